@@ -0,0 +1,273 @@
+/*
+ * Microbenchmark for the maze accessors.
+ *
+ * Usage: maze_bench [rows [cols [iterations [threads]]]]
+ *
+ * A maze of the given size is generated with corridors one unit wide
+ * between walls with regularly spaced doors, 26 avatars are placed in it,
+ * and maze_get_view(), maze_find_target() and maze_move() are each timed
+ * from random positions, followed by removing avatars and placing them
+ * again at random.  The generator and the random positions are
+ * seeded with a constant, so runs are comparable.
+ *
+ * The views are then timed again with several threads computing them while
+ * another thread keeps moving the avatars, first with the queries taking
+ * the maze lock and then with them reading optimistically.
+ *
+ * Finally the avatars are moved from one thread and then from several,
+ * each moving its own avatars: with the maze divided into 64x64 tiles,
+ * with a single tile covering the whole maze, which is the default, and
+ * in lock-free mode.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "maze.h"
+
+#define NAVATARS 26
+
+typedef struct {
+    int row, col;
+} POS;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Walls on every fourth row and every sixth column, with a door every few cells
+static char **make_template(int rows, int cols) {
+    char **template = malloc((rows + 1) * sizeof *template);
+    for (int r = 0; r < rows; r++) {
+        template[r] = malloc(cols + 1);
+        for (int c = 0; c < cols; c++) {
+            int border = r == 0 || c == 0 || r == rows - 1 || c == cols - 1;
+            int hwall = r % 4 == 0 && c % 7 != 3;
+            int vwall = c % 6 == 0 && r % 5 != 2;
+            template[r][c] = border ? '@' : hwall ? '*' : vwall ? '%' : ' ';
+        }
+        template[r][cols] = '\0';
+    }
+    template[rows] = NULL;
+    return template;
+}
+
+// Collect the empty cells of the template, to start queries from
+static POS *empty_cells(char **template, int rows, int cols, int *countp) {
+    POS *cells = malloc((size_t)rows * cols * sizeof *cells);
+    int n = 0;
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            if (IS_EMPTY(template[r][c])) cells[n++] = (POS){r, c};
+        }
+    }
+    *countp = n;
+    return cells;
+}
+
+static struct {
+    POS *starts;
+    DIRECTION *dirs;
+    POS *avatars;
+    long per_thread;
+    int done; // set when the readers have finished, to stop the mover
+    long moves;
+    int movers; // threads moving avatars, in the scaling test
+} contention;
+
+static void *reader_thread(void *arg) {
+    long first = (long)arg * contention.per_thread;
+    char view[VIEW_DEPTH][VIEW_WIDTH];
+    for (long i = first; i < first + contention.per_thread; i++) {
+        maze_get_view((VIEW *)view, contention.starts[i].row, contention.starts[i].col, contention.dirs[i], VIEW_DEPTH);
+    }
+    return NULL;
+}
+
+static void *mover_thread(void *arg) {
+    unsigned seed = 1;
+    long moves = 0;
+    while (!__atomic_load_n(&contention.done, __ATOMIC_ACQUIRE)) {
+        POS *p = &contention.avatars[moves % NAVATARS];
+        DIRECTION d = rand_r(&seed) % NUM_DIRECTIONS;
+        if (maze_move(p->row, p->col, d) == 0) {
+            p->row += d == NORTH ? -1 : d == SOUTH ? 1 : 0;
+            p->col += d == WEST ? -1 : d == EAST ? 1 : 0;
+        }
+        moves++;
+    }
+    contention.moves = moves;
+    return NULL;
+}
+
+static void *move_thread(void *arg) {
+    long t = (long)arg;
+    unsigned seed = t + 1;
+    for (long i = 0; i < contention.per_thread; i++) {
+        POS *p = &contention.avatars[(t + i * contention.movers) % NAVATARS];
+        DIRECTION d = rand_r(&seed) % NUM_DIRECTIONS;
+        if (maze_move(p->row, p->col, d) == 0) {
+            p->row += d == NORTH ? -1 : d == SOUTH ? 1 : 0;
+            p->col += d == WEST ? -1 : d == EAST ? 1 : 0;
+        }
+    }
+    return NULL;
+}
+
+// Time moves from several threads, each moving the avatars whose index is its own modulo threads
+static unsigned long scale(int threads) {
+    pthread_t movers[threads];
+    contention.movers = threads;
+    unsigned long start = now_ns();
+    for (long t = 0; t < threads; t++) {
+        pthread_create(&movers[t], NULL, move_thread, (void *)t);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(movers[t], NULL);
+    }
+    return now_ns() - start;
+}
+
+static int place_avatars(POS *avatars) {
+    for (int i = 0; i < NAVATARS; i++) {
+        if (maze_set_player_random('A' + i, &avatars[i].row, &avatars[i].col)) {
+            fprintf(stderr, "Could not place avatar %c\n", 'A' + i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Time views from several threads while one thread moves avatars, return the ns per view
+static unsigned long contend(int threads, int locked) {
+    pthread_t readers[threads], mover;
+    maze_set_locked_reads(locked);
+    contention.done = 0;
+    pthread_create(&mover, NULL, mover_thread, NULL);
+    unsigned long start = now_ns();
+    for (long t = 0; t < threads; t++) {
+        pthread_create(&readers[t], NULL, reader_thread, (void *)t);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(readers[t], NULL);
+    }
+    unsigned long ns = now_ns() - start;
+    __atomic_store_n(&contention.done, 1, __ATOMIC_RELEASE);
+    pthread_join(mover, NULL);
+    maze_set_locked_reads(0);
+    return ns;
+}
+
+static void report(const char *what, unsigned long ns, long iterations, const char *extra) {
+    printf("%-12s %10ld ops %8.1f ns/op  %s\n", what, iterations, (double)ns / iterations, extra);
+}
+
+int main(int argc, char *argv[]) {
+    int rows = argc > 1 ? atoi(argv[1]) : 1000;
+    int cols = argc > 2 ? atoi(argv[2]) : 1000;
+    long iterations = argc > 3 ? atol(argv[3]) : 2000000;
+    int threads = argc > 4 ? atoi(argv[4]) : 4;
+    if (rows < 3 || cols < 3 || iterations < 1 || threads < 1) {
+        fprintf(stderr, "Usage: %s [rows [cols [iterations [threads]]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char **template = make_template(rows, cols);
+    int nempty;
+    POS *empties = empty_cells(template, rows, cols, &nempty);
+    maze_init(template);
+    srand(1);
+    POS avatars[NAVATARS];
+    if (place_avatars(avatars)) return EXIT_FAILURE;
+    POS *starts = malloc(iterations * sizeof *starts);
+    DIRECTION *dirs = malloc(iterations * sizeof *dirs);
+    for (long i = 0; i < iterations; i++) {
+        starts[i] = empties[rand() % nempty];
+        dirs[i] = rand() % NUM_DIRECTIONS;
+    }
+    printf("maze %dx%d, %d avatars\n", rows, cols, NAVATARS);
+
+    char view[VIEW_DEPTH][VIEW_WIDTH];
+    long depths = 0;
+    unsigned long start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        depths += maze_get_view((VIEW *)view, starts[i].row, starts[i].col, dirs[i], VIEW_DEPTH);
+    }
+    char extra[64];
+    snprintf(extra, sizeof extra, "(avg depth %.2f)", (double)depths / iterations);
+    report("get_view", now_ns() - start, iterations, extra);
+
+    long hits = 0;
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        hits += maze_find_target(starts[i].row, starts[i].col, dirs[i]) != EMPTY;
+    }
+    snprintf(extra, sizeof extra, "(%ld hits)", hits);
+    report("find_target", now_ns() - start, iterations, extra);
+
+    long moved = 0;
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        POS *p = &avatars[i % NAVATARS];
+        DIRECTION d = dirs[i];
+        if (maze_move(p->row, p->col, d) == 0) {
+            p->row += d == NORTH ? -1 : d == SOUTH ? 1 : 0;
+            p->col += d == WEST ? -1 : d == EAST ? 1 : 0;
+            moved++;
+        }
+    }
+    snprintf(extra, sizeof extra, "(%ld moved)", moved);
+    report("move", now_ns() - start, iterations, extra);
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        POS *p = &avatars[i % NAVATARS];
+        maze_remove_player('A' + i % NAVATARS, p->row, p->col);
+        maze_set_player_random('A' + i % NAVATARS, &p->row, &p->col);
+    }
+    report("respawn", now_ns() - start, iterations, "");
+
+    contention.starts = starts;
+    contention.dirs = dirs;
+    contention.avatars = avatars;
+    contention.per_thread = iterations / threads;
+    long views = contention.per_thread * threads;
+    printf("%d view threads, 1 move thread\n", threads);
+    unsigned long ns = contend(threads, 1);
+    snprintf(extra, sizeof extra, "(%ld moves alongside)", contention.moves);
+    report("locked", ns, views, extra);
+    unsigned long retries = maze_get_read_retries();
+    ns = contend(threads, 0);
+    snprintf(extra, sizeof extra, "(%ld moves alongside, %lu retries)", contention.moves, maze_get_read_retries() - retries);
+    report("optimistic", ns, views, extra);
+
+    struct {
+        const char *name;
+        int tile_size, lock_free;
+    } configs[] = {{"64x64 tiles", 64, 0}, {"one tile", MAZE_TILE_WHOLE, 0}, {"lock-free", 64, 1}};
+    for (int s = 0; s < 3; s++) {
+        maze_fini();
+        maze_set_tile_size(configs[s].tile_size);
+        maze_set_lock_free(configs[s].lock_free);
+        maze_init(template);
+        if (place_avatars(avatars)) return EXIT_FAILURE;
+        printf("%s\n", configs[s].name);
+        for (int t = 1; t <= threads; t = t < threads && t * 2 > threads ? threads : t * 2) {
+            contention.per_thread = iterations / t;
+            ns = scale(t);
+            snprintf(extra, sizeof extra, "(%d move threads)", t);
+            report("move", ns, contention.per_thread * t, extra);
+        }
+    }
+
+    maze_fini();
+    for (int r = 0; r < rows; r++) free(template[r]);
+    free(template);
+    free(empties);
+    free(starts);
+    free(dirs);
+    return EXIT_SUCCESS;
+}
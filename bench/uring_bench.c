@@ -0,0 +1,159 @@
+/*
+ * Microbenchmark for the io_uring network backend against plain system calls.
+ *
+ * Usage: uring_bench [iterations [pairs]]
+ *
+ * Packets of PACKET_SIZE bytes are sent over Unix domain socket pairs,
+ * first with writev() and read(), then with uring_writev() and uring_read().
+ *
+ * The fan-out test writes one packet to each of several sockets in turn
+ * from a single thread, as the server does when a move changes the views
+ * of several players; each socket is drained by a thread of its own with
+ * read(), outside the timing.  The ping-pong test runs several pairs of
+ * threads, each pair sending a packet back and forth, so that reads wait
+ * for the peer and several threads use the ring at once.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define PACKET_SIZE 64
+
+static int use_uring;
+static long iterations;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void send_packet(int fd, char *buf) {
+    struct iovec iov = {buf, PACKET_SIZE};
+    ssize_t n = use_uring ? uring_writev(fd, &iov, 1) : writev(fd, &iov, 1);
+    if (n != PACKET_SIZE) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void recv_packet(int fd, char *buf) {
+    size_t got = 0;
+    while (got < PACKET_SIZE) {
+        ssize_t n = use_uring ? uring_read(fd, buf + got, PACKET_SIZE - got) : read(fd, buf + got, PACKET_SIZE - got);
+        if (n <= 0) {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        got += n;
+    }
+}
+
+// Read and discard until the writer closes its end
+static void *drain_thread(void *arg) {
+    int fd = (long)arg;
+    char buf[4096];
+    while (read(fd, buf, sizeof buf) > 0);
+    return NULL;
+}
+
+// Time one thread writing a packet to each socket in turn, return the ns per write
+static double fan_out(int sockets) {
+    int fds[sockets][2];
+    pthread_t drains[sockets];
+    for (int i = 0; i < sockets; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        pthread_create(&drains[i], NULL, drain_thread, (void *)(long)fds[i][1]);
+    }
+    char buf[PACKET_SIZE] = {0};
+    long rounds = iterations / sockets;
+    unsigned long start = now_ns();
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < sockets; i++) send_packet(fds[i][0], buf);
+    }
+    unsigned long ns = now_ns() - start;
+    for (int i = 0; i < sockets; i++) {
+        close(fds[i][0]);
+        pthread_join(drains[i], NULL);
+        close(fds[i][1]);
+    }
+    return (double)ns / (rounds * sockets);
+}
+
+static void *ping_thread(void *arg) {
+    int fd = (long)arg;
+    char buf[PACKET_SIZE] = {0};
+    for (long i = 0; i < iterations; i++) {
+        send_packet(fd, buf);
+        recv_packet(fd, buf);
+    }
+    return NULL;
+}
+
+static void *pong_thread(void *arg) {
+    int fd = (long)arg;
+    char buf[PACKET_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        recv_packet(fd, buf);
+        send_packet(fd, buf);
+    }
+    return NULL;
+}
+
+// Time pairs of threads bouncing a packet between them, return the ns per round trip
+static double ping_pong(int pairs) {
+    int fds[pairs][2];
+    pthread_t pings[pairs], pongs[pairs];
+    for (int i = 0; i < pairs; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned long start = now_ns();
+    for (int i = 0; i < pairs; i++) {
+        pthread_create(&pongs[i], NULL, pong_thread, (void *)(long)fds[i][1]);
+        pthread_create(&pings[i], NULL, ping_thread, (void *)(long)fds[i][0]);
+    }
+    for (int i = 0; i < pairs; i++) {
+        pthread_join(pings[i], NULL);
+        pthread_join(pongs[i], NULL);
+    }
+    unsigned long ns = now_ns() - start;
+    for (int i = 0; i < pairs; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    return (double)ns / (iterations * pairs);
+}
+
+int main(int argc, char *argv[]) {
+    iterations = argc > 1 ? atol(argv[1]) : 200000;
+    int pairs = argc > 2 ? atoi(argv[2]) : 4;
+    if (iterations < 1 || pairs < 1) {
+        fprintf(stderr, "Usage: %s [iterations [pairs]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("%d byte packets, fan-out to 8 sockets, %d ping-pong pairs\n", PACKET_SIZE, pairs);
+    for (use_uring = 0; use_uring <= 1; use_uring++) {
+        if (use_uring && uring_init(URING_ENTRIES) < 0) {
+            perror("uring_init");
+            return EXIT_FAILURE;
+        }
+        const char *name = use_uring ? "uring" : "rw";
+        printf("%-6s fan-out    %8.1f ns/write\n", name, fan_out(8));
+        printf("%-6s ping-pong  %8.1f ns/round trip (1 pair)\n", name, ping_pong(1));
+        printf("%-6s ping-pong  %8.1f ns/round trip (%d pairs)\n", name, ping_pong(pairs), pairs);
+        if (use_uring) uring_fini();
+    }
+    return EXIT_SUCCESS;
+}
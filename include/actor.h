@@ -0,0 +1,126 @@
+#ifndef ACTOR_H
+#define ACTOR_H
+
+#include "protocol.h"
+#include "player.h"
+
+/*
+ * The actor module provides an optional mode in which a single simulation
+ * thread, the actor, exclusively owns the game state.  Normally every
+ * thread serving a client changes the maze and the players itself, taking
+ * the maze lock, the players lock and the per-player locks in whatever
+ * order its request needs.  In actor mode, the threads serving clients
+ * only decode packets and push them as commands onto a lock-free
+ * multi-producer, single-consumer queue; the actor pops them and carries
+ * them out one at a time, so no two game-state operations ever
+ * interleave.  The actor still goes through the same player and maze
+ * functions, so it still takes the maze, players and per-player locks;
+ * they are just never contended by another thread changing the game.
+ *
+ * The results of commands reach clients through the players' outbound
+ * queues (see player_set_queue_depth()), which actor mode turns on, so
+ * that the actor never blocks writing to a slow client.  That includes
+ * the READY reply to a LOGIN; the INUSE reply to a refused one is sent
+ * by the thread serving the client, once the actor is done.  Commands drained
+ * from the queue together are applied with view updates put off until the
+ * end (see player_view_batch_begin()), so each view is recomputed once per
+ * batch.
+ *
+ * Laser hits are applied by the actor as soon as the laser has been fired
+ * (see player_set_hit_handler()), and respawns are handed from the timer
+ * thread to the actor as commands, so threads serving clients must not
+ * take hits themselves in this mode.
+ */
+
+/*
+ * Maximum number of commands applied in one batch.
+ */
+#define ACTOR_MAX_BATCH 256
+
+/*
+ * Outbound queue depth given to players in actor mode, unless a depth
+ * has been set explicitly.
+ */
+#define ACTOR_QUEUE_DEPTH 1024
+
+/*
+ * Statistics for the actor.  Times are in nanoseconds, measured on
+ * CLOCK_MONOTONIC.
+ */
+typedef struct actor_stats {
+    unsigned long commands;      // Commands carried out
+    unsigned long batches;       // Wakeups of the actor
+    int max_batch;               // Largest number of commands applied in one batch
+    unsigned long views;         // Views recomputed at the end of batches
+    unsigned long wait_ns_total; // Time from a command being pushed to it being carried out
+    unsigned long wait_ns_max;
+} ACTOR_STATS;
+
+/*
+ * Start the actor thread.
+ *
+ * The actor blocks SIGHUP, so that termination is handled by the main
+ * thread.
+ */
+void actor_init(void);
+
+/*
+ * Determine whether actor mode is in effect.
+ *
+ * @return nonzero if actor_init() has been called, otherwise zero.
+ */
+int actor_enabled(void);
+
+/*
+ * Have the actor carry out the request contained in a packet, as
+ * mzw_handle_packet() would.
+ *
+ * @param connfd  The file descriptor for the client connection.
+ * @param playerp  Pointer to the variable holding the client's PLAYER,
+ * or NULL before LOGIN.
+ * @param pkt  The packet received, in host byte order.
+ * @param data  The payload of the packet, or NULL.  It is copied if the
+ * actor needs it after the call returns.
+ *
+ * Before LOGIN the call waits for the actor to carry out the packet,
+ * since its outcome decides whether *playerp is set.  After LOGIN it
+ * returns as soon as the command has been queued.
+ */
+void actor_handle_packet(int connfd, PLAYER **playerp, MZW_PACKET *pkt, void *data);
+
+/*
+ * Have the actor log a player out, waiting until it has done so.
+ *
+ * @param player  The player, as for player_logout().
+ *
+ * Commands already queued for the player are carried out first.  The
+ * actor only takes the player out of the game (player_leave()); what is
+ * left of its output is sent by the calling thread (player_close()), so
+ * a client that has stopped reading cannot hold up the actor.
+ */
+void actor_logout(PLAYER *player);
+
+/*
+ * Have the actor take a player out of the game, waiting until it has
+ * done so.
+ *
+ * @param player  The player, as for player_leave().
+ *
+ * This is the actor's half of actor_logout(), for a caller that finishes
+ * the logout with player_close() elsewhere.
+ */
+void actor_leave(PLAYER *player);
+
+/*
+ * Get a snapshot of the actor statistics.
+ *
+ * @param stats  Pointer to storage to receive the statistics.
+ */
+void actor_get_stats(ACTOR_STATS *stats);
+
+/*
+ * Log the actor statistics.
+ */
+void actor_report(void);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/*
+ * The event loop module is an alternative to running one service thread
+ * per client connection.  A small, fixed set of threads each run an epoll
+ * loop over many connections.  Packets are received without blocking,
+ * parsed incrementally as their bytes arrive, and dispatched through
+ * mzw_handle_packet() to the same player functions used by the service
+ * threads, so the two modes can be compared under the same load.
+ *
+ * Connections are registered with the client registry in the same way as
+ * for service threads, so creg_shutdown_all() and creg_wait_for_empty()
+ * work unchanged to terminate the server.
+ *
+ * A loop thread never waits on a client.  Every player is given an
+ * outbound queue (see player_set_queue_depth()), so what a loop sends is
+ * written by the player's writer thread, and a client that stops reading
+ * holds up only that thread.  When a connection shuts down, the loop only
+ * takes the player out of the game; draining the rest of its output and
+ * closing the connection are left to a thread of their own.
+ */
+
+/*
+ * Outbound queue depth given to players when event loops are in use,
+ * unless a depth has been set explicitly.
+ */
+#define EVL_QUEUE_DEPTH 1024
+
+/*
+ * Maximum number of event loops that will be started.
+ */
+#define EVL_MAX_LOOPS 8
+
+/*
+ * Start the event loops.
+ *
+ * @param nloops  The number of event loop threads to start, which is
+ * clamped to the range [1, EVL_MAX_LOOPS].
+ *
+ * This must be called before evl_add_client().
+ */
+void evl_init(int nloops);
+
+/*
+ * Hand a newly accepted client connection over to one of the event loops.
+ *
+ * @param connfd  The file descriptor for the client connection.  The
+ * event loop takes ownership of the descriptor and closes it when the
+ * connection shuts down.
+ */
+void evl_add_client(int connfd);
+
+/*
+ * Hand a newly accepted client connection over to a particular event loop.
+ *
+ * @param index  The event loop, taken modulo the number of loops.  This
+ * allows callers that accept connections on several threads to keep each
+ * one's connections on its own loop.
+ * @param connfd  The file descriptor for the client connection, as for
+ * evl_add_client().
+ */
+void evl_add_client_to(int index, int connfd);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/*
+ * The listener module is an alternative to accepting every connection on
+ * a single socket in the main thread.  It opens several listening sockets
+ * on the same port with SO_REUSEPORT, so that the kernel spreads incoming
+ * connections across them, and runs a separate accept thread on each.
+ * Each listener is meant to correspond to one CPU core: when pinning is
+ * requested, the accept thread is bound to its core and the service
+ * threads it creates inherit the binding, so a connection is accepted and
+ * served on the same core without sharing an accept queue with the others.
+ * A burst of connections at the start of a match is then accepted in
+ * parallel instead of queuing up behind one thread.
+ *
+ * Accepted connections are served in the same way as by the main accept
+ * loop: by a new service thread, by one of the event loops, or by the
+ * worker pool if one has been set up.  In the last case, listener i has
+ * slice i of the pool to itself, and starts its workers.
+ *
+ * A listener can also be opened on an AF_UNIX stream socket, for clients
+ * such as bots and load generators running on the same host.  These speak
+ * the same protocol over the same service path, without the cost of the
+ * TCP loopback stack.
+ */
+
+/*
+ * Maximum number of listeners that will be started.
+ */
+#define LSN_MAX_LISTENERS 64
+
+/*
+ * Statistics kept for each listener.
+ */
+typedef struct lsn_stats {
+    int cpu;                 // Core the listener is pinned to, or -1 if not pinned
+    unsigned long accepted;  // Connections accepted since the listener started
+    unsigned long failed;    // Accepts that failed, e.g. for want of descriptors
+    int active;              // Connections accepted by this listener still being served
+                             // (counted only when each connection gets a new service thread)
+    int peak;                // Largest value of active
+    double rate;             // Average accepts per second since the listener started
+} LSN_STATS;
+
+/*
+ * Open the listening sockets and start an accept thread on each.
+ *
+ * @param port  The port on which to listen.
+ * @param nlisteners  The number of listeners, clamped to the range
+ * [1, LSN_MAX_LISTENERS].
+ * @param pin  Nonzero if listener i and the threads serving its
+ * connections should be bound to CPU core i (modulo the number of cores).
+ * @param event_loops  Nonzero if accepted connections are to be handed to
+ * the event loops (listener i feeding loop i, modulo the number of loops),
+ * which must already have been started, rather than to service threads.
+ * @return the number of listeners started.  The server exits if the
+ * sockets cannot be opened.
+ *
+ * The accept threads block SIGHUP, so that the main thread, which is
+ * expected to wait for it, can terminate the server.
+ */
+int lsn_start(char *port, int nlisteners, int pin, int event_loops);
+
+/*
+ * Open a listening AF_UNIX stream socket and start an accept thread on it,
+ * in addition to any other listeners.
+ *
+ * @param path  The path of the socket, which must remain valid while the
+ * server runs.  A socket already at this path, left behind by an earlier
+ * server, is replaced; anything else there makes the call fail.
+ * @param event_loops  As for lsn_start().
+ * @return zero if the listener was started, otherwise -1, with errno set.
+ *
+ * This may be called at most once, after lsn_start() if that is called
+ * at all.  The listener is counted after the TCP listeners in the
+ * statistics, and is never pinned.
+ */
+int lsn_start_unix(char *path, int event_loops);
+
+/*
+ * Remove the socket file of the AF_UNIX listener, if one was started.
+ */
+void lsn_fini(void);
+
+/*
+ * Get a snapshot of the statistics for one listener.
+ *
+ * @param index  The listener, from zero to one less than the number started.
+ * @param stats  Pointer to storage to receive the statistics.
+ * @return zero if successful, nonzero if there is no such listener.
+ */
+int lsn_get_stats(int index, LSN_STATS *stats);
+
+/*
+ * Log the statistics of all listeners, including each one's share of the
+ * connections accepted.
+ */
+void lsn_report(void);
+
+#endif
@@ -148,8 +148,11 @@ int maze_set_player(OBJECT avatar, int row, int col);
  * at which the avatar was placed.
  * @return zero if the placement was successful, nonzero otherwise.
  *
- * The placement can fail if after a large number of attempts an unoccupied
- * location has not been found.
+ * The placement fails only if the maze has no unoccupied location.  The
+ * location is picked from a list of the cells that are not walls, and the
+ * pick is taken only if the cell is still empty, so placement takes the
+ * same time whatever the size of the maze, until the maze is nearly full
+ * and the list has to be walked.
  */
 int maze_set_player_random(OBJECT avatar, int *rowp, int *colp);
 
@@ -212,6 +215,84 @@ OBJECT maze_find_target(int row, int col, DIRECTION dir);
  */
 int maze_get_view(VIEW *view, int row, int col, DIRECTION gaze, int depth);
 
+/*
+ * The maze is divided into square tiles, each with its own lock.  Changes
+ * to the maze lock only the tiles of the cells they change, so that, for
+ * example, two moves on opposite sides of a large maze go ahead at once;
+ * a move across the edge of a tile locks both tiles, in a fixed order.
+ *
+ * Queries of the maze (maze_get_view(), maze_find_target() and show_maze())
+ * do not normally lock anything.  Each tile has a version number that a
+ * change advances while it changes cells; a query copies the cells it needs
+ * and starts over if the version of a tile it read moved meanwhile, so that
+ * views are never torn and queries never wait for one another.
+ *
+ * maze_set_player_random() picks from a list of the cells that are not
+ * walls, which is fixed when the maze is made, so that changes have no
+ * index to keep up to date and take no lock besides those of their tiles.
+ */
+
+/*
+ * Have changes to the maze use atomic compare-and-swap on the cells instead
+ * of the tile locks, so that no change ever waits for another.  A move
+ * claims the destination cell if it is still empty, which is the moment it
+ * takes effect, and then releases the source cell.  Queries are not
+ * affected: they still see each move happen all at once.
+ *
+ * @param lock_free  Nonzero for lock-free changes, zero for the tile locks.
+ *
+ * This must be called before any thread other than the caller uses the
+ * maze.  In lock-free mode, each avatar must be moved and removed by only
+ * one thread at a time, as the player module does.
+ */
+void maze_set_lock_free(int lock_free);
+
+/*
+ * Tile side that makes a single tile of any maze, the default.
+ */
+#define MAZE_TILE_WHOLE (1 << 30)
+
+/*
+ * Set the side of the tiles, in cells, for the next call of maze_init().
+ *
+ * @param size  The side of a tile.  It is rounded up to a power of two.
+ * A size at least as large as the maze gives a single tile, so that all
+ * changes to the maze are serialized, which is the default.  Smaller
+ * tiles, such as 64, let moves in different parts of the maze go ahead
+ * at once, but each query then checks every tile it reads.
+ */
+void maze_set_tile_size(int size);
+
+/*
+ * Have maze_get_view() and maze_find_target() lock the tiles they scan
+ * instead of reading optimistically.  This is meant for measuring one
+ * scheme against the other, and has no effect in lock-free mode.
+ *
+ * @param locked  Nonzero to take the locks, zero to read optimistically.
+ */
+void maze_set_locked_reads(int locked);
+
+/*
+ * Get the number of times an optimistic query had to start over because
+ * the maze changed while it was reading.
+ *
+ * @return the number of retries since the program started.
+ */
+unsigned long maze_get_read_retries(void);
+
+/*
+ * Copy the whole maze, as it was at one moment.
+ *
+ * @param buf  Storage for maze_get_rows() * maze_get_cols() objects, which
+ * receives the rows one after another.
+ *
+ * Changes made while the copy is taken make it start over, so every cell
+ * is seen as of the same moment, in lock-free mode as well.  This is meant
+ * for checking the maze, and is too slow to be called often on a large
+ * one.
+ */
+void maze_snapshot(OBJECT *buf);
+
 /*
  * Print a view on stderr, for debugging.
  *
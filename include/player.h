@@ -65,7 +65,10 @@ PLAYER *player_login(int clientfd, OBJECT avatar, char *name);
  *
  * The specified player is removed from the maze and from the players map
  * and a SCORE packet with a score of -1 is sent to the client to cause the
- * player's score to be removed from the scoreboard area.
+ * player's score to be removed from the scoreboard area.  A respawn that
+ * is pending because the player was hit is cancelled.  The SCORE packets
+ * are sent without holding up logins, but the player's avatar is not
+ * given to anyone logging in until they have been sent.
  * This function "consumes" one reference to the PLAYER object by calling
  * player_unref().  This will have the effect of causing the PLAYER object
  * to be freed as soon as any references to it currently held by other threads
@@ -73,6 +76,25 @@ PLAYER *player_login(int clientfd, OBJECT avatar, char *name);
  */
 void player_logout(PLAYER *player);
 
+/*
+ * The two halves of player_logout(), for a server in which the player
+ * leaves the game on a thread that must not wait on the client's
+ * connection, such as the actor thread.
+ *
+ * player_leave() removes the player from the maze and from the players
+ * map and sends the SCORE packets, as player_logout() does, but neither
+ * finishes the player's own output nor releases a reference.
+ *
+ * player_close() is then called by the thread serving the client.  It
+ * sends what is still buffered or queued for the player, waits for the
+ * outbound queue to drain, and releases the reference as player_logout()
+ * does.  A client that takes nothing for PLAYER_DRAIN_MS (see player.c)
+ * while the queue drains has its connection shut down for writing, and
+ * is sent nothing more.
+ */
+void player_leave(PLAYER *player);
+void player_close(PLAYER *player);
+
 /*
  * Reset a player to a random location in the maze.
  *
@@ -146,6 +168,10 @@ void player_unref(PLAYER *player, char *why);
  * Since this can happen concurrently, we need to synchronize access to
  * the network connection to that client.
  *
+ * If the player has an outbound queue (see player_set_queue_depth()), the
+ * packet is instead queued for the player's writer thread, and the call
+ * does not wait for the connection at all.
+ *
  * NOTE: This function will lock the mutex associated with the PLAYER
  * object passed, for the duration of the call.  Since PLAYER mutexes are
  * recursive, it is OK for a thread to call this function while holding
@@ -154,6 +180,293 @@ void player_unref(PLAYER *player, char *why);
  */
 int player_send_packet(PLAYER *player, MZW_PACKET *pkt, void *data);
 
+/*
+ * Send a packet to the client for a player, with its payload gathered
+ * from several buffers.
+ *
+ * @param player  The PLAYER object corresponding to the client who should
+ * receive the packet.
+ * @param pkt  The packet to be sent, whose size field is the total length
+ * of the fragments.
+ * @param iov  The payload fragments, in order.
+ * @param iovcnt  The number of fragments, at most PROTO_MAX_FRAGMENTS.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ *
+ * This is the same as player_send_packet(), except that the payload is
+ * passed on to proto_send_packetv() without first being copied into a
+ * single buffer.
+ */
+int player_send_packetv(PLAYER *player, MZW_PACKET *pkt, struct iovec *iov, int iovcnt);
+
+/*
+ * Send the READY packet that accepts a LOGIN, and switch the connection
+ * to the protocol version negotiated for everything that follows.
+ *
+ * @param player  The player who has just logged in.
+ * @param pkt  The READY packet.
+ * @param version  The protocol version from now on.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ *
+ * READY itself is always encoded in version 1.  Other threads may already
+ * be sending to the player, since it was published by player_login(): what
+ * they have sent or buffered before the call goes out ahead of READY, in
+ * version 1, and what they send after it follows READY in the new version.
+ * If the player has an outbound queue, READY is encoded at once and queued
+ * behind what is already there, so the call does not wait for the
+ * connection.  The connection then receives in the new version at once,
+ * but only sends in it once the writer thread has written READY.
+ */
+int player_send_ready(PLAYER *player, MZW_PACKET *pkt, int version);
+
+/*
+ * Send the same packet to the clients of every player logged in.
+ *
+ * @param pkt  The packet to be sent, whose size field is the total length
+ * of the fragments.  Its timestamp is filled in.
+ * @param iov  The payload fragments, in order.
+ * @param iovcnt  The number of fragments.
+ * @return the number of players the packet was sent to.
+ *
+ * The packet is timestamped and encoded once, into a PROTO_FRAME that is
+ * then handed to each player in turn: written straight away, added to a
+ * batch, or queued by reference for the player's writer thread, the last
+ * of which frees it.  The players are found without holding the lock on
+ * the set of players while the packet is sent.  Failures to send to
+ * particular players are ignored, as their service threads find out for
+ * themselves.
+ */
+int player_broadcast(MZW_PACKET *pkt, struct iovec *iov, int iovcnt);
+
+/*
+ * Set the capacity of the outbound queue given to each player that logs in
+ * from now on.
+ *
+ * @param depth  The maximum number of packets that may be queued for a
+ * player, or zero (the default) for no queue.
+ *
+ * Without a queue, player_send_packet() writes to the client's connection
+ * before returning, so a client that is slow to read stalls every thread
+ * sending to it.  With a queue, player_send_packet() only copies the packet
+ * into the player's queue, and a writer thread dedicated to that player
+ * drains the queue onto the connection.  Packets are written in the order
+ * they were queued.  If the queue is full, or the connection has failed,
+ * the packet is dropped and player_send_packet() returns nonzero.
+ * Packets still queued when the player logs out are written before
+ * player_logout() returns, unless the client takes none of them for
+ * PLAYER_DRAIN_MS, in which case the rest are dropped.
+ *
+ * View updates for a player with a queue are the exception: only the
+ * newest is kept, and a single entry in the queue stands for it.  When
+ * the writer thread reaches that entry it sends the changes from the last
+ * view it actually sent to the newest one, so a client that falls behind
+ * skips the views in between rather than receiving every one of them.
+ */
+void player_set_queue_depth(int depth);
+
+/*
+ * Statistics kept for a player's outbound queue.  Latencies are measured
+ * on CLOCK_MONOTONIC, in nanoseconds.
+ */
+typedef struct player_queue_stats {
+    int depth;                      // Packets currently queued
+    int max_depth;                  // Largest number of packets ever queued at once
+    unsigned long enqueued;         // Packets accepted into the queue
+    unsigned long sent;             // Packets written to the client
+    unsigned long dropped;          // Packets refused or discarded after a write failure
+    unsigned long enqueue_ns_total; // Time spent by senders in player_send_packet()
+    unsigned long enqueue_ns_max;
+    unsigned long flush_ns_total;   // Time from being queued until written
+    unsigned long flush_ns_max;
+} PLAYER_QUEUE_STATS;
+
+/*
+ * Get a snapshot of the statistics for a player's outbound queue.
+ *
+ * @param player  The player whose statistics are wanted.
+ * @param stats  Pointer to storage to receive the statistics.
+ * @return zero if the player has an outbound queue, otherwise nonzero.
+ */
+int player_get_queue_stats(PLAYER *player, PLAYER_QUEUE_STATS *stats);
+
+/*
+ * What is done about a client that is not reading what is sent to it.
+ */
+typedef enum {
+    PLAYER_SLOW_NONE,      // Nothing: sends wait for the client, or fail once its queue is full
+    PLAYER_SLOW_DROP,      // Packets are discarded until the client catches up
+    PLAYER_SLOW_CONFLATE,  // View packets are discarded, and the next view once it catches up is full
+    PLAYER_SLOW_DISCONNECT // The connection is shut down
+} PLAYER_SLOW_POLICY;
+
+/*
+ * Default watermarks, in bytes of output pending for a client.
+ */
+#define PLAYER_HIGH_WATERMARK (64 * 1024)
+#define PLAYER_LOW_WATERMARK (16 * 1024)
+
+/*
+ * Set how clients that fall behind are dealt with.
+ *
+ * @param policy  What is done while a client is behind.
+ * @param high  A client is behind once this many bytes are pending for it.
+ * @param low  It has caught up once no more than this many are, which is
+ * to be less than high.
+ *
+ * The bytes pending for a client are those in its batch buffer and
+ * outbound queue, and those the kernel holds in the socket send buffer
+ * (SIOCOUTQ).  They are checked as each packet is sent on its own, and
+ * once per write of a batch buffer for packets that are batched.  Without
+ * an outbound queue, the high watermark is lowered to what the socket
+ * send buffer holds, so that the client is found to be behind before a
+ * send would block.  Without a policy, a client that stops reading
+ * eventually blocks every thread that sends to it, while holding whatever
+ * locks that thread holds.
+ *
+ * A disconnected client's connection is shut down, not closed: the thread
+ * serving it sees the end of the connection and logs the player out and
+ * unregisters the client as if the client had left.
+ */
+void player_set_slow_policy(PLAYER_SLOW_POLICY policy, size_t high, size_t low);
+
+/*
+ * Counters for slow clients, accumulated over all players.
+ */
+typedef struct player_slow_stats {
+    unsigned long congested;    // Times a client went over the high watermark
+    unsigned long recovered;    // Times one came back under the low watermark
+    unsigned long dropped;      // Packets discarded under PLAYER_SLOW_DROP
+    unsigned long conflated;    // View packets discarded under PLAYER_SLOW_CONFLATE
+    unsigned long disconnected; // Connections shut down under PLAYER_SLOW_DISCONNECT
+} PLAYER_SLOW_STATS;
+
+/*
+ * Get a snapshot of the slow client counters.
+ *
+ * @param stats  Pointer to storage to receive the counters.
+ */
+void player_get_slow_stats(PLAYER_SLOW_STATS *stats);
+
+/*
+ * Begin batching the output of the calling thread.
+ *
+ * Until player_batch_end() is called, packets this thread sends with
+ * player_send_packet() are not written immediately, but are appended to
+ * an output buffer kept for the receiving player.  This is meant to
+ * bracket the handling of one inbound packet: a single MOVE can produce
+ * a CLEAR and dozens of SHOW packets for every player in view, and each
+ * of those would otherwise be a separate system call and, often, a
+ * separate TCP segment.
+ *
+ * Output is still delivered in order: an unbatched send to a player first
+ * writes out whatever other threads have buffered for that player.  Players
+ * with an outbound queue (see player_set_queue_depth()) are not affected.
+ * A thread must not block while batching, since its output is held back.
+ */
+void player_batch_begin(void);
+
+/*
+ * End batching for the calling thread and write out, with a single system
+ * call per player, everything buffered for the players it sent packets to.
+ *
+ * @return 0 if all writes succeeded, -1 otherwise.
+ */
+int player_batch_end(void);
+
+/*
+ * Begin putting off the view updates made by the calling thread.
+ *
+ * Until player_view_batch_end() is called, player_update_view() called by
+ * this thread only notes that the player's view needs to be updated.
+ * Applying many inputs in a row, each of which would otherwise recompute
+ * and send the view of every player, then costs one view computation per
+ * player.
+ */
+void player_view_batch_begin(void);
+
+/*
+ * End putting off view updates for the calling thread, and update the view
+ * of each player noted since player_view_batch_begin() once.
+ *
+ * @return the number of views updated.
+ */
+int player_view_batch_end(void);
+
+/*
+ * Counters for batched output, accumulated over all threads and players.
+ */
+typedef struct player_batch_stats {
+    unsigned long packets;        // Packets buffered instead of being written individually
+    unsigned long flushes;        // System calls used to write them
+    unsigned long syscalls_saved; // packets - flushes
+    unsigned long segments_saved; // Estimated, from each connection's maximum segment size
+    unsigned long frames;         // Writes sent as a single BATCH packet (see player_set_batch_frames())
+} PLAYER_BATCH_STATS;
+
+/*
+ * Get a snapshot of the batched output counters.
+ *
+ * @param stats  Pointer to storage to receive the counters.
+ */
+void player_get_batch_stats(PLAYER_BATCH_STATS *stats);
+
+/*
+ * Counters for broadcasts, accumulated over all threads.
+ */
+typedef struct player_broadcast_stats {
+    unsigned long broadcasts; // Packets encoded once for every player
+    unsigned long deliveries; // Players they were sent to, each of which used to encode its own copy
+} PLAYER_BROADCAST_STATS;
+
+/*
+ * Get a snapshot of the broadcast counters.
+ *
+ * @param stats  Pointer to storage to receive the counters.
+ */
+void player_get_broadcast_stats(PLAYER_BROADCAST_STATS *stats);
+
+/*
+ * Counters for view updates, accumulated over all players.
+ */
+typedef struct player_view_stats {
+    unsigned long updates;      // VIEW packets sent on connections, one per update
+    unsigned long show_packets; // CLEAR and SHOW packets the same updates take without packed views
+    unsigned long conflated;    // Queued updates replaced by a newer one before being sent
+} PLAYER_VIEW_STATS;
+
+/*
+ * Get a snapshot of the view update counters.
+ *
+ * @param stats  Pointer to storage to receive the counters.
+ */
+void player_get_view_stats(PLAYER_VIEW_STATS *stats);
+
+/*
+ * Send the player's views on its connection as VIEW packets, one per
+ * update, rather than as CLEAR and SHOW packets.
+ *
+ * @param player  The player, whose client asked for this with
+ * MZW_FEATURE_PACKED_VIEWS at LOGIN.
+ *
+ * A full update becomes one MZW_VIEW_FULL packet instead of a CLEAR and a
+ * SHOW for every cell, and an incremental one becomes one MZW_VIEW_DELTA
+ * packet instead of a SHOW for every changed cell.
+ */
+void player_set_packed_views(PLAYER *player);
+
+/*
+ * Send what is batched for the player on its connection wrapped in a
+ * single BATCH packet, rather than as the packets one after the other.
+ *
+ * @param player  The player, whose client asked for this with
+ * MZW_FEATURE_BATCH at LOGIN.
+ *
+ * Each view update and each reset is then batched for the player even
+ * when the calling thread is not batching, so that it arrives as one
+ * BATCH packet the client can apply at once.  A batch that holds a
+ * single packet is sent as that packet.
+ */
+void player_set_batch_frames(PLAYER *player);
+
 /*
  * Get the current maze location and gaze direction for a player.
  *
@@ -166,6 +479,14 @@ int player_send_packet(PLAYER *player, MZW_PACKET *pkt, void *data);
  */
 int player_get_location(PLAYER *player, int *rowp, int *colp, int *dirp);
 
+/*
+ * Get the avatar of a player.
+ *
+ * @param player  The player.
+ * @return the avatar the player logged in with.
+ */
+OBJECT player_get_avatar(PLAYER *player);
+
 /*
  * Attempt to move the player's avatar in the maze one unit of distance
  * forward or back with respect to the current direction of gaze.
@@ -202,11 +523,14 @@ void player_rotate(PLAYER *player, int dir);
  * @param player  The player whose laser is to be fired.
  *
  * The laser will score a hit on the first avatar, if any, encountered
- * along the corridor.  If a hit is scored, the thread serving the player
- * who has been hit will be notified by sending a SIGUSR1 signal to the
- * thread serving that player.  In addition the score of the player who
+ * along the corridor.  If a hit is scored, it is recorded in the state of
+ * the player who has been hit: a hit event is posted to that player's
+ * mailbox, which makes the player's event file descriptor (see
+ * player_get_eventfd()) readable so that the thread serving the player
+ * notices it.  No signal is sent.  In addition the score of the player who
  * fired the laser will be incremented by one and all clients will be
- * notified of the new score.
+ * notified of the new score.  Finally, the hit handler, if one has been
+ * set (see player_set_hit_handler()), is called with the player hit.
  */
 void player_fire_laser(PLAYER *player);
 
@@ -247,26 +571,125 @@ void player_invalidate_view(PLAYER *player);
  * those cells in the view that have changed since the previous update.
  * Note that in an incremental update care must be taken if the depths of
  * the old and new views are different.
+ *
+ * For a player with packed views (see player_set_packed_views()), each
+ * update is instead a single VIEW packet.  For a player with an outbound
+ * queue, the update is left for the writer thread to send, and replaces
+ * one it has not yet sent (see player_set_queue_depth()).  Once
+ * player_set_view_channel()
+ * has been called for the player, every update is instead a single VIEW
+ * datagram holding the whole view.
  */
 void player_update_view(PLAYER *player);
 
+/*
+ * Send the player's views over UDP from now on, rather than over the
+ * player's connection.
+ *
+ * @param player  The player.
+ * @param udp_fd  The datagram socket from which the views are to be sent.
+ * @param addr  The address of the client's UDP socket.
+ * @param addrlen  The length of the address.
+ *
+ * Each view update then becomes one VIEW datagram, numbered one more than
+ * the last, that holds the whole view, since the client cannot rely on
+ * having received any earlier one.  The socket is shared, and is not
+ * closed when the player logs out.
+ */
+void player_set_view_channel(PLAYER *player, int udp_fd, struct sockaddr *addr, socklen_t addrlen);
+
 /*
  * Check whether a player has received any laser hits and, if so,
  * respond appropriately.
  *
  * @param player  The player to be checked for laser hits.
  *
- * The server thread handling a particular player will be notified about
- * a laser hit by receiving a SIGUSR1 signal.  A handler for this signal
- * should be installed in order to record the occurrence of the laser hit
- * in the state for the player who took the hit.  The present function
- * should be called just before each attempt is made to read the next
- * packet from the client connection.  This will ensure that any hits
- * that have occurred are noticed by the player that took the hits
- * in a prompt fashion.
+ * The player who fires posts each hit to the victim's mailbox, whose
+ * event file descriptor then becomes readable.  The thread serving a
+ * player should wait for that descriptor together with the client
+ * connection, and call the present function whenever it becomes readable
+ * and just before each attempt is made to read the next packet from the
+ * client connection.  This will ensure that any hits that have occurred
+ * are noticed by the player that took the hits in a prompt fashion.
+ * Hits are never lost: they stay in the mailbox until they are taken.
+ *
+ * A player who has been hit is taken out of the maze and sent an ALERT,
+ * and a timer is started on the timer wheel that calls player_reset()
+ * from the timer thread once PLAYER_FREEZE_SECS have elapsed.  The
+ * present function does not block: while the player is frozen, the
+ * serving thread goes on receiving its packets, but moves and shots
+ * fail because the player has no location in the maze.
  */
 void player_check_for_laser_hit(PLAYER *player);
 
+/*
+ * Number of seconds a player who has been hit stays out of the maze
+ * before being reset to a new location.
+ */
+#define PLAYER_FREEZE_SECS 3
+
+/*
+ * Check whether a player has received any laser hits and, if so,
+ * respond to them as player_check_for_laser_hit() does.
+ *
+ * @param player  The player to be checked for laser hits.
+ * @return nonzero if a hit froze the player, zero if there was no hit
+ * or the player was already frozen.
+ */
+int player_take_laser_hit(PLAYER *player);
+
+/*
+ * Change what happens when a frozen player's freeze is over.
+ *
+ * @param handler  Function called on the timer thread with the player,
+ * or NULL for the default, which calls player_reset() there and then.
+ * The player is guaranteed to stay allocated only while the handler runs;
+ * a handler that defers the reset must take its own reference, and must
+ * check that the player has not logged out in the meantime.
+ */
+void player_set_respawn_handler(void (*handler)(PLAYER *player));
+
+/*
+ * Have hits taken as soon as they are scored, rather than by the thread
+ * serving the player hit.
+ *
+ * @param handler  Function called by player_fire_laser(), on the thread
+ * that fired, with the player hit, once the hit has been posted and the
+ * new score sent; or NULL for the default, which leaves the hit in the
+ * mailbox.  The player stays referenced while the handler runs.
+ */
+void player_set_hit_handler(void (*handler)(PLAYER *player));
+
+/*
+ * Get the event file descriptor of a player's mailbox.
+ *
+ * @param player  The player whose mailbox is wanted.
+ * @return  a non-blocking eventfd that is readable whenever events, such
+ * as laser hits, may have been posted to the player's mailbox since they
+ * were last taken by player_take_laser_hit().  It belongs to the player
+ * and is closed when the PLAYER object is freed.
+ *
+ * Other players post events to the mailbox without taking any lock, and
+ * the thread serving the player takes them all at once, so events can be
+ * delivered to a player no matter what its serving thread is doing,
+ * without the cost of a signal or of restarting interrupted system calls.
+ */
+int player_get_eventfd(PLAYER *player);
+
+/*
+ * Check, without any system call, whether events are waiting in a
+ * player's mailbox.
+ *
+ * @param player  The player whose mailbox is to be checked.
+ * @return nonzero if events have been posted and not yet taken.
+ *
+ * This is meant to be called between packets that were received together,
+ * so that a hit is noticed promptly without reading the eventfd each time.
+ * A readable eventfd with an empty mailbox can occur if events were taken
+ * just before the poster signalled; player_take_laser_hit() clears it.
+ */
+int player_has_events(PLAYER *player);
+
 /*
  * Broadcast a chat message to all players.
  *
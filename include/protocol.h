@@ -3,6 +3,8 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include "csapp.h"
 
 /*
  * The "Maze War" game protocol.
@@ -38,6 +40,38 @@
  *   SCORE:   Update the scoreboard
  *            (contains avatar, score)
  *   CHAT:    Chat message from another user
+ *
+ * Optional view channel, negotiated after LOGIN:
+ *   UDP:     (client-to-server) Ask for views to be sent over UDP
+ *            (payload is the client's UDP port, in network byte order)
+ *            (server-to-client) Reply, param1 is 1 if views will now be
+ *            sent over UDP and 0 if they stay on the connection
+ *   VIEW:    Complete view, or the cells of it that have changed, in one
+ *            packet (contains depth and objects, see below)
+ *
+ * Views are only useful in their newest form, and on a lossy link TCP
+ * holds every later packet back until a lost one has been retransmitted.
+ * Once the UDP channel is in use, each view update is sent as a VIEW
+ * datagram holding the whole view rather than as CLEAR and SHOW packets,
+ * with a sequence number so that the client applies only the newest one
+ * it has received and ignores any that were overtaken.  Everything else,
+ * including scores and chat, stays on the connection.
+ *
+ * A client may also ask at LOGIN for its views to be sent on the connection
+ * as VIEW packets (see MZW_FEATURE_PACKED_VIEWS), each of which replaces a
+ * CLEAR followed by a SHOW for every cell, or the SHOW packets of an
+ * incremental update.
+ *
+ * Server-to-client, for clients that ask for it at LOGIN
+ * (see MZW_FEATURE_BATCH):
+ *   BATCH:   Several packets that make up one update, such as a view
+ *            update or the scoreboard sent on entering the maze
+ *            (param1 is the number of packets, as an unsigned byte; the
+ *            payload is the packets, encoded one after another exactly
+ *            as they would be sent on their own)
+ *
+ * A client should apply the packets of a BATCH together, without redrawing
+ * in between.  A BATCH never contains another BATCH.
  */
 
 /*
@@ -51,7 +85,9 @@ typedef enum {
     MZW_SEND_PKT,
     /* Server-to-client */
     MZW_READY_PKT, MZW_INUSE_PKT, MZW_CLEAR_PKT, MZW_SHOW_PKT,MZW_ALERT_PKT,
-    MZW_SCORE_PKT, MZW_CHAT_PKT
+    MZW_SCORE_PKT, MZW_CHAT_PKT,
+    /* View channel, after the others so that their values are unchanged */
+    MZW_UDP_PKT, MZW_VIEW_PKT, MZW_BATCH_PKT
 } MZW_PACKET_TYPE;
 
 /*
@@ -67,6 +103,44 @@ typedef struct mzw_packet {
     uint32_t timestamp_nsec;       // Nanoseconds field of time packet was sent
 } MZW_PACKET;
 
+/*
+ * Optional features, requested by a client as bits in param2 of LOGIN and
+ * granted by the server in param2 of READY.  A client that sends zero, as
+ * every client did before there were any, is sent what it always was.
+ */
+#define MZW_FEATURE_PACKED_VIEWS 0x01 // Views as VIEW packets rather than CLEAR and SHOW
+#define MZW_FEATURE_BATCH 0x02        // Packets of one update wrapped in a BATCH packet
+
+/*
+ * Most packets wrapped in one BATCH packet.  The count goes in param1,
+ * which a BATCH packet uses as an unsigned byte, so it may exceed 127.
+ * The payload is limited by the size field as well, so a packet that
+ * would take it past UINT16_MAX bytes is sent in the next BATCH, or on
+ * its own if it is that large by itself.
+ */
+#define MZW_BATCH_MAX_PACKETS 255
+
+/*
+ * A VIEW packet has param1 set to the depth of the view, and param2 set
+ * to its form.  The cells of a view are numbered from zero in order of
+ * distance from the player, nearest first, with MZW_VIEW_WIDTH cells at
+ * each distance: the objects to the left, ahead and to the right, as they
+ * would appear in param1 of SHOW packets with param2 0, 1 and 2.
+ *
+ * MZW_VIEW_FULL: the payload holds every cell, depth * MZW_VIEW_WIDTH
+ * bytes.  Cells beyond the depth are empty, as after a CLEAR.  UDP
+ * datagrams are always of this form.
+ *
+ * MZW_VIEW_DELTA: the depth is unchanged, and the payload is a bitmask of
+ * (depth * MZW_VIEW_WIDTH + 7) / 8 bytes, with bit i % 8 of byte i / 8 set
+ * if cell i has changed, followed by the new contents of the changed cells
+ * in order.
+ */
+#define MZW_VIEW_WIDTH 3
+#define MZW_VIEW_MAX_DEPTH 16
+#define MZW_VIEW_FULL 0
+#define MZW_VIEW_DELTA 1
+
 /*
  * Object types (for 'show' packet).
  */
@@ -74,6 +148,108 @@ typedef enum {
     MZW_NO_OBJ, MZW_PLAYER, MZW_WALL, MZW_DOOR
 } MZW_OBJECT_TYPE;
 
+/*
+ * Protocol versions.  Version 1 is the fixed 16-byte header above.
+ * Version 2 replaces it with a variable-length one:
+ *
+ *   - a flags byte: bits 0-1 hold the number of parameters present, from
+ *     0 to 3, with parameters left out being zero; bit 2 is set if a
+ *     timestamp is present, and is otherwise zero.  Other bits are zero.
+ *   - a varint (7 bits per byte, least significant first, high bit set
+ *     on every byte but the last, at most 3 bytes) holding
+ *     (size << 5) | type, so that packet types must be less than 32.
+ *   - the parameters present, one byte each, from param1 on.
+ *   - if present, the timestamp seconds and nanoseconds, 4 bytes each in
+ *     network byte order.
+ *
+ * A SHOW packet, for example, takes 5 bytes rather than 16.
+ *
+ * A client asks for version 2 by setting param3 of LOGIN to the highest
+ * version it supports; zero, as sent by older clients, means version 1.
+ * The READY reply is always a version 1 packet, with param3 set to the
+ * version chosen by the server.  From then on, both directions use that
+ * version, so a client asking for version 2 must not send anything more
+ * until it has received READY.  In version 2 the server leaves timestamps
+ * out.
+ */
+#define PROTO_VERSION_1 1
+#define PROTO_VERSION_2 2
+#define PROTO_VERSION_MAX PROTO_VERSION_2
+
+/*
+ * Connections with file descriptors at or above this limit always use
+ * version 1.
+ */
+#define PROTO_MAX_FDS 65536
+
+/*
+ * Set the protocol version used for packets sent and received on a
+ * connection from now on.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @param version  The version, from PROTO_VERSION_1 to PROTO_VERSION_MAX.
+ * @return  zero if successful, otherwise -1, with errno set to EINVAL.
+ *
+ * Every connection starts out at version 1.  The version must be set back
+ * to PROTO_VERSION_1 before the descriptor is closed, as it belongs to the
+ * descriptor rather than to the connection, and the next connection to be
+ * given the same descriptor would otherwise inherit it.
+ */
+int proto_set_version(int fd, int version);
+
+/*
+ * Set the protocol version used for packets received on a connection from
+ * now on, leaving the version they are sent in as it is.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @param version  The version, from PROTO_VERSION_1 to PROTO_VERSION_MAX.
+ * @return  zero if successful, otherwise -1, with errno set to EINVAL.
+ *
+ * This is for a switch announced by a packet that is written later, by
+ * another thread: the receiving side has to be ready for the new version
+ * as soon as the packet is on its way, while packets still ahead of it
+ * must be sent in the old one.  proto_set_version() then completes the
+ * switch once the packet is written.
+ */
+int proto_set_recv_version(int fd, int version);
+
+/*
+ * Get the protocol version packets are sent in on a connection.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @return  the version, PROTO_VERSION_1 if it was never set.
+ */
+int proto_get_version(int fd);
+
+/*
+ * Mechanisms available for moving packets between the server and its
+ * clients.  The default issues ordinary read() and write() system calls.
+ * The io_uring backend instead routes all I/O through a submission ring
+ * shared by all threads, so that operations issued concurrently by many
+ * threads are submitted to the kernel in batches.
+ */
+typedef enum {
+    PROTO_BACKEND_RW, PROTO_BACKEND_URING
+} PROTO_BACKEND;
+
+/*
+ * Select the backend used by proto_send_packet() and proto_recv_packet().
+ *
+ * @param backend  The backend to be used.
+ * @return  zero if the backend was initialized, nonzero otherwise.
+ * In the latter case, errno is set to indicate the error and the
+ * default backend remains in use.
+ *
+ * This should be called once at startup, before any packets are sent.
+ */
+int proto_init_backend(PROTO_BACKEND backend);
+
+/*
+ * Release the resources of the selected backend and revert to the default.
+ * No packets may be in transit at the time of call.
+ */
+void proto_fini_backend(void);
+
 /*
  * Send a packet, which consists of a fixed-size header followed by an
  * optional associated data payload.
@@ -91,6 +267,118 @@ typedef enum {
  */
 int proto_send_packet(int fd, MZW_PACKET *pkt, void *data);
 
+/*
+ * Maximum number of payload fragments accepted by proto_send_packetv().
+ */
+#define PROTO_MAX_FRAGMENTS 8
+
+/*
+ * Send a packet whose payload is gathered from several separate buffers,
+ * so that the caller need not first copy them into one.
+ *
+ * @param fd  The file descriptor on which packet is to be sent.
+ * @param pkt  The fixed-size packet header, with multi-byte fields
+ *   in host byte order.  The size field must equal the total length
+ *   of the fragments.
+ * @param iov  The payload fragments, in order.
+ * @param iovcnt  The number of fragments, at most PROTO_MAX_FRAGMENTS.
+ * @return  zero in case of successful transmission, nonzero otherwise.
+ *   In the latter case, errno is set to indicate the error.
+ *
+ * The header and all of the fragments are handed to the kernel in a
+ * single system call (sendmsg() on a socket, writev() otherwise), which
+ * is only repeated if the kernel accepts part of the packet.
+ * proto_send_packet() is the special case of a single fragment.
+ */
+int proto_send_packetv(int fd, MZW_PACKET *pkt, const struct iovec *iov, int iovcnt);
+
+/*
+ * Encode a packet into a buffer, exactly as it would be sent by
+ * proto_send_packetv(), so that several packets can be accumulated
+ * and later transmitted together with proto_send_packed().
+ *
+ * @param fd  The connection the packet is meant for, whose protocol
+ *   version decides the encoding, or -1 for version 1.
+ * @param buf  The buffer to receive the encoded packet, which must have
+ *   room for sizeof(MZW_PACKET) + pkt->size bytes.
+ * @param pkt  The fixed-size packet header, with multi-byte fields
+ *   in host byte order.
+ * @param iov  The payload fragments, in order.
+ * @param iovcnt  The number of fragments.
+ * @return  the number of bytes stored in buf.
+ */
+size_t proto_pack_packet(int fd, void *buf, MZW_PACKET *pkt, const struct iovec *iov, int iovcnt);
+
+/*
+ * Send a buffer of packets previously encoded by proto_pack_packet().
+ *
+ * @param fd  The file descriptor on which the packets are to be sent.
+ * @param buf  The encoded packets.
+ * @param len  The number of bytes in buf.
+ * @return  zero in case of successful transmission, nonzero otherwise.
+ *   In the latter case, errno is set to indicate the error.
+ */
+int proto_send_packed(int fd, void *buf, size_t len);
+
+/*
+ * A packet encoded once to be sent unchanged on many connections, such as
+ * a score or a chat message that goes to every player.  A frame holds the
+ * payload once and the header as each protocol version encodes it, and is
+ * never changed after it is made, so any number of threads may send it at
+ * the same time.  It is reference counted: each connection it is queued
+ * for holds a reference, and the last one to let go frees it.
+ */
+typedef struct proto_frame PROTO_FRAME;
+
+/*
+ * Encode a packet as a frame.
+ *
+ * @param pkt  The fixed-size packet header, in host byte order.  The
+ *   timestamp goes into the version 1 encoding only, as version 2
+ *   connections leave server timestamps out.
+ * @param iov  The payload fragments, in order.
+ * @param iovcnt  The number of fragments.
+ * @return  the frame, holding one reference for the caller.
+ */
+PROTO_FRAME *proto_frame_create(MZW_PACKET *pkt, const struct iovec *iov, int iovcnt);
+
+/*
+ * Take another reference to a frame.
+ *
+ * @param frame  The frame.
+ * @return  the frame.
+ */
+PROTO_FRAME *proto_frame_ref(PROTO_FRAME *frame);
+
+/*
+ * Give up a reference to a frame, freeing it if it was the last.
+ *
+ * @param frame  The frame.
+ */
+void proto_frame_unref(PROTO_FRAME *frame);
+
+/*
+ * Copy a frame into a buffer, as proto_pack_packet() would encode it.
+ *
+ * @param fd  The connection the frame is meant for, whose protocol
+ *   version decides which header is used, or -1 for version 1.
+ * @param buf  The buffer, which must have room for sizeof(MZW_PACKET)
+ *   bytes plus the payload.
+ * @param frame  The frame.
+ * @return  the number of bytes stored in buf.
+ */
+size_t proto_pack_frame(int fd, void *buf, PROTO_FRAME *frame);
+
+/*
+ * Send a frame.
+ *
+ * @param fd  The file descriptor on which the frame is to be sent.
+ * @param frame  The frame.
+ * @return  zero in case of successful transmission, nonzero otherwise.
+ *   In the latter case, errno is set to indicate the error.
+ */
+int proto_send_frame(int fd, PROTO_FRAME *frame);
+
 /*
  * Receive a packet, blocking until one is available.
  *
@@ -108,4 +396,185 @@ int proto_send_packet(int fd, MZW_PACKET *pkt, void *data);
  */
 int proto_recv_packet(int fd, MZW_PACKET *pkt, void **datap);
 
+/*
+ * Receive a packet through a buffered reader, blocking until one is
+ * available.  This is a variant of proto_recv_packet() for connections
+ * over which many packets are received.
+ *
+ * @param rp  The reader for the connection, initialized once with
+ *   rio_readinitb() and then used for every packet received on it.
+ * @param pkt  Pointer to caller-supplied storage for the fixed-size
+ *   portion of the packet.
+ * @param datap  Pointer to a variable into which to store a pointer to any
+ *   payload received, or NULL if there is none.
+ * @return  zero in case of successful reception, nonzero otherwise.  In the
+ *   latter case, errno is set to indicate the error.
+ *
+ * Each read() takes in as many bytes as are available and fit in the
+ * reader's buffer, so a client that sends several packets back-to-back
+ * costs a single system call for all of them, and later calls return
+ * packets straight from the buffer.
+ *
+ * The payload is not copied to the heap: the returned pointer is borrowed,
+ * is not to be freed, and is valid only until the next call for the same
+ * reader or by the same thread.
+ *
+ * Unlike the CSAPP rio functions, a read interrupted by a signal is not
+ * retried; -1 is returned with errno set to EINTR, as for
+ * proto_recv_packet().  Any part of a packet received so far stays in
+ * the buffer, so calling again resumes where the interrupted call left
+ * off.  (The exception is a payload larger than RIO_BUFSIZE, which is
+ * read directly and is lost if the read is interrupted.)
+ */
+int proto_recv_packetb(rio_t *rp, MZW_PACKET *pkt, void **datap);
+
+/*
+ * Free the storage that proto_recv_packetb() keeps for the calling thread's
+ * payloads larger than RIO_BUFSIZE.  A thread that has finished receiving
+ * on a connection calls this before it exits or goes on to another one,
+ * as the storage would otherwise outlive it.  Any payload pointer returned
+ * to the thread is no longer valid afterwards.
+ */
+void proto_recv_release(void);
+
+/*
+ * Parse one packet out of a buffer of bytes already received, without
+ * performing any I/O.  This supports incremental reception on non-blocking
+ * connections, where a packet may arrive in several pieces.
+ *
+ * @param fd  The connection the bytes were received from, whose protocol
+ *   version for received packets decides the decoding, or -1 for version 1.
+ * @param buf  The received bytes, starting at a packet boundary.
+ * @param len  The number of bytes available in buf.
+ * @param pkt  Pointer to caller-supplied storage for the fixed-size
+ *   portion of the packet, which is returned in host byte order.
+ * @param datap  Pointer to a variable into which to store a pointer to any
+ *   payload, or NULL if there is none.
+ * @return  the number of bytes of buf occupied by the packet, or zero if
+ *   buf does not yet hold a complete packet.
+ *
+ * The returned payload pointer points into buf itself; it is not to be
+ * freed and it is only valid for as long as the contents of buf are.
+ */
+size_t proto_parse_packet(int fd, void *buf, size_t len, MZW_PACKET *pkt, void **datap);
+
+/*
+ * Take the next packet out of the payload of a BATCH packet.
+ *
+ * @param fd  The connection the BATCH packet was received from, whose
+ *   protocol version the packets in it are encoded in, or -1 for version 1.
+ * @param data  The payload of the BATCH packet.
+ * @param len  Its size.
+ * @param offp  Pointer to the offset of the next packet in the payload,
+ *   which is to be zero for the first call and is advanced by each call.
+ * @param pkt  Pointer to caller-supplied storage for the header of the
+ *   packet, returned in host byte order.
+ * @param datap  Pointer to a variable into which to store a pointer to its
+ *   payload, which points into data, or NULL if there is none.
+ * @return  1 if a packet was taken, 0 once the payload is used up, and -1
+ *   with errno set to EBADMSG if what is left of the payload is not a
+ *   whole packet, or is itself a BATCH.
+ */
+int proto_batch_next(int fd, void *data, size_t len, size_t *offp, MZW_PACKET *pkt, void **datap);
+
+/*
+ * Encode the changes between two views as the payload of an MZW_VIEW_DELTA
+ * packet.
+ *
+ * @param buf  The buffer to receive the payload, which must have room for
+ *   (depth * MZW_VIEW_WIDTH + 7) / 8 + depth * MZW_VIEW_WIDTH bytes.
+ * @param old_cells  The view the client has, depth * MZW_VIEW_WIDTH cells.
+ * @param new_cells  The view the client is to have, of the same depth.
+ * @param depth  The depth of both views, at most MZW_VIEW_MAX_DEPTH.
+ * @return  the length of the payload, or zero if no cell has changed.
+ */
+size_t proto_pack_view_delta(void *buf, const char *old_cells, const char *new_cells, int depth);
+
+/*
+ * Apply a VIEW packet, of either form, to the view a client is showing.
+ *
+ * @param cells  The view, MZW_VIEW_MAX_DEPTH * MZW_VIEW_WIDTH cells,
+ *   updated in place.
+ * @param empty  The object that fills the cells beyond the depth of a
+ *   full view.
+ * @param pkt  The header of the VIEW packet, in host byte order.
+ * @param data  Its payload.
+ * @return  the depth of the view, or -1 with errno set to EBADMSG if the
+ *   packet is malformed, in which case the view is left unchanged.
+ */
+int proto_apply_view(char *cells, char empty, MZW_PACKET *pkt, void *data);
+
+/*
+ * Largest datagram sent or received by proto_send_datagram() and
+ * proto_recv_datagram(), small enough not to be fragmented on any
+ * common link.
+ */
+#define PROTO_MAX_DATAGRAM 1200
+
+/*
+ * Size of the sequence number at the start of the payload of a datagram.
+ */
+#define PROTO_SEQ_SIZE 4
+
+/*
+ * State kept by the receiver of a stream of sequenced datagrams.
+ * Initialize it to all zeroes.
+ */
+typedef struct proto_seq {
+    uint32_t last;          // Newest sequence number accepted
+    int started;            // Nonzero once a datagram has been accepted
+    unsigned long accepted; // Datagrams accepted as newer than all before them
+    unsigned long stale;    // Datagrams discarded as duplicates or overtaken
+    unsigned long missed;   // Sequence numbers skipped over, lost or still in flight
+} PROTO_SEQ;
+
+/*
+ * Compare two sequence numbers, allowing for wraparound (RFC 1982).
+ *
+ * @return  nonzero if a is newer than b, otherwise zero.
+ */
+int proto_seq_after(uint32_t a, uint32_t b);
+
+/*
+ * Send a packet as a single datagram, with a sequence number.
+ *
+ * @param fd  The datagram socket on which the packet is to be sent.
+ * @param to  The address of the receiver, or NULL if fd is connected.
+ * @param tolen  The length of the address.
+ * @param seq  The sequence number, which should increase by one for each
+ *   datagram sent to the same receiver.
+ * @param pkt  The fixed-size packet header, with multi-byte fields in host
+ *   byte order.  The size field must equal the total length of the
+ *   fragments; the datagram carries PROTO_SEQ_SIZE bytes more.
+ * @param iov  The payload fragments, in order.
+ * @param iovcnt  The number of fragments, at most PROTO_MAX_FRAGMENTS.
+ * @return  zero if the datagram was handed to the kernel, nonzero
+ *   otherwise.  In the latter case, errno is set to indicate the error.
+ *
+ * The send is never retried: a datagram the kernel has no room for is
+ * simply lost, as it might have been on the way.  A packet that would
+ * make a datagram larger than PROTO_MAX_DATAGRAM fails with EMSGSIZE.
+ */
+int proto_send_datagram(int fd, const struct sockaddr *to, socklen_t tolen, uint32_t seq,
+                        MZW_PACKET *pkt, const struct iovec *iov, int iovcnt);
+
+/*
+ * Receive one datagram sent by proto_send_datagram(), keeping it only if
+ * it is newer than every datagram accepted before it.
+ *
+ * @param fd  The datagram socket from which to receive.
+ * @param seq  The receiver's sequence state, updated by the call.
+ * @param buf  Storage for the datagram, of at least PROTO_MAX_DATAGRAM bytes.
+ * @param pkt  Pointer to caller-supplied storage for the header, returned
+ *   in host byte order, with the size field not counting the sequence
+ *   number.
+ * @param datap  Pointer to a variable into which to store a pointer to the
+ *   payload, which points into buf, or NULL if there is none.
+ * @return  1 if the datagram was accepted, 0 if it was discarded as stale,
+ *   and -1 on error, with errno set.  A datagram too short to hold its
+ *   header and sequence number, or whose size field does not match its
+ *   length, is an error with errno set to EBADMSG.
+ */
+int proto_recv_datagram(int fd, PROTO_SEQ *seq, void *buf, MZW_PACKET *pkt, void **datap);
+
 #endif
@@ -2,6 +2,8 @@
 #define SERVER_H
 
 #include "client_registry.h"
+#include "protocol.h"
+#include "player.h"
 
 /*
  * If nonzero and compiled for debugging, show the maze after each packet processed.
@@ -29,4 +31,81 @@ extern int debug_show_maze;
  */
 void *mzw_client_service(void *arg);
 
+/*
+ * Run the service loop for a client connection on the calling thread,
+ * returning once the connection has shut down and been closed.
+ *
+ * @param connfd  The file descriptor for the client connection.
+ *
+ * This is the body of mzw_client_service(), for callers such as a pool of
+ * worker threads that serve one connection after another.
+ */
+void mzw_serve_client(int connfd);
+
+/*
+ * Carry out the request contained in a single packet received from a client.
+ *
+ * @param connfd  The file descriptor for the client connection.
+ * @param playerp  Pointer to a variable that holds the PLAYER for the client,
+ * or NULL if the client has not yet logged in.  A successful LOGIN stores
+ * the newly created PLAYER into this variable.
+ * @param pkt  The packet received, with multi-byte fields in host byte order.
+ * @param data  The payload of the packet, or NULL if there is none.  The
+ * payload is not retained after the call returns.
+ *
+ * This is the dispatch step of the service loop, factored out so that it
+ * can be driven either by a thread blocking on a single connection, as in
+ * mzw_client_service(), or by an event loop multiplexing many connections.
+ * An INUSE reply to a refused LOGIN is sent here, on the calling thread,
+ * since there is no player to queue it for.  It is sent without waiting:
+ * a client that has left so many replies unread that it does not fit is
+ * disconnected.
+ */
+void mzw_handle_packet(int connfd, PLAYER **playerp, MZW_PACKET *pkt, void *data);
+
+/*
+ * Carry out the request contained in a single packet on the calling
+ * thread, whatever the mode.
+ *
+ * @param connfd, playerp, pkt, data  As for mzw_handle_packet().
+ *
+ * mzw_handle_packet() calls this directly, except in actor mode, where
+ * the packet is handed to the actor thread, which calls this in turn.
+ * A refused LOGIN is left for mzw_handle_packet() to answer.
+ */
+void mzw_apply_packet(int connfd, PLAYER **playerp, MZW_PACKET *pkt, void *data);
+
+/*
+ * Log out the player of a client whose connection has shut down, in the
+ * way the current mode requires.
+ *
+ * @param player  The player, as for player_logout().
+ */
+void mzw_logout(PLAYER *player);
+
+/*
+ * Take the player of a client whose connection has shut down out of the
+ * game, in the way the current mode requires, without waiting on the
+ * connection.
+ *
+ * @param player  The player, as for player_leave().
+ *
+ * This is mzw_logout() without the final player_close(), for a caller
+ * that must not wait for the player's output to drain.
+ */
+void mzw_leave(PLAYER *player);
+
+/*
+ * Open the UDP socket that views are sent from to clients that ask for
+ * them to be sent over UDP (see MZW_UDP_PKT in protocol.h).
+ *
+ * @param port  The port to bind, normally the same as the TCP port.
+ * @return zero if the socket was opened, otherwise -1, with errno set.
+ *
+ * Until this is called, requests for the UDP view channel are refused
+ * and all views are sent over the clients' connections.  The socket stays
+ * open for as long as the server runs.
+ */
+int mzw_open_view_socket(char *port);
+
 #endif
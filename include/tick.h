@@ -0,0 +1,104 @@
+#ifndef TICK_H
+#define TICK_H
+
+#include "player.h"
+
+/*
+ * The tick module provides an optional fixed-rate simulation.  Normally
+ * each MOVE, TURN, FIRE or REFRESH packet is applied as soon as it is
+ * received, and every move recomputes and sends the view of every player,
+ * so that with N active players each input costs N view computations.
+ *
+ * In tick mode these packets are only queued by the threads serving the
+ * clients.  A single tick thread, woken at a fixed rate by a timerfd,
+ * applies the inputs queued since the previous tick in arrival order, then
+ * recomputes the view of each player whose view may have changed once, and
+ * writes each player's output for the tick in one go.  The cost of a tick
+ * is therefore bounded by TICK_MAX_INPUTS inputs and one view per player,
+ * however many inputs arrive.  Inputs beyond TICK_MAX_INPUTS are not lost,
+ * they are left queued for the following tick.
+ *
+ * So that a client flooding the server with inputs cannot make the queue
+ * grow without bound, each player may have at most TICK_MAX_PLAYER_INPUTS
+ * inputs waiting; any more are dropped until a tick has taken some.  A
+ * REFRESH is also dropped if the player already has one waiting, since
+ * the view it asks for would be sent once anyway.
+ *
+ * Chat messages are not part of the simulation and are still sent as soon
+ * as they are received.
+ */
+
+/*
+ * Maximum number of inputs applied in one tick.
+ */
+#define TICK_MAX_INPUTS 1024
+
+/*
+ * Maximum number of inputs a player may have waiting for the next ticks.
+ */
+#define TICK_MAX_PLAYER_INPUTS 32
+
+/*
+ * Maximum tick rate, in ticks per second.
+ */
+#define TICK_MAX_HZ 1000
+
+/*
+ * Statistics for the tick thread.  Times are in nanoseconds, measured on
+ * CLOCK_MONOTONIC.
+ */
+typedef struct tick_stats {
+    int hz;                      // Tick rate
+    unsigned long ticks;         // Ticks run
+    unsigned long overruns;      // Ticks missed because a tick took longer than the period
+    unsigned long inputs;        // Inputs applied
+    unsigned long carried;       // Times an input was left queued for a later tick
+    unsigned long views;         // Views recomputed at the end of ticks
+    int peak_queued;             // Largest number of inputs waiting at the start of a tick
+    unsigned long dropped;       // Inputs dropped because the player had too many waiting
+    unsigned long coalesced;     // REFRESH inputs dropped because one was already waiting
+    unsigned long tick_ns_total; // Time spent running ticks
+    unsigned long tick_ns_max;
+} TICK_STATS;
+
+/*
+ * Start the tick thread.
+ *
+ * @param hz  The tick rate, in the range [1, TICK_MAX_HZ].
+ *
+ * The tick thread blocks SIGHUP, so that termination is handled by the
+ * main thread.
+ */
+void tick_init(int hz);
+
+/*
+ * Determine whether tick mode is in effect.
+ *
+ * @return nonzero if tick_init() has been called, otherwise zero.
+ */
+int tick_enabled(void);
+
+/*
+ * Queue an input from a client, to be applied at the next tick.
+ *
+ * @param player  The player who sent the input.  A reference is taken
+ * until the input has been applied.
+ * @param type  The type of the packet: MZW_MOVE_PKT, MZW_TURN_PKT,
+ * MZW_FIRE_PKT or MZW_REFRESH_PKT.
+ * @param param  The first parameter of the packet.
+ */
+void tick_submit(PLAYER *player, int type, int param);
+
+/*
+ * Get a snapshot of the tick statistics.
+ *
+ * @param stats  Pointer to storage to receive the statistics.
+ */
+void tick_get_stats(TICK_STATS *stats);
+
+/*
+ * Log the tick statistics.
+ */
+void tick_report(void);
+
+#endif
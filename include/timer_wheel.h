@@ -0,0 +1,133 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The timer wheel module runs deferred work, such as respawning a player
+ * who has been hit, on a single server-wide timer thread, so that the
+ * threads serving clients never have to sleep.
+ *
+ * Timers are kept in a hierarchical timing wheel: TW_LEVELS wheels of
+ * TW_SLOTS slots each, where a slot of the first wheel covers one tick and
+ * a slot of each further wheel covers all of the wheel below it.  Adding
+ * and cancelling a timer take constant time, and a timer due far in the
+ * future is moved ("cascaded") into a finer wheel only as its expiry
+ * approaches.  The thread advances the wheel one tick at a time while
+ * timers are pending, and sleeps otherwise.
+ *
+ * The TW_TIMER itself is provided by the caller, typically embedded in the
+ * object the timer acts on, so that scheduling allocates no memory.
+ */
+
+/*
+ * Default length of a tick, in milliseconds.  Timers fire no earlier than
+ * requested, and normally less than one tick late.
+ */
+#define TW_TICK_MS 10
+
+#define TW_LEVEL_BITS 6
+#define TW_SLOTS (1 << TW_LEVEL_BITS)
+#define TW_LEVELS 4
+
+/*
+ * A timer.  The fields are private to the timer wheel module; a timer is
+ * prepared with tw_timer_init() before it is first added.
+ */
+typedef struct tw_timer {
+    void (*fn)(void *arg);       // Called on the timer thread when the timer fires
+    void *arg;
+    uint64_t expires;            // Tick at which the timer is due
+    struct timespec due;         // Time at which the timer is due, for lateness statistics
+    struct tw_timer *next;       // Next timer in the same slot
+    struct tw_timer **pprev;     // Link that points to this timer, NULL if not pending
+} TW_TIMER;
+
+/*
+ * Statistics for the timer wheel.  Times are in nanoseconds, measured on
+ * CLOCK_MONOTONIC.
+ */
+typedef struct tw_stats {
+    unsigned long added;         // Timers added
+    unsigned long fired;         // Timers whose function has been called
+    unsigned long cancelled;     // Pending timers removed by tw_cancel()
+    unsigned long cascaded;      // Times a timer was moved to a finer wheel
+    unsigned long pending;       // Timers currently waiting to fire
+    unsigned long late_ns_total; // Time between when timers were due and when they fired
+    unsigned long late_ns_max;
+} TW_STATS;
+
+/*
+ * Start the timer thread.
+ *
+ * @param tick_ms  The length of a tick in milliseconds, or zero for
+ * TW_TICK_MS.
+ *
+ * Calls after the first have no effect.  The timer thread blocks all
+ * signals.
+ */
+void tw_init(int tick_ms);
+
+/*
+ * Stop the timer thread.  Timers still pending do not fire.
+ */
+void tw_fini(void);
+
+/*
+ * Prepare a timer for use.
+ *
+ * @param timer  The timer.
+ * @param fn  The function to call when the timer fires.
+ * @param arg  The argument to pass to fn.
+ */
+void tw_timer_init(TW_TIMER *timer, void (*fn)(void *), void *arg);
+
+/*
+ * Arrange for a timer to fire after a delay.
+ *
+ * @param timer  The timer, which must not already be pending.
+ * @param delay_ms  The delay in milliseconds.
+ *
+ * The timer's function is called on the timer thread, once, no earlier
+ * than delay_ms from now.  It may add the timer again.
+ */
+void tw_add(TW_TIMER *timer, unsigned long delay_ms);
+
+/*
+ * Cancel a timer.
+ *
+ * @param timer  The timer.
+ * @return zero if the timer was pending and will now not fire, otherwise
+ * -1, meaning that it has already fired or was never added.
+ *
+ * If the timer's function is running when this is called, tw_cancel()
+ * waits for it to return, so that once tw_cancel() returns the function
+ * is no longer using its argument.  It follows that a timer function must
+ * not cancel its own timer, and that tw_cancel() must not be called while
+ * holding a lock that the timer's function takes.
+ */
+int tw_cancel(TW_TIMER *timer);
+
+/*
+ * Determine whether a timer is waiting to fire.
+ *
+ * @param timer  The timer.
+ * @return nonzero if the timer has been added and has not yet fired or
+ * been cancelled.
+ */
+int tw_pending(TW_TIMER *timer);
+
+/*
+ * Get a snapshot of the timer wheel statistics.
+ *
+ * @param stats  Pointer to storage to receive the statistics.
+ */
+void tw_get_stats(TW_STATS *stats);
+
+/*
+ * Log the timer wheel statistics.
+ */
+void tw_report(void);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * The uring module provides an io_uring based alternative to issuing one
+ * read() or write() system call per operation.  All threads share a single
+ * submission ring: an operation is placed in the ring and whichever thread
+ * is currently flushing the ring submits it, together with any others that
+ * have queued up in the meantime, in one io_uring_enter() call.  The
+ * submitting thread then collects whatever completions the kernel posted
+ * while the operations were submitted, its own included when, as for most
+ * socket writes, the operation could be carried out at once.  A reaper
+ * thread collects the completions of operations that had to wait, such as
+ * reads from a client that has not sent anything yet, and wakes the
+ * threads waiting for them.
+ *
+ * The operations provided here have the same blocking semantics as the
+ * system calls they replace, so that the protocol module can use them
+ * interchangeably.  That costs them most of what io_uring can save: a read
+ * that has to wait is handed from the reaper to its thread, and bench/
+ * uring_bench shows both reads and writes to be slower than with read()
+ * and writev(), unless many threads submit at once.
+ */
+
+/*
+ * Default number of submission queue entries in the shared ring.
+ */
+#define URING_ENTRIES 256
+
+/*
+ * Initialize the shared ring and start the reaper thread.
+ *
+ * @param entries  The number of submission queue entries.
+ * @return zero if successful, otherwise -1 with errno set, for example
+ * if the kernel does not support io_uring.
+ */
+int uring_init(unsigned entries);
+
+/*
+ * Finalize the shared ring.  No operations may be in progress.
+ */
+void uring_fini(void);
+
+/*
+ * Read from a file descriptor through the ring, blocking until the
+ * read completes.
+ *
+ * @param fd  The file descriptor to read from.
+ * @param buf  The buffer into which to read.
+ * @param n  The maximum number of bytes to read.
+ * @return  the number of bytes read, zero on EOF, or -1 with errno set.
+ *
+ * As for read(), a signal delivered to the waiting thread causes -1 to
+ * be returned with errno set to EINTR.  In that case the read has been
+ * cancelled and no data has been consumed from the file descriptor.
+ */
+ssize_t uring_read(int fd, void *buf, size_t n);
+
+/*
+ * Write a vector of buffers to a file descriptor through the ring,
+ * blocking until the write completes.
+ *
+ * @param fd  The file descriptor to write to.
+ * @param iov  The buffers to be written, in order.
+ * @param iovcnt  The number of buffers.
+ * @return  the number of bytes written, which may be short as for writev(),
+ * or -1 with errno set.
+ *
+ * Unlike uring_read(), the write is not abandoned if the waiting thread
+ * receives a signal.
+ */
+ssize_t uring_writev(int fd, const struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+
+/*
+ * The worker pool module is an alternative to creating a new thread for
+ * each client connection.  A fixed number of worker threads is created at
+ * startup, and accepted connections are placed in a bounded admission
+ * queue (a CSAPP-style "sbuf"), from which idle workers take them and run
+ * the service loop until the client disconnects.  Connection churn then
+ * costs no thread creation or teardown, and the number of threads stays
+ * bounded no matter how many clients connect.
+ *
+ * When every worker is busy and the admission queue is full, submitting a
+ * connection blocks the accepting thread, so that further connections wait
+ * in the kernel's listen backlog rather than consuming server resources.
+ *
+ * The pool can be divided into slices, each with its own workers and its
+ * own admission queue, so that each listener (see listener.h) hands its
+ * connections to a worker set of its own.  A slice's workers are created
+ * by the thread that starts the slice, and inherit its CPU binding, so a
+ * pinned listener's connections are served on its core.
+ */
+
+/*
+ * Default capacity of the admission queue, per worker.
+ */
+#define WP_QUEUE_PER_WORKER 2
+
+/*
+ * Statistics for the worker pool, or for one slice of it.  Times are in nanoseconds, measured on
+ * CLOCK_MONOTONIC.
+ */
+typedef struct wp_stats {
+    int workers;                 // Number of worker threads
+    int busy;                    // Workers currently serving a connection
+    int peak_busy;               // Largest value of busy (summed over the slices for the pool)
+    int queued;                  // Connections waiting in the admission queue
+    int peak_queued;             // Largest value of queued (likewise)
+    unsigned long served;        // Connections taken from the queue by workers
+    unsigned long full_waits;    // Submissions that had to wait for room in the queue
+    unsigned long wait_ns_total; // Time connections spent in the queue
+    unsigned long wait_ns_max;
+    double utilization;          // Fraction of worker time spent serving, since startup
+} WP_STATS;
+
+/*
+ * Set up the slices of the pool and their admission queues.  No workers
+ * are created until each slice is started with wp_start().
+ *
+ * @param nworkers  The number of worker threads in all, which are shared
+ * out as evenly as possible among the slices.  It is raised to the number
+ * of slices if it is smaller, so that every slice has a worker.
+ * @param stack_size  The stack size of each worker, in bytes, or zero for
+ * the system default.  Sizes below PTHREAD_STACK_MIN are raised to it.
+ * @param queue_size  The capacity of the admission queues in all, shared
+ * out likewise, or zero for WP_QUEUE_PER_WORKER times the number of
+ * workers in each slice.
+ * @param nslices  The number of slices (at least 1).
+ *
+ * Workers block SIGHUP, so that termination is handled by the main thread.
+ */
+void wp_init(int nworkers, size_t stack_size, int queue_size, int nslices);
+
+/*
+ * Create the workers of a slice, unless that has already been done.
+ *
+ * @param slice  The slice, modulo the number of slices.
+ *
+ * The workers inherit the CPU binding of the calling thread.
+ */
+void wp_start(int slice);
+
+/*
+ * Determine whether the worker pool has been started.
+ *
+ * @return nonzero if wp_init() has been called, otherwise zero.
+ */
+int wp_enabled(void);
+
+/*
+ * Submit a newly accepted client connection to be served by a slice of
+ * the pool, blocking while the slice's admission queue is full.
+ *
+ * @param slice  The slice, modulo the number of slices, which must have
+ * been started for the connection to be served.
+ * @param connfd  The file descriptor for the client connection.  The
+ * worker that serves it closes it when the client disconnects.
+ */
+void wp_submit(int slice, int connfd);
+
+/*
+ * Get a snapshot of the worker pool statistics.
+ *
+ * @param stats  Pointer to storage to receive the statistics.
+ */
+void wp_get_stats(WP_STATS *stats);
+
+/*
+ * Get a snapshot of the statistics for one slice of the pool.
+ *
+ * @param slice  The slice, from zero to one less than the number of slices.
+ * @param stats  Pointer to storage to receive the statistics.
+ * @return zero if successful, nonzero if there is no such slice.
+ */
+int wp_get_slice_stats(int slice, WP_STATS *stats);
+
+/*
+ * Log the worker pool statistics, and those of each slice if there are
+ * several.
+ */
+void wp_report(void);
+
+#endif
@@ -0,0 +1,262 @@
+#include "actor.h"
+#include "server.h"
+#include "csapp.h"
+#include "debug.h"
+#include <time.h>
+
+typedef enum {
+    ACTOR_PACKET, // a packet from a client
+    ACTOR_LOGOUT, // the client has disconnected
+    ACTOR_RESPAWN // a frozen player's freeze is over
+} ACTOR_CMD_TYPE;
+
+typedef struct actor_cmd {
+    struct actor_cmd *next; // linked by the queue
+    ACTOR_CMD_TYPE type;
+    int connfd;
+    PLAYER *player; // referenced by asynchronous commands until carried out
+    PLAYER **playerp; // for a LOGIN, where the new player is stored
+    MZW_PACKET pkt;
+    void *data; // payload, owned by the command if it is asynchronous
+    int sync; // the pusher waits on done, and owns the command
+    sem_t done;
+    struct timespec pushed;
+} ACTOR_CMD;
+
+// Intrusive MPSC queue (after Vyukov): producers swap themselves in at head, the actor pops at tail
+static struct {
+    ACTOR_CMD *head; // most recently pushed
+    ACTOR_CMD *tail; // next to pop, only touched by the actor
+    ACTOR_CMD stub; // keeps the list non-empty
+    sem_t items; // one post per push, so the actor can sleep when idle
+} queue;
+
+static int enabled;
+static pthread_t actor_tid;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ACTOR_STATS stats;
+static unsigned long batch_views; // views recomputed by the current batch, only touched by the actor
+static unsigned long spare_items; // posts taken from queue.items ahead of their commands, only touched by the actor
+
+static unsigned long elapsed_ns(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+static void queue_push(ACTOR_CMD *cmd) {
+    cmd->next = NULL;
+    ACTOR_CMD *prev = __atomic_exchange_n(&queue.head, cmd, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, cmd, __ATOMIC_RELEASE); // until this store the list is briefly cut here
+}
+
+// Pop the oldest command, or NULL if the queue is empty or a push is half done
+static ACTOR_CMD *queue_pop(void) {
+    ACTOR_CMD *tail = queue.tail;
+    ACTOR_CMD *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &queue.stub) {
+        if (!next) return NULL;
+        queue.tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        queue.tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE)) return NULL;
+    queue_push(&queue.stub); // tail is the last command, put the stub behind it so it can be taken
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        queue.tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void actor_push(ACTOR_CMD *cmd) {
+    clock_gettime(CLOCK_MONOTONIC, &cmd->pushed);
+    queue_push(cmd);
+    sem_post(&queue.items);
+}
+
+// Push a command and wait for the actor to carry it out
+static void actor_call(ACTOR_CMD *cmd) {
+    cmd->sync = 1;
+    Sem_init(&cmd->done, 0, 0);
+    actor_push(cmd);
+    while (sem_wait(&cmd->done) < 0) {
+        if (errno != EINTR) unix_error("sem_wait error");
+    }
+    sem_destroy(&cmd->done);
+}
+
+// Bring the views up to date and stop batching them, so what follows reaches clients in the order it would unbatched
+static void actor_unbatch_views(void) {
+    batch_views += player_view_batch_end();
+}
+
+// Hits are taken by the actor, right after the shot, rather than by the threads serving the victims
+static void actor_take_hit(PLAYER *victim) {
+    actor_unbatch_views(); // the victim's ALERT follows the views without it
+    player_take_laser_hit(victim);
+    player_view_batch_begin();
+}
+
+static void actor_apply(ACTOR_CMD *cmd) {
+    switch (cmd->type) {
+        case ACTOR_PACKET:
+            mzw_apply_packet(cmd->connfd, cmd->playerp ? cmd->playerp : &cmd->player, &cmd->pkt, cmd->data);
+            break;
+        case ACTOR_LOGOUT:
+            player_leave(cmd->player); // the service thread drains the player's output afterwards
+            break;
+        case ACTOR_RESPAWN:
+            { // the player may have logged out after the timer fired
+                PLAYER *p = player_get(player_get_avatar(cmd->player));
+                if (p == cmd->player) player_reset(p);
+                if (p) player_unref(p, "actor_apply");
+            }
+            break;
+    }
+}
+
+// Carry out a command and dispose of it, return its queueing delay
+static unsigned long actor_run(ACTOR_CMD *cmd) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long wait = elapsed_ns(&cmd->pushed, &now);
+    // LOGIN, logout and respawn send views before scores, so they are not batched with what precedes them
+    int ordered = cmd->sync || cmd->type != ACTOR_PACKET;
+    if (ordered) actor_unbatch_views();
+    actor_apply(cmd);
+    if (ordered) player_view_batch_begin();
+    if (cmd->sync) {
+        sem_post(&cmd->done); // cmd belongs to the waiter again
+    } else {
+        if (cmd->player) player_unref(cmd->player, "actor command");
+        free(cmd->data);
+        Free(cmd);
+    }
+    return wait;
+}
+
+static void actor_sem_wait(void) {
+    while (sem_wait(&queue.items) < 0) {
+        if (errno != EINTR) unix_error("sem_wait error");
+    }
+}
+
+// Take a post from queue.items for one more command, returning zero if none is to be had without waiting
+static int actor_wait_item(int block) {
+    if (spare_items > 0) { // taken while waiting for a push that had not completed
+        spare_items--;
+        return 1;
+    }
+    if (!block) return sem_trywait(&queue.items) == 0;
+    actor_sem_wait();
+    return 1;
+}
+
+// Pop the command a post was taken for, which may sit behind a push still in progress
+static ACTOR_CMD *actor_take(void) {
+    ACTOR_CMD *cmd;
+    while (!(cmd = queue_pop())) {
+        actor_sem_wait(); // the push ahead posts once it completes, sleep until then
+        spare_items++; // that post, or a later one, belongs to a command behind it
+    }
+    return cmd;
+}
+
+static void *actor_thread(void *arg) {
+    sigset_t mask; // leave SIGHUP to the main thread
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    while (1) {
+        actor_wait_item(1);
+        unsigned long wait_total = 0, wait_max = 0;
+        int n = 0;
+        batch_views = 0;
+        player_view_batch_begin(); // each view is computed once for everything drained below
+        do {
+            unsigned long wait = actor_run(actor_take());
+            wait_total += wait;
+            if (wait > wait_max) wait_max = wait;
+            n++;
+        } while (n < ACTOR_MAX_BATCH && actor_wait_item(0));
+        batch_views += player_view_batch_end();
+        pthread_mutex_lock(&stats_lock);
+        stats.commands += n;
+        stats.batches++;
+        if (n > stats.max_batch) stats.max_batch = n;
+        stats.views += batch_views;
+        stats.wait_ns_total += wait_total;
+        if (wait_max > stats.wait_ns_max) stats.wait_ns_max = wait_max;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return NULL;
+}
+
+// Timer thread: hand the respawn over to the actor
+static void actor_respawn(PLAYER *player) {
+    ACTOR_CMD *cmd = Calloc(1, sizeof *cmd);
+    cmd->type = ACTOR_RESPAWN;
+    cmd->player = player_ref(player, "actor_respawn");
+    actor_push(cmd);
+}
+
+void actor_init(void) {
+    queue.stub.next = NULL;
+    queue.head = queue.tail = &queue.stub;
+    Sem_init(&queue.items, 0, 0);
+    player_set_respawn_handler(actor_respawn);
+    player_set_hit_handler(actor_take_hit);
+    enabled = 1;
+    Pthread_create(&actor_tid, NULL, actor_thread, NULL);
+    debug("Game state owned by the actor thread");
+}
+
+int actor_enabled(void) {
+    return enabled;
+}
+
+void actor_handle_packet(int connfd, PLAYER **playerp, MZW_PACKET *pkt, void *data) {
+    if (!*playerp) { // LOGIN decides what *playerp becomes, so wait for it
+        ACTOR_CMD cmd = {.type = ACTOR_PACKET, .connfd = connfd, .playerp = playerp, .pkt = *pkt, .data = data};
+        actor_call(&cmd);
+        return;
+    }
+    ACTOR_CMD *cmd = Calloc(1, sizeof *cmd);
+    cmd->type = ACTOR_PACKET;
+    cmd->connfd = connfd;
+    cmd->player = player_ref(*playerp, "actor_handle_packet");
+    cmd->pkt = *pkt;
+    if (data && pkt->size) { // the caller's payload is borrowed
+        cmd->data = Malloc(pkt->size);
+        memcpy(cmd->data, data, pkt->size);
+    }
+    actor_push(cmd);
+}
+
+void actor_leave(PLAYER *player) {
+    ACTOR_CMD cmd = {.type = ACTOR_LOGOUT, .player = player};
+    actor_call(&cmd);
+}
+
+void actor_logout(PLAYER *player) {
+    actor_leave(player);
+    player_close(player); // may wait on the client, which the actor never does
+}
+
+void actor_get_stats(ACTOR_STATS *st) {
+    pthread_mutex_lock(&stats_lock);
+    *st = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void actor_report(void) {
+    if (!enabled) return;
+    ACTOR_STATS st;
+    actor_get_stats(&st);
+    info("Actor: %lu commands in %lu batches (max %d), %lu views, avg queueing %lu ns, max %lu ns",
+         st.commands, st.batches, st.max_batch, st.views,
+         st.commands ? st.wait_ns_total / st.commands : 0, st.wait_ns_max);
+}
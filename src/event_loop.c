@@ -0,0 +1,208 @@
+#include "event_loop.h"
+#include "server.h"
+#include "protocol.h"
+#include "client_registry.h"
+#include "player.h"
+#include "actor.h"
+#include "csapp.h"
+#include "debug.h"
+#include <sys/epoll.h>
+
+#define EVL_MAX_EVENTS 64 // events taken per epoll_wait
+#define EVL_INIT_BUFSIZE 1024 // initial receive buffer, grown to fit the largest packet seen
+
+struct evl_conn;
+
+typedef struct evl_source { // what an epoll event refers to
+    struct evl_conn *conn;
+    int mailbox; // nonzero for the player's event fd, zero for the client socket
+} EVL_SOURCE;
+
+typedef struct evl_conn {
+    int fd; // client socket file descriptor
+    EVL_SOURCE sock;
+    EVL_SOURCE mail;
+    PLAYER *player; // NULL until LOGIN succeeds
+    char *buf; // bytes received but not yet parsed into packets
+    size_t len; // number of bytes in buf
+    size_t cap; // allocated size of buf
+    int closed; // shut down, freed once the events of the current wakeup are handled
+    struct evl_conn *next_closed;
+} EVL_CONN;
+
+typedef struct event_loop {
+    int epfd; // epoll instance for this loop's connections
+    pthread_t tid;
+    EVL_CONN *closed; // connections closed during this wakeup
+} EVENT_LOOP;
+
+static EVENT_LOOP loops[EVL_MAX_LOOPS];
+static int num_loops;
+static unsigned int next_loop; // round-robin assignment of new connections (only the accept loop writes it)
+
+// Give up a connection's descriptor, once nothing more is written to it
+static void evl_release_fd(int fd) {
+    creg_unregister(client_registry, fd);
+    proto_set_version(fd, PROTO_VERSION_1); // the descriptor may be reused by a new connection
+    Close(fd);
+}
+
+typedef struct evl_closing { // a connection whose player's output is still draining
+    int fd;
+    PLAYER *player;
+} EVL_CLOSING;
+
+// Finish a logout the loop has started, waiting for the client as the loop must not
+static void *evl_closer(void *arg) {
+    EVL_CLOSING *c = arg;
+    Pthread_detach(pthread_self());
+    sigset_t mask; // leave SIGHUP to the main thread, as the loops do
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    player_close(c->player);
+    evl_release_fd(c->fd);
+    Free(c);
+    return NULL;
+}
+
+static void evl_conn_close(EVENT_LOOP *loop, EVL_CONN *conn) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (conn->player) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, player_get_eventfd(conn->player), NULL);
+        mzw_leave(conn->player);
+        EVL_CLOSING *c = Malloc(sizeof *c);
+        c->fd = conn->fd;
+        c->player = conn->player;
+        pthread_t tid;
+        Pthread_create(&tid, NULL, evl_closer, c); // still registered, so termination waits for it
+    } else {
+        evl_release_fd(conn->fd);
+    }
+    // the other fd of the connection may still have an event pending in this wakeup
+    conn->closed = 1;
+    conn->next_closed = loop->closed;
+    loop->closed = conn;
+}
+
+static void evl_free_closed(EVENT_LOOP *loop) {
+    EVL_CONN *next;
+    for (EVL_CONN *conn = loop->closed; conn; conn = next) {
+        next = conn->next_closed;
+        Free(conn->buf);
+        Free(conn);
+    }
+    loop->closed = NULL;
+}
+
+// Dispatch every complete packet in the receive buffer, checking for hits before each one
+static void evl_conn_dispatch(EVENT_LOOP *loop, EVL_CONN *conn) {
+    size_t off = 0;
+    while (1) {
+        if (conn->player && !actor_enabled() && player_has_events(conn->player)) {
+            player_take_laser_hit(conn->player); // the respawn is left to the timer wheel
+        }
+        MZW_PACKET pkt;
+        void *data;
+        size_t used = proto_parse_packet(conn->fd, conn->buf + off, conn->len - off, &pkt, &data);
+        if (used == 0) break; // rest of the packet has not arrived yet
+        int logged_in = conn->player != NULL;
+        mzw_handle_packet(conn->fd, &conn->player, &pkt, data);
+        if (!logged_in && conn->player && !actor_enabled()) { // in actor mode the actor takes the hits
+            struct epoll_event mev = {.events = EPOLLIN, .data.ptr = &conn->mail};
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, player_get_eventfd(conn->player), &mev);
+        }
+        off += used;
+    }
+    memmove(conn->buf, conn->buf + off, conn->len - off);
+    conn->len -= off;
+}
+
+static void evl_conn_input(EVENT_LOOP *loop, EVL_CONN *conn) {
+    if (conn->len == conn->cap) { // a packet larger than the buffer is arriving
+        conn->cap *= 2;
+        conn->buf = Realloc(conn->buf, conn->cap);
+    }
+    ssize_t n = recv(conn->fd, conn->buf + conn->len, conn->cap - conn->len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return; // spurious wakeup, try again on the next one
+    }
+    if (n <= 0) { // EOF or real error
+        evl_conn_close(loop, conn);
+        return;
+    }
+    conn->len += n;
+    evl_conn_dispatch(loop, conn);
+}
+
+// A laser hit (or a stale wakeup) was posted to the player's mailbox
+static void evl_conn_mail(EVL_CONN *conn) {
+    player_take_laser_hit(conn->player);
+}
+
+static void *evl_thread(void *arg) {
+    EVENT_LOOP *loop = arg;
+    sigset_t mask; // leave SIGHUP to the main thread, terminate() waits for the loops to drain
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    struct epoll_event events[EVL_MAX_EVENTS];
+    while (1) {
+        // a laser hit makes the victim's mailbox readable, so it wakes the loop serving the victim
+        int n = epoll_wait(loop->epfd, events, EVL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) unix_error("epoll_wait error");
+            n = 0;
+        }
+        player_batch_begin(); // output for the whole wakeup is written once per player at the end
+        for (int i = 0; i < n; i++) {
+            EVL_SOURCE *src = events[i].data.ptr;
+            if (src->conn->closed) continue;
+            if (src->mailbox) {
+                evl_conn_mail(src->conn);
+            } else {
+                evl_conn_input(loop, src->conn);
+            }
+        }
+        player_batch_end();
+        evl_free_closed(loop);
+    }
+    return NULL;
+}
+
+void evl_init(int nloops) {
+    if (nloops < 1) nloops = 1;
+    if (nloops > EVL_MAX_LOOPS) nloops = EVL_MAX_LOOPS;
+    num_loops = nloops;
+    for (int i = 0; i < num_loops; i++) {
+        loops[i].closed = NULL;
+        if ((loops[i].epfd = epoll_create1(0)) < 0) {
+            unix_error("epoll_create1 error");
+        }
+        Pthread_create(&loops[i].tid, NULL, evl_thread, &loops[i]);
+    }
+    debug("Started %d event loops", num_loops);
+}
+
+void evl_add_client(int connfd) {
+    evl_add_client_to(next_loop++, connfd);
+}
+
+void evl_add_client_to(int index, int connfd) {
+    creg_register(client_registry, connfd); // register clientfd into creg
+    EVL_CONN *conn = Calloc(1, sizeof *conn);
+    conn->fd = connfd;
+    conn->cap = EVL_INIT_BUFSIZE;
+    conn->buf = Malloc(conn->cap);
+    conn->sock.conn = conn->mail.conn = conn;
+    conn->mail.mailbox = 1;
+    EVENT_LOOP *loop = &loops[(unsigned int)index % num_loops];
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &conn->sock};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+        debug("epoll_ctl failed for fd %d", connfd);
+        creg_unregister(client_registry, connfd);
+        Close(connfd);
+        Free(conn->buf);
+        Free(conn);
+    }
+}
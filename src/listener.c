@@ -0,0 +1,263 @@
+#include "listener.h"
+#include "server.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "csapp.h"
+#include "debug.h"
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define LSN_MAX_CPUS 1024 // size of the affinity mask
+#define LSN_BACKOFF_MAX_MS 256 // longest pause after failed accepts, doubling from 1 ms
+#define LSN_LOG_INTERVAL 10 // seconds between reports of failing accepts
+
+typedef struct listener {
+    int listenfd; // this listener's own SO_REUSEPORT socket
+    int index;
+    int cpu; // -1 if not pinned
+    int event_loops; // hand connections to the event loops instead of service threads
+    char *path; // socket file of an AF_UNIX listener, NULL for TCP
+    pthread_t tid;
+    struct timespec started;
+    pthread_mutex_t lock; // protects the counters, which service threads update as they finish
+    unsigned long accepted;
+    unsigned long failed; // accepts that failed, e.g. for want of descriptors
+    int active;
+    int peak;
+} LISTENER;
+
+typedef struct lsn_conn { // argument of a service thread started by a listener
+    int connfd;
+    LISTENER *listener;
+} LSN_CONN;
+
+static LISTENER listeners[LSN_MAX_LISTENERS + 1]; // room for an AF_UNIX listener after the TCP ones
+static int num_listeners;
+
+// open_listenfd with SO_REUSEPORT, so that every listener can bind the same port (modification of CSAPP)
+static int open_reuseport_listenfd(char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+        return -1;
+    }
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval) == 0 &&
+            bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(listp);
+    if (listenfd >= 0 && listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+// Listening AF_UNIX stream socket at path, replacing a socket left behind by an earlier run
+static int open_unix_listenfd(char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) { // never remove anything but a socket
+        unlink(path);
+    }
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0) return -1;
+    if (bind(listenfd, (SA *)&addr, sizeof addr) < 0 || listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+// Service thread wrapper that keeps the listener's count of active connections
+static void *lsn_service(void *arg) {
+    LSN_CONN *conn = arg;
+    LISTENER *l = conn->listener;
+    int *connfdp = Malloc(sizeof *connfdp);
+    *connfdp = conn->connfd;
+    Free(conn);
+    mzw_client_service(connfdp); // detaches this thread
+    pthread_mutex_lock(&l->lock);
+    l->active--;
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+static void *lsn_thread(void *arg) {
+    LISTENER *l = arg;
+    sigset_t mask; // leave SIGHUP to the main thread, which terminates the server
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (l->cpu >= 0) { // threads created from here on inherit the binding
+        // raw system call, the glibc CPU_SET API needs _GNU_SOURCE, which clashes with csapp.h
+        unsigned long set[LSN_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+        set[l->cpu / (8 * sizeof(unsigned long))] = 1UL << (l->cpu % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_sched_setaffinity, 0, sizeof set, set) < 0) { // 0 = the calling thread
+            debug("Listener %d could not be pinned to CPU %d", l->index, l->cpu);
+            l->cpu = -1;
+        }
+    }
+    if (!l->event_loops && wp_enabled()) { // this listener's own workers, on its core if pinned
+        wp_start(l->index);
+    }
+    int backoff_ms = 0; // pause before the next accept, while they keep failing
+    time_t logged = -LSN_LOG_INTERVAL; // when failures were last reported
+    unsigned long unlogged = 0; // failures since then
+    while (1) {
+        struct sockaddr_storage clientaddr;
+        socklen_t clientlen = sizeof(clientaddr);
+        int connfd = accept(l->listenfd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue; // nothing wrong with the listener
+            // e.g. out of descriptors: keep listening rather than take the server down, but the pending
+            // connection stays queued and would fail again at once, so wait for descriptors to be freed
+            pthread_mutex_lock(&l->lock);
+            l->failed++;
+            pthread_mutex_unlock(&l->lock);
+            unlogged++;
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec - logged >= LSN_LOG_INTERVAL) {
+                warn("Listener %d accept error: %s (%lu failures)", l->index, strerror(errno), unlogged);
+                logged = now.tv_sec;
+                unlogged = 0;
+            }
+            backoff_ms = backoff_ms ? backoff_ms * 2 : 1;
+            if (backoff_ms > LSN_BACKOFF_MAX_MS) backoff_ms = LSN_BACKOFF_MAX_MS;
+            struct timespec pause = {backoff_ms / 1000, (backoff_ms % 1000) * 1000000L};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        backoff_ms = 0;
+        int pooled = !l->event_loops && wp_enabled();
+        pthread_mutex_lock(&l->lock);
+        l->accepted++;
+        if (!l->event_loops && !pooled && ++l->active > l->peak) l->peak = l->active;
+        pthread_mutex_unlock(&l->lock);
+        if (l->event_loops) {
+            evl_add_client_to(l->index, connfd);
+            continue;
+        }
+        if (pooled) {
+            wp_submit(l->index, connfd);
+            continue;
+        }
+        LSN_CONN *conn = Malloc(sizeof *conn);
+        conn->connfd = connfd;
+        conn->listener = l;
+        pthread_t tid;
+        Pthread_create(&tid, NULL, lsn_service, conn);
+    }
+    return NULL;
+}
+
+static void lsn_init(LISTENER *l, int index, int cpu, int event_loops) {
+    l->index = index;
+    l->cpu = cpu;
+    l->event_loops = event_loops;
+    l->accepted = l->failed = 0;
+    l->active = l->peak = 0;
+    pthread_mutex_init(&l->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &l->started);
+}
+
+int lsn_start(char *port, int nlisteners, int pin, int event_loops) {
+    if (nlisteners < 1) nlisteners = 1;
+    if (nlisteners > LSN_MAX_LISTENERS) nlisteners = LSN_MAX_LISTENERS;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1) ncpus = 1;
+    for (int i = 0; i < nlisteners; i++) {
+        LISTENER *l = &listeners[i];
+        if ((l->listenfd = open_reuseport_listenfd(port)) < 0) {
+            unix_error("Open reuseport listener error");
+        }
+        lsn_init(l, i, pin ? (int)(i % ncpus) % LSN_MAX_CPUS : -1, event_loops);
+    }
+    num_listeners = nlisteners; // all sockets are bound before any accepts, so none misses its share
+    for (int i = 0; i < num_listeners; i++) {
+        Pthread_create(&listeners[i].tid, NULL, lsn_thread, &listeners[i]);
+    }
+    debug("Started %d listeners%s", num_listeners, pin ? " pinned to cores" : "");
+    return num_listeners;
+}
+
+int lsn_start_unix(char *path, int event_loops) {
+    if (num_listeners > 0 && listeners[num_listeners - 1].path) { // only one
+        errno = EEXIST;
+        return -1;
+    }
+    LISTENER *l = &listeners[num_listeners];
+    if ((l->listenfd = open_unix_listenfd(path)) < 0) {
+        return -1;
+    }
+    lsn_init(l, num_listeners, -1, event_loops);
+    l->path = path;
+    num_listeners++;
+    Pthread_create(&l->tid, NULL, lsn_thread, l);
+    debug("Listening on %s", path);
+    return 0;
+}
+
+void lsn_fini(void) {
+    for (int i = 0; i < num_listeners; i++) {
+        if (listeners[i].path) {
+            unlink(listeners[i].path);
+        }
+    }
+}
+
+int lsn_get_stats(int index, LSN_STATS *stats) {
+    if (index < 0 || index >= num_listeners) return -1;
+    LISTENER *l = &listeners[index];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - l->started.tv_sec) + (now.tv_nsec - l->started.tv_nsec) / 1e9;
+    pthread_mutex_lock(&l->lock);
+    stats->cpu = l->cpu;
+    stats->accepted = l->accepted;
+    stats->failed = l->failed;
+    stats->active = l->active;
+    stats->peak = l->peak;
+    pthread_mutex_unlock(&l->lock);
+    stats->rate = secs > 0 ? stats->accepted / secs : 0;
+    return 0;
+}
+
+void lsn_report(void) {
+    unsigned long total = 0;
+    LSN_STATS st;
+    for (int i = 0; i < num_listeners; i++) {
+        lsn_get_stats(i, &st);
+        total += st.accepted;
+    }
+    for (int i = 0; i < num_listeners; i++) {
+        lsn_get_stats(i, &st);
+        if (listeners[i].path) {
+            info("Listener %d (%s): accepted %lu (%.1f%%), %.2f/s, active %d, peak %d, failed %lu",
+                 i, listeners[i].path, st.accepted, total ? 100.0 * st.accepted / total : 0.0, st.rate,
+                 st.active, st.peak, st.failed);
+            continue;
+        }
+        info("Listener %d (cpu %d): accepted %lu (%.1f%%), %.2f/s, active %d, peak %d, failed %lu",
+             i, st.cpu, st.accepted, total ? 100.0 * st.accepted / total : 0.0, st.rate, st.active, st.peak,
+             st.failed);
+    }
+}
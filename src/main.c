@@ -3,6 +3,13 @@
 #include "server.h"
 #include "maze.h"
 #include "player.h"
+#include "event_loop.h"
+#include "listener.h"
+#include "worker_pool.h"
+#include "timer_wheel.h"
+#include "tick.h"
+#include "actor.h"
+#include "protocol.h"
 #include "debug.h"
 
 static void terminate(int status);
@@ -36,8 +43,24 @@ int main(int argc, char* argv[]){
   char *port = NULL;
   char *template_file = NULL;
   char **maze_template = default_maze; // fall back to hard-coded / default maze if maze_template empty/invalid
+  int event_loops = 0; // nonzero = serve clients from epoll event loops instead of a thread each
+  PROTO_BACKEND backend = PROTO_BACKEND_RW;
+  int queue_depth = 0; // nonzero = per-player outbound queue of this many packets
+  int listeners = 0; // nonzero = this many SO_REUSEPORT listeners instead of the main accept loop
+  int pin = 0; // bind listener i and its service threads to core i
+  int workers = 0; // nonzero = serve connections from a pool of this many threads
+  long stack_kb = 0; // worker stack size, 0 = system default
+  int admission = 0; // worker pool queue capacity, 0 = default
+  int tick_rate = 0; // nonzero = apply inputs in simulation ticks at this rate
+  int actor = 0; // nonzero = one thread owns the game state and carries out all requests
+  int udp_views = 0; // nonzero = clients may ask for their views over UDP
+  char *unix_path = NULL; // also listen on this AF_UNIX socket
+  PLAYER_SLOW_POLICY slow_policy = PLAYER_SLOW_NONE; // what is done about clients that stop reading
+  long high_water = PLAYER_HIGH_WATERMARK, low_water = -1; // bytes pending, -1 = a quarter of high_water
+  int lock_free = 0; // nonzero = maze cells are changed by compare-and-swap instead of under tile locks
+  int tile_size = 0; // nonzero = maze locked in tiles of this side, rather than as a whole
   int opt;
-  while((opt = getopt(argc, argv, "p:t:")) != -1){
+  while((opt = getopt(argc, argv, "p:t:eb:q:l:Pw:s:a:T:AuU:o:W:Lg:")) != -1){
     switch(opt){
       case 'p':{
         char *end;
@@ -53,8 +76,119 @@ int main(int argc, char* argv[]){
       case 't':
         template_file = optarg;
         break;
+      case 'e':
+        event_loops = 1;
+        break;
+      case 'b':
+        if(!strcmp(optarg, "rw")){
+          backend = PROTO_BACKEND_RW;
+        } else if(!strcmp(optarg, "uring")){
+          backend = PROTO_BACKEND_URING;
+        } else {
+          fprintf(stderr, "ERROR: Unknown network backend \"%s\" (must be rw or uring)\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'q':{
+        char *end;
+        long v = strtol(optarg, &end, 10);
+        if(end == optarg || *end != '\0' || v < 0 || v > 65536){
+          fprintf(stderr, "ERROR: Queue depth \"%s\" (must be 0-65536)\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        queue_depth = (int)v;
+        break;
+      }
+      case 'l':{
+        char *end;
+        long v = strtol(optarg, &end, 10);
+        if(end == optarg || *end != '\0' || v < 0 || v > LSN_MAX_LISTENERS){
+          fprintf(stderr, "ERROR: Listener count \"%s\" (must be 0-%d, 0 = one per core)\n", optarg, LSN_MAX_LISTENERS);
+          exit(EXIT_FAILURE);
+        }
+        listeners = v ? (int)v : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        break;
+      }
+      case 'P':
+        pin = 1;
+        break;
+      case 'w':
+      case 's':
+      case 'a':{
+        char *end;
+        long v = strtol(optarg, &end, 10);
+        if(end == optarg || *end != '\0' || v < (opt == 'w' ? 1 : 0) || v > 65536){
+          fprintf(stderr, "ERROR: Invalid %s \"%s\"\n",
+                  opt == 'w' ? "worker count" : opt == 's' ? "worker stack size (KiB)" : "admission queue size", optarg);
+          exit(EXIT_FAILURE);
+        }
+        if(opt == 'w') workers = (int)v;
+        else if(opt == 's') stack_kb = v;
+        else admission = (int)v;
+        break;
+      }
+      case 'T':{
+        char *end;
+        long v = strtol(optarg, &end, 10);
+        if(end == optarg || *end != '\0' || v < 1 || v > TICK_MAX_HZ){
+          fprintf(stderr, "ERROR: Tick rate \"%s\" (must be 1-%d Hz)\n", optarg, TICK_MAX_HZ);
+          exit(EXIT_FAILURE);
+        }
+        tick_rate = (int)v;
+        break;
+      }
+      case 'A':
+        actor = 1;
+        break;
+      case 'u':
+        udp_views = 1;
+        break;
+      case 'U':
+        unix_path = optarg;
+        break;
+      case 'o':
+        if(!strcmp(optarg, "drop")){
+          slow_policy = PLAYER_SLOW_DROP;
+        } else if(!strcmp(optarg, "conflate")){
+          slow_policy = PLAYER_SLOW_CONFLATE;
+        } else if(!strcmp(optarg, "disconnect")){
+          slow_policy = PLAYER_SLOW_DISCONNECT;
+        } else {
+          fprintf(stderr, "ERROR: Unknown slow client policy \"%s\" (must be drop, conflate or disconnect)\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'W':{
+        char *end;
+        high_water = strtol(optarg, &end, 10);
+        low_water = -1;
+        if(*end == ':'){
+          char *low = end + 1;
+          low_water = strtol(low, &end, 10);
+          if(end == low) low_water = -2;
+        }
+        if(end == optarg || *end != '\0' || high_water < 1 || high_water > (1L << 30) ||
+           low_water < -1 || low_water >= high_water){
+          fprintf(stderr, "ERROR: Watermarks \"%s\" (must be <high bytes>[:<low bytes>], low below high)\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      }
+      case 'L':
+        lock_free = 1;
+        break;
+      case 'g':{
+        char *end;
+        long v = strtol(optarg, &end, 10);
+        if(end == optarg || *end != '\0' || v < 1 || v > 65536){
+          fprintf(stderr, "ERROR: Tile size \"%s\" (must be 1-65536 cells)\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        tile_size = (int)v;
+        break;
+      }
       default:
-        fprintf(stderr, "Usage: util/mazewar [-p <port>] [-t <template file>]");
+        fprintf(stderr, "Usage: util/mazewar [-p <port>] [-t <template file>] [-e] [-b rw|uring] [-q <depth>] [-l <listeners>] [-P] [-w <workers> [-s <stack KiB>] [-a <queue>]] [-T <tick Hz> | -A] [-u] [-U <socket path>] [-o drop|conflate|disconnect [-W <high>[:<low>]]] [-L] [-g <tile size>]");
         exit(EXIT_FAILURE);
     }
   }
@@ -92,17 +226,75 @@ int main(int argc, char* argv[]){
   }
   signal_no_restart(SIGHUP,sighup_handler);
   signal_no_restart(SIGPIPE, SIG_IGN); // prevent CRTL + C on client terminal from killing server
+  if(proto_init_backend(backend) != 0){
+    fprintf(stderr, "ERROR: Network backend could not be initialized: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
   // Perform required initializations of the client_registry, maze, and player modules
   client_registry = creg_init();
+  maze_set_lock_free(lock_free);
+  if(tile_size){
+    maze_set_tile_size(tile_size);
+  }
   maze_init(maze_template); // changed from default_maze in the event we may need fallback if no valid -t
   player_init();
+  if(actor && tick_rate){
+    fprintf(stderr, "ERROR: -T and -A cannot be used together\n");
+    exit(EXIT_FAILURE);
+  }
+  if(actor && !queue_depth){ // the actor must never block writing to a client
+    queue_depth = ACTOR_QUEUE_DEPTH;
+  }
+  if(event_loops && !queue_depth){ // nor must a loop thread, which serves many
+    queue_depth = EVL_QUEUE_DEPTH;
+  }
+  player_set_queue_depth(queue_depth);
+  player_set_slow_policy(slow_policy, high_water, low_water < 0 ? high_water / 4 : low_water);
+  if(tick_rate){
+    tick_init(tick_rate);
+  }
+  if(actor){
+    actor_init();
+  }
+  if(udp_views && mzw_open_view_socket(port) != 0){
+    fprintf(stderr, "ERROR: UDP view socket could not be opened: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
   debug_show_maze = 1; // Show the maze after each packet.
+  if(event_loops){ // one loop per online CPU, capped by the event loop module
+    evl_init((int)sysconf(_SC_NPROCESSORS_ONLN));
+  }
+  if(workers && !event_loops){ // event loops need no service threads at all
+    // a slice for each listener, the AF_UNIX one included, otherwise one for the accept loop here
+    wp_init(workers, (size_t)stack_kb * 1024, admission, listeners ? listeners + (unix_path != NULL) : 1);
+  }
+  if(listeners){
+    lsn_start(port, listeners, pin, event_loops);
+  }
+  if(unix_path && lsn_start_unix(unix_path, event_loops) != 0){
+    fprintf(stderr, "ERROR: Could not listen on \"%s\": %s\n", unix_path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if(listeners){ // the accept threads do all the work, this thread only waits for SIGHUP
+    while(1) pause();
+  }
   // Server setup with accept loop
   int listenfd = Open_listenfd(port);
+  if(wp_enabled()){
+    wp_start(0);
+  }
   while(1){
     struct sockaddr_storage clientaddr;
     socklen_t clientlen = sizeof(clientaddr);
     int connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+    if(event_loops){
+      evl_add_client(connfd);
+      continue;
+    }
+    if(wp_enabled()){
+      wp_submit(0, connfd);
+      continue;
+    }
     int *connfdp = Malloc(sizeof *connfdp);
     *connfdp = connfd;
     pthread_t tid;
@@ -122,8 +314,16 @@ void terminate(int status) {
     debug("All service threads terminated.");
     // Finalize modules.
     creg_fini(client_registry);
+    lsn_report();
+    lsn_fini();
+    wp_report();
+    tw_report();
+    tick_report();
+    actor_report();
     player_fini();
+    tw_fini();
     maze_fini();
+    proto_fini_backend();
     debug("MazeWar server terminating");
     exit(status);
 }
\ No newline at end of file
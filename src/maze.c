@@ -1,56 +1,286 @@
 #include "maze.h"
 #include "csapp.h"
+#include <sched.h>
 
+#define MAZE_ALIGN 64 // cache line
+#define GUARD '\0' // border cell: stops moves, searches and corridors, but is neither a wall nor an avatar
+#define MAZE_RANDOM_PICKS 16 // tries at random before placement walks the maze
+
+// The cells are one allocation: each row is padded to a power-of-two stride, and a ring of GUARD
+// cells surrounds the maze, so a step from any cell of the maze is a valid index and none is bounds-checked
 static int maze_rows;
 static int maze_cols;
-static OBJECT **maze_cells;
-static pthread_mutex_t maze_mutex;
+static int maze_shift; // log2 of the row stride
+static OBJECT *maze_block; // the allocation, starting with the top guard row
+static OBJECT *maze_cells; // cell (0,0), cell (r,c) is at (r << maze_shift) + c
+static long maze_step[NUM_DIRECTIONS]; // index increment for one unit in each direction
 static const int dr[NUM_DIRECTIONS] = {-1, 0, 1, 0};
 static const int dc[NUM_DIRECTIONS] = {0, -1, 0, 1};
 
-// Initialize maze (row,col), populate the array using template, initialize MUTEX, set SRAND
+// The allocation, guard ring included, is divided into square tiles, each with a lock for writers
+// and a version for optimistic readers.  Tiles are numbered row by row, and whoever needs several
+// locks takes them in that order.
+typedef struct maze_tile {
+    _Alignas(MAZE_ALIGN) pthread_mutex_t lock; // a line to itself, so writers on different tiles do not share
+} MAZE_TILE;
+
+static int maze_tile_shift = 30; // log2 of the tile side, in cells, by default wider than any maze
+static int maze_tile_rows; // rows of tiles
+static int maze_across_shift; // log2 of the number of tiles in a row
+static int maze_ntiles;
+static int maze_one_tile; // the default: tile 0 covers everything, so no query or change looks a tile up
+static int maze_read_max; // most tiles a query can touch
+// Counts of the writes to a tile, equal when none is in progress.  In lock-free mode writers to a
+// tile do not exclude one another, so a single odd/even version would not do.
+typedef struct tile_version {
+    unsigned begun;
+    unsigned ended;
+} TILE_VERSION;
+
+static MAZE_TILE *maze_tiles;
+static TILE_VERSION *maze_versions; // packed, since readers consult them far more often than writers change them
+static int maze_locked_reads;
+static int maze_lock_free; // cells are changed by compare-and-swap, and the tile locks are not used
+static unsigned long maze_read_retries;
+
+// Every cell that is not a wall, in order, so that a random pick is one read.  It is fixed at
+// maze_init(): entries for occupied cells are left in place, and placement skips them by claiming
+// the cell it picks only if it is still empty, so that changes never touch it.
+static int *maze_floor; // int, to keep the index small
+static int maze_nfloor;
+
+typedef struct tile_read { // a tile seen by an optimistic reader, with the writes it had seen begin
+    unsigned *begunp;
+    unsigned begun;
+} TILE_READ;
+
+// show_maze() and maze_snapshot() copy the maze into one buffer kept with it, so calls take turns
+static pthread_mutex_t show_lock = PTHREAD_MUTEX_INITIALIZER;
+static OBJECT *show_copy;
+static TILE_READ *show_reads;
+
+static inline long maze_index(int row, int col) {
+    return ((long)row << maze_shift) + col;
+}
+
+// Tile number of a cell given by its row and column in the allocation
+static inline int maze_tile_at(int brow, int bcol) {
+    return ((brow >> maze_tile_shift) << maze_across_shift) + (bcol >> maze_tile_shift);
+}
+
+static inline MAZE_TILE *maze_tile_of(OBJECT *cell) {
+    long off = cell - maze_block;
+    return &maze_tiles[maze_tile_at(off >> maze_shift, off & ((1L << maze_shift) - 1))];
+}
+
+// Cells are read and written with relaxed atomics, since optimistic readers run alongside writers
+static inline OBJECT cell_load(OBJECT *cell) {
+    return __atomic_load_n(cell, __ATOMIC_RELAXED);
+}
+
+static inline void cell_store(OBJECT *cell, OBJECT object) {
+    __atomic_store_n(cell, object, __ATOMIC_RELAXED);
+}
+
+// Writers bracket their stores, so readers can tell they overlapped one.  Under the tile lock
+// there is one writer at a time, and the counts need no atomic increment.
+static inline void maze_write_begin(MAZE_TILE *tile) {
+    unsigned *begunp = &maze_versions[tile - maze_tiles].begun;
+    if (maze_lock_free) __atomic_fetch_add(begunp, 1, __ATOMIC_RELAXED);
+    else __atomic_store_n(begunp, *begunp + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void maze_write_end(MAZE_TILE *tile) {
+    unsigned *endedp = &maze_versions[tile - maze_tiles].ended;
+    if (maze_lock_free) __atomic_fetch_add(endedp, 1, __ATOMIC_RELEASE);
+    else __atomic_store_n(endedp, *endedp + 1, __ATOMIC_RELEASE);
+}
+
+// In lock-free mode, change a cell only if it holds what the caller expects
+static inline int cell_swap(OBJECT *cell, OBJECT expected, OBJECT object) {
+    return __atomic_compare_exchange_n(cell, &expected, object, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+// Lock the two tiles of a move in order, which may be one tile
+static void maze_lock_pair(MAZE_TILE *a, MAZE_TILE *b) {
+    if (a > b) {
+        MAZE_TILE *t = a;
+        a = b;
+        b = t;
+    }
+    pthread_mutex_lock(&a->lock);
+    if (b != a) pthread_mutex_lock(&b->lock);
+}
+
+static void maze_unlock_pair(MAZE_TILE *a, MAZE_TILE *b) {
+    pthread_mutex_unlock(&a->lock);
+    if (b != a) pthread_mutex_unlock(&b->lock);
+}
+
+// Lock or unlock the tiles covering rows r0..r1 and columns c0..c1 of the allocation, clamped to it
+static void maze_lock_region(int r0, int c0, int r1, int c1, int lock) {
+    if (maze_one_tile) {
+        if (lock) pthread_mutex_lock(&maze_tiles->lock);
+        else pthread_mutex_unlock(&maze_tiles->lock);
+        return;
+    }
+    int last_row = maze_rows + 1, last_col = (1 << maze_shift) - 1;
+    if (r0 > r1) { int t = r0; r0 = r1; r1 = t; }
+    if (c0 > c1) { int t = c0; c0 = c1; c1 = t; }
+    r0 = r0 < 0 ? 0 : r0;
+    c0 = c0 < 0 ? 0 : c0;
+    r1 = r1 > last_row ? last_row : r1;
+    c1 = c1 > last_col ? last_col : c1;
+    for (int tr = r0 >> maze_tile_shift; tr <= r1 >> maze_tile_shift; tr++) {
+        for (int tc = c0 >> maze_tile_shift; tc <= c1 >> maze_tile_shift; tc++) {
+            MAZE_TILE *tile = &maze_tiles[(tr << maze_across_shift) + tc];
+            if (lock) pthread_mutex_lock(&tile->lock);
+            else pthread_mutex_unlock(&tile->lock);
+        }
+    }
+}
+
+// Wait out writers in progress on the tile, and return the writes begun the read starts from.
+// Reading ended first, a write beginning in between makes the counts differ.
+static inline unsigned maze_read_begin(TILE_VERSION *version) {
+    while (1) {
+        unsigned ended = __atomic_load_n(&version->ended, __ATOMIC_ACQUIRE);
+        unsigned begun = __atomic_load_n(&version->begun, __ATOMIC_ACQUIRE);
+        if (begun == ended) return begun;
+        sched_yield(); // the writer may have been preempted
+    }
+}
+
+// Record a tile about to be read.  Queries walk straight lines, so a tile once left is never
+// entered again, and callers only have to avoid recording the tile they are in twice.
+static inline void maze_read_tile(TILE_READ *reads, int *np, MAZE_TILE *tile) {
+    TILE_VERSION *version = &maze_versions[tile - maze_tiles];
+    reads[*np].begunp = &version->begun;
+    reads[*np].begun = maze_read_begin(version);
+    (*np)++;
+}
+
+// Number of steps in a direction from a cell, counting the cell, before the next one is in another tile
+static inline int maze_tile_run(OBJECT *cell, int dir) {
+    long off = cell - maze_block;
+    int mask = (1 << maze_tile_shift) - 1;
+    int along = dc[dir] ? off & mask : (off >> maze_shift) & mask; // position within the tile
+    return dr[dir] + dc[dir] < 0 ? along + 1 : mask + 1 - along;
+}
+
+// Nonzero if a writer changed the tile since maze_read_begin(), for a read that only needs one
+static inline int maze_read_retry_one(TILE_VERSION *version, unsigned begun) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&version->begun, __ATOMIC_RELAXED) == begun) return 0;
+    __atomic_fetch_add(&maze_read_retries, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Nonzero if a writer changed one of the tiles read, so what was copied must be discarded.
+// The tiles are all checked after all the cells were read, so the copy is a snapshot of the
+// moment just before the first check.
+static inline int maze_read_retry(TILE_READ *reads, int n) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        if (__atomic_load_n(reads[i].begunp, __ATOMIC_RELAXED) != reads[i].begun) {
+            __atomic_fetch_add(&maze_read_retries, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Only arguments from callers are checked, one unsigned comparison per coordinate
+static inline int maze_contains(int row, int col) {
+    return (unsigned)row < (unsigned)maze_rows && (unsigned)col < (unsigned)maze_cols;
+}
+
+// Initialize maze (row,col), populate the array using template, initialize the tile locks, set SRAND
 void maze_init(char **template) {
     int rows;
     for (rows = 0; template[rows] != NULL; rows++); // count rows not NULL (NULL denotes end of MAZE generation)
     maze_rows = rows;
-    if(maze_rows == 0){ // maze must be empty
-        maze_cols = 0;
-        maze_cells = NULL;
-        pthread_mutex_init(&maze_mutex, NULL);
-        return;
-    }
-    maze_cols = strlen(template[0]);
+    maze_cols = rows ? strlen(template[0]) : 0;
     for (rows = 1; rows < maze_rows; rows++){ // ensure rectangular-shape maze
         if((int)strlen(template[rows]) != maze_cols){
             fprintf(stderr, "Maze is not in rectangular shape, inconsistent row lengths in template\n");
             exit(EXIT_FAILURE);
         }
     }
-    OBJECT **cells = Malloc(maze_rows * sizeof(char*));
-    for(rows = 0; rows < maze_rows; rows++){
-        cells[rows] = Malloc((maze_cols + 1) * sizeof(char));
-        memcpy(cells[rows], template[rows], maze_cols + 1);
+    int shift = 0;
+    while ((1 << shift) < maze_cols + 2) shift++; // a guard column on each side
+    size_t size = (size_t)(maze_rows + 2) << shift; // and a guard row above and below
+    void *block = NULL; // unix_error() does not return, but the compiler cannot tell
+    if ((errno = posix_memalign(&block, MAZE_ALIGN, size)) != 0) {
+        unix_error("posix_memalign error");
     }
-    pthread_mutex_init(&maze_mutex, NULL);
-    pthread_mutex_lock(&maze_mutex);
+    memset(block, GUARD, size);
+    OBJECT *cells = (OBJECT *)block + (1L << shift) + 1;
+    for (rows = 0; rows < maze_rows; rows++){
+        memcpy(cells + ((long)rows << shift), template[rows], maze_cols);
+    }
+    maze_shift = shift;
+    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        maze_step[dir] = ((long)dr[dir] << shift) + dc[dir];
+    }
+    maze_block = block;
     maze_cells = cells;
-    pthread_mutex_unlock(&maze_mutex);
+    maze_tile_rows = ((maze_rows + 1) >> maze_tile_shift) + 1;
+    maze_across_shift = shift > maze_tile_shift ? shift - maze_tile_shift : 0;
+    maze_ntiles = maze_tile_rows << maze_across_shift;
+    maze_one_tile = maze_ntiles == 1;
+    int longest = maze_tile_rows > (1 << maze_across_shift) ? maze_tile_rows : 1 << maze_across_shift;
+    maze_read_max = 3 * (longest + 1); // a view reads three lines, a target search one
+    void *tiles = NULL;
+    if ((errno = posix_memalign(&tiles, MAZE_ALIGN, maze_ntiles * sizeof(MAZE_TILE))) != 0) {
+        unix_error("posix_memalign error");
+    }
+    maze_tiles = tiles;
+    maze_versions = Calloc(maze_ntiles, sizeof(TILE_VERSION));
+    for (int i = 0; i < maze_ntiles; i++) {
+        pthread_mutex_init(&maze_tiles[i].lock, NULL);
+    }
+    maze_floor = Malloc(((size_t)maze_rows * maze_cols + 1) * sizeof(int));
+    show_copy = Malloc(((size_t)maze_rows << shift) + 1);
+    show_reads = Malloc(maze_ntiles * sizeof(TILE_READ));
+    maze_nfloor = 0;
+    for (rows = 0; rows < maze_rows; rows++){
+        for (int columns = 0; columns < maze_cols; columns++){
+            long index = maze_index(rows, columns);
+            if (!IS_WALL(maze_cells[index])) maze_floor[maze_nfloor++] = index;
+        }
+    }
     srand(time(NULL)); // seed the pseudo-random number generator for random player in maze placement
 }
 
-// Free maze and destroy maze mutex
+// Free maze and destroy the tile locks
 void maze_fini() {
-    pthread_mutex_lock(&maze_mutex);
-    if (maze_cells != NULL){ // maze exist, free whole maze
-        for (int rows = 0; rows < maze_rows; rows++){
-            Free(maze_cells[rows]);
-        }
-        Free(maze_cells);
-        maze_cells = NULL;
+    for (int i = 0; i < maze_ntiles; i++) {
+        pthread_mutex_destroy(&maze_tiles[i].lock);
     }
-    pthread_mutex_unlock(&maze_mutex);
-    pthread_mutex_destroy(&maze_mutex);
+    free(maze_tiles);
+    Free(maze_versions);
+    free(maze_block);
+    Free(maze_floor);
+    Free(show_copy);
+    Free(show_reads);
+    show_copy = NULL;
+    show_reads = NULL;
+    maze_floor = NULL;
+    maze_nfloor = 0;
+    maze_tiles = NULL;
+    maze_versions = NULL;
+    maze_block = maze_cells = NULL;
+    maze_ntiles = 0;
 }
+
+void maze_set_tile_size(int size) {
+    int shift = 0;
+    while ((1 << shift) < size && shift < 30) shift++;
+    maze_tile_shift = shift;
+}
+
 // Getters for the maze rows and columns (total amount)
 int maze_get_rows() {
     return maze_rows;
@@ -60,144 +290,266 @@ int maze_get_cols() {
     return maze_cols;
 }
 
+// Replace what a cell holds if it is what the caller expects, return nonzero if it was
+static int maze_change_cell(OBJECT *cell, OBJECT expected, OBJECT object) {
+    MAZE_TILE *tile = maze_one_tile ? maze_tiles : maze_tile_of(cell);
+    int changed;
+    if (maze_lock_free) {
+        if (cell_load(cell) != expected) return 0; // spare readers a retry
+        maze_write_begin(tile);
+        changed = cell_swap(cell, expected, object);
+        maze_write_end(tile);
+        return changed;
+    }
+    pthread_mutex_lock(&tile->lock);
+    changed = *cell == expected;
+    if (changed) {
+        maze_write_begin(tile);
+        cell_store(cell, object);
+        maze_write_end(tile);
+    }
+    pthread_mutex_unlock(&tile->lock);
+    return changed;
+}
+
 // Set the player with avatar at (row,col)
 int maze_set_player(OBJECT avatar, int row, int col) {
-    int result;
-    pthread_mutex_lock(&maze_mutex);
-    // Check bounds and position must be empty
-    if (row < 0 || row >= maze_rows || col < 0 || col >= maze_cols || !IS_EMPTY(maze_cells[row][col])){
-        result = 1; // could not find a spot
-    }
-    else{
-        maze_cells[row][col] = avatar;
-        result = 0; // was able to find a spot and place avatar
+    if (!maze_contains(row, col)){
+        return 1; // out of bounds
     }
-    pthread_mutex_unlock(&maze_mutex);
-    return result;
+    // Position must be empty, otherwise could not find a spot
+    return !maze_change_cell(maze_cells + maze_index(row, col), EMPTY, avatar);
 }
 
-// Randomly set player with avatar at (row,col) repeatedly until success or give up
+// Place the player with avatar at a random empty cell, picked from the floor cells
 int maze_set_player_random(OBJECT avatar, int *rowp, int *colp) {
-    if (maze_rows == 0 || maze_cols == 0){
-        return 1;
-    }
-    pthread_mutex_lock(&maze_mutex);
-    int empty_count = 0; // precompute empty spaces and place randomly over these spots
-    for (int rows = 0; rows < maze_rows; rows++){
-        for (int columns = 0; columns < maze_cols; columns++){
-            if(maze_cells[rows][columns] == EMPTY){
-                empty_count++;
-            }
-        }
-    }
-    if (empty_count == 0){ // no space to place on maze
-        pthread_mutex_unlock(&maze_mutex);
-        *rowp = *colp = -1;
-        return 1;
-    }
-    typedef struct{
-        int row,col;
-    } Position;
-    // Scan for empty spots, create a struct containg all valid locations, pick a random location from the valid spots
-    Position *empties = Malloc(empty_count * sizeof(Position)); // create an arary of struct containg valid (row,col)
-    int index = 0;
-    for (int rows = 0; rows < maze_rows; rows++){
-        for (int columns = 0; columns < maze_cols; columns++){
-            if (maze_cells[rows][columns] == EMPTY){
-                empties[index++] = (Position){.row = rows, .col = columns};
+    if (maze_nfloor > 0) {
+        // A few random picks nearly always find an empty cell; only a crowded maze is walked,
+        // from a random start, to find one of the last empty cells or know there is none
+        int start = rand() % maze_nfloor;
+        for (int i = 0; i < MAZE_RANDOM_PICKS + maze_nfloor; i++) {
+            long index = maze_floor[i < MAZE_RANDOM_PICKS ? rand() % maze_nfloor : (start + i) % maze_nfloor];
+            if (IS_EMPTY(cell_load(maze_cells + index)) && maze_change_cell(maze_cells + index, EMPTY, avatar)) {
+                *rowp = index >> maze_shift;
+                *colp = index & ((1L << maze_shift) - 1);
+                return 0;
             }
         }
     }
-    int pick = rand() % empty_count;
-    int pick_r = empties[pick].row;
-    int pick_c = empties[pick].col;
-    maze_cells[pick_r][pick_c] = avatar;
-    *rowp = pick_r;
-    *colp = pick_c;
-    Free(empties);
-    pthread_mutex_unlock(&maze_mutex);
-    return 0;
+    *rowp = *colp = -1; // no space to place on maze
+    return 1;
 }
 
 // Set position to empty (' ') if player is present there and within bound
 void maze_remove_player(OBJECT avatar, int row, int col) {
-    pthread_mutex_lock(&maze_mutex);
-    if (row >= 0 && row < maze_rows && col >=0 && col < maze_cols && maze_cells[row][col] == avatar){
-        maze_cells[row][col] = EMPTY;
+    if (!maze_contains(row, col)){
+        return;
     }
-    pthread_mutex_unlock(&maze_mutex);
+    maze_change_cell(maze_cells + maze_index(row, col), avatar, EMPTY);
 }
 
-int maze_move(int row, int col, int dir) {
-    pthread_mutex_lock(&maze_mutex);    
-    if (row < 0 || row >= maze_rows || col < 0 || col >= maze_cols || dir < 0 || dir >= NUM_DIRECTIONS){
-        pthread_mutex_unlock(&maze_mutex);
+// A move when one tile and its lock cover the whole maze
+static int maze_move_one_tile(OBJECT *from, OBJECT *to) {
+    pthread_mutex_lock(&maze_tiles->lock);
+    OBJECT object = *from;
+    if (!IS_AVATAR(object) || !IS_EMPTY(*to)) {
+        pthread_mutex_unlock(&maze_tiles->lock);
         return 1;
     }
-    OBJECT object = maze_cells[row][col]; // check if this object is the avatar
-    if(!IS_AVATAR(object)){
-        pthread_mutex_unlock(&maze_mutex);
+    TILE_VERSION *version = maze_versions; // the lock makes this the only writer
+    __atomic_store_n(&version->begun, version->begun + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    cell_store(from, EMPTY);
+    cell_store(to, object);
+    __atomic_store_n(&version->ended, version->ended + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&maze_tiles->lock);
+    return 0;
+}
+
+int maze_move(int row, int col, int dir) {
+    if (!maze_contains(row, col) || (unsigned)dir >= NUM_DIRECTIONS){
         return 1;
     }
-    // At this point we are within bound, legal direction to move, and player exists
-    // Calculate destination coordinates and ensure it still within bounds + empty
-    int new_row = row + dr[dir];
-    int new_col = col + dc[dir];
-    if (new_row < 0 || new_row >= maze_rows || new_col < 0 || new_col >= maze_cols || !IS_EMPTY(maze_cells[new_row][new_col])){
-        pthread_mutex_unlock(&maze_mutex);
-        return 1;
+    OBJECT *from = maze_cells + maze_index(row, col);
+    OBJECT *to = from + maze_step[dir]; // the guard ring keeps this inside the allocation
+    if (maze_one_tile && !maze_lock_free) return maze_move_one_tile(from, to);
+    MAZE_TILE *from_tile = maze_tile_of(from), *to_tile = maze_tile_of(to);
+    if (!maze_lock_free) maze_lock_pair(from_tile, to_tile); // moves elsewhere in the maze go ahead meanwhile
+    OBJECT object = cell_load(from); // check if this object is the avatar
+    // The destination must be empty, which a guard cell never is, so the move stays within bounds
+    int moved = IS_AVATAR(object) && IS_EMPTY(cell_load(to));
+    if (moved) {
+        maze_write_begin(from_tile); // readers see both cells change, or neither
+        if (to_tile != from_tile) maze_write_begin(to_tile);
+        if (maze_lock_free) {
+            // Claiming the destination is what makes the move happen.  Only the thread moving the
+            // avatar changes a cell holding it, so the source is still the avatar's and just emptied.
+            moved = cell_swap(to, EMPTY, object);
+            if (moved) cell_store(from, EMPTY);
+        } else {
+            cell_store(from, EMPTY); // set to empty as player has moved from the cell
+            cell_store(to, object); // set player to the destination, verified empty
+        }
+        if (to_tile != from_tile) maze_write_end(to_tile);
+        maze_write_end(from_tile);
     }
-    maze_cells[row][col] = EMPTY; // set to empty as player has moved from the cell
-    maze_cells[new_row][new_col] = object; // set player to new coordinates verified within bounds and empty
-    pthread_mutex_unlock(&maze_mutex);
-    return 0;
+    if (!maze_lock_free) maze_unlock_pair(from_tile, to_tile);
+    return !moved;
 }
 
-// Search from (row, col) in dir until AVATAR and returns AVATAR, otherwise EMPTY
-OBJECT maze_find_target(int row, int col, DIRECTION dir) {  
-    pthread_mutex_lock(&maze_mutex);
-    int r = row + dr[dir];
-    int c = col + dc[dir];
-    while(r >= 0 && r < maze_rows && c >= 0 && c < maze_cols){
-        OBJECT object = maze_cells[r][c];
-        if (!IS_EMPTY(object)){
-            pthread_mutex_unlock(&maze_mutex);
-            return IS_AVATAR(object) ? object : EMPTY; // if avatar return AVATAR, else return empty
+// Walk to the first non-empty cell
+static OBJECT maze_scan_target(OBJECT *cell, long step) {
+    OBJECT object = cell_load(cell);
+    while (IS_EMPTY(object)){ // the guard ring ends the search at the boundary
+        cell += step;
+        object = cell_load(cell);
+    }
+    return object;
+}
+
+// Walk to the first non-empty cell, recording the tiles read
+static OBJECT maze_scan_target_tiles(OBJECT *cell, int dir, TILE_READ *reads, int *np) {
+    long step = maze_step[dir];
+    int run = maze_tile_run(cell, dir); // the tile only has to be looked up when the walk leaves it
+    maze_read_tile(reads, np, maze_tile_of(cell));
+    OBJECT object = cell_load(cell);
+    while (IS_EMPTY(object)){
+        cell += step;
+        if (--run == 0) {
+            maze_read_tile(reads, np, maze_tile_of(cell));
+            run = 1 << maze_tile_shift;
         }
-        r += dr[dir];
-        c += dc[dir];
+        object = cell_load(cell);
     }
-    pthread_mutex_unlock(&maze_mutex);
-    return EMPTY;
+    return object;
 }
 
-int maze_get_view(VIEW *view, int row, int col, DIRECTION gaze, int depth) {
+// Search from (row, col) in dir until AVATAR and returns AVATAR, otherwise EMPTY
+OBJECT maze_find_target(int row, int col, DIRECTION dir) {
+    if (!maze_contains(row, col) || (unsigned)dir >= NUM_DIRECTIONS){
+        return EMPTY;
+    }
+    OBJECT *cell = maze_cells + maze_index(row, col) + maze_step[dir];
+    OBJECT object;
+    if (maze_locked_reads && !maze_lock_free) { // lock the tiles from the start to the edge of the maze
+        int brow = row + 1, bcol = col + 1;
+        int erow = dr[dir] < 0 ? 0 : dr[dir] > 0 ? maze_rows + 1 : brow;
+        int ecol = dc[dir] < 0 ? 0 : dc[dir] > 0 ? maze_cols + 1 : bcol;
+        maze_lock_region(brow, bcol, erow, ecol, 1);
+        object = maze_scan_target(cell, maze_step[dir]);
+        maze_lock_region(brow, bcol, erow, ecol, 0);
+    } else if (maze_one_tile) {
+        unsigned begun;
+        do {
+            begun = maze_read_begin(maze_versions);
+            object = maze_scan_target(cell, maze_step[dir]);
+        } while (maze_read_retry_one(maze_versions, begun));
+    } else {
+        TILE_READ reads[maze_read_max];
+        int n;
+        do {
+            n = 0;
+            object = maze_scan_target_tiles(cell, dir, reads, &n);
+        } while (maze_read_retry(reads, n));
+    }
+    return IS_AVATAR(object) ? object : EMPTY; // if avatar return AVATAR, else return empty
+}
+
+// Copy one row of the X3D rectangular view and return its corridor cell, unless that is the guard
+static inline OBJECT maze_copy_row(VIEW *view, int distance, OBJECT *cell, long left, long right) {
+    OBJECT object = cell_load(cell);
+    if (object == GUARD) return object; // the corridor has left the maze
+    OBJECT l = cell_load(cell + left), r = cell_load(cell + right); // the guard beside it is shown as empty
+    (*view)[distance][LEFT_WALL] = l == GUARD ? EMPTY : l;
+    (*view)[distance][CORRIDOR] = object;
+    (*view)[distance][RIGHT_WALL] = r == GUARD ? EMPTY : r;
+    return object;
+}
+
+static int maze_copy_view(VIEW *view, OBJECT *cell, DIRECTION gaze, int depth) {
+    long step = maze_step[gaze];
+    long left = maze_step[TURN_LEFT(gaze)];
+    long right = maze_step[TURN_RIGHT(gaze)];
     int distance;
-    pthread_mutex_lock(&maze_mutex);
-    for (distance = 0; distance < depth; distance++) {
-        // Compute corridor cells 
-        int row_distance = row + dr[gaze] * distance;
-        int column_distance = col + dc[gaze] * distance;
-        if (row_distance < 0 || row_distance >= maze_rows ||
-            column_distance < 0 || column_distance >= maze_cols) {
+    for (distance = 0; distance < depth; distance++, cell += step) {
+        OBJECT object = maze_copy_row(view, distance, cell, left, right);
+        if (object == GUARD) break;
+        if (distance > 0 && object != EMPTY) { // if not empty, include it, and stop
+            distance++;
             break;
         }
-        DIRECTION left  = TURN_LEFT(gaze);
-        DIRECTION right = TURN_RIGHT(gaze);
-        // Copy the X3D rectangular view
-        (*view)[distance][LEFT_WALL] = maze_cells[row_distance + dr[left]][column_distance + dc[left]];
-        (*view)[distance][CORRIDOR] = maze_cells[row_distance][column_distance];
-        (*view)[distance][RIGHT_WALL] = maze_cells[row_distance + dr[right]][column_distance + dc[right]];
-        // If not empty, include it, and stop
-        if (distance > 0 && (*view)[distance][CORRIDOR] != EMPTY) {
+    }
+    return distance;
+}
+
+// Copy a view, recording the tiles read
+static int maze_copy_view_tiles(VIEW *view, OBJECT *cell, DIRECTION gaze, int depth, TILE_READ *reads, int *np) {
+    long step = maze_step[gaze];
+    long left = maze_step[TURN_LEFT(gaze)];
+    long right = maze_step[TURN_RIGHT(gaze)];
+    int run = 1; // steps left in the current tiles, which the three lines of the patch leave together
+    int distance;
+    for (distance = 0; distance < depth; distance++, cell += step) {
+        if (--run == 0) { // the sides are in the corridor's tile or in tiles of their own
+            MAZE_TILE *tile = maze_tile_of(cell), *lt = maze_tile_of(cell + left), *rt = maze_tile_of(cell + right);
+            maze_read_tile(reads, np, tile);
+            if (lt != tile) maze_read_tile(reads, np, lt);
+            if (rt != tile) maze_read_tile(reads, np, rt);
+            run = distance ? 1 << maze_tile_shift : maze_tile_run(cell, gaze);
+        }
+        OBJECT object = maze_copy_row(view, distance, cell, left, right);
+        if (object == GUARD) break;
+        if (distance > 0 && object != EMPTY) {
             distance++;
             break;
         }
     }
-    pthread_mutex_unlock(&maze_mutex);
     return distance;
 }
 
+int maze_get_view(VIEW *view, int row, int col, DIRECTION gaze, int depth) {
+    if (!maze_contains(row, col) || (unsigned)gaze >= NUM_DIRECTIONS){
+        return 0;
+    }
+    OBJECT *cell = maze_cells + maze_index(row, col);
+    int distance;
+    if (maze_locked_reads && !maze_lock_free) { // lock the tiles under the depth x 3 patch
+        int brow = row + 1, bcol = col + 1, far = depth > 0 ? depth - 1 : 0;
+        int side_r = dr[gaze] == 0, side_c = dc[gaze] == 0; // the sides are across the gaze
+        int r0 = brow - side_r, c0 = bcol - side_c;
+        int r1 = brow + dr[gaze] * far + side_r, c1 = bcol + dc[gaze] * far + side_c;
+        maze_lock_region(r0, c0, r1, c1, 1);
+        distance = maze_copy_view(view, cell, gaze, depth);
+        maze_lock_region(r0, c0, r1, c1, 0);
+    } else if (maze_one_tile) {
+        unsigned begun;
+        do { // a torn copy is simply made again, into the same view
+            begun = maze_read_begin(maze_versions);
+            distance = maze_copy_view(view, cell, gaze, depth);
+        } while (maze_read_retry_one(maze_versions, begun));
+    } else {
+        TILE_READ reads[maze_read_max];
+        int n;
+        do {
+            n = 0;
+            distance = maze_copy_view_tiles(view, cell, gaze, depth, reads, &n);
+        } while (maze_read_retry(reads, n));
+    }
+    return distance;
+}
+
+void maze_set_lock_free(int lock_free) {
+    maze_lock_free = lock_free;
+}
+
+void maze_set_locked_reads(int locked) {
+    maze_locked_reads = locked;
+}
+
+unsigned long maze_get_read_retries(void) {
+    return __atomic_load_n(&maze_read_retries, __ATOMIC_RELAXED);
+}
+
 // Debug purposes, prints a X3D view
 void show_view(VIEW *view, int depth) {
     // view[distance][LEFT_WALL], view[distance][CORRIDOR], view[distance][RIGHT_WALL]
@@ -207,11 +559,35 @@ void show_view(VIEW *view, int depth) {
 }
 
 // Debug purposes, display the state of the maze
+// Copy every row, padding included, as it was at one moment, into show_copy, caller holds show_lock
+static void maze_copy_locked(void) {
+    size_t size = (size_t)maze_rows << maze_shift;
+    do { // copied first, so that printing does not hold up writers
+        for (int i = 0; i < maze_ntiles; i++) {
+            show_reads[i].begunp = &maze_versions[i].begun;
+            show_reads[i].begun = maze_read_begin(&maze_versions[i]);
+        }
+        for (size_t i = 0; i < size; i++) {
+            show_copy[i] = cell_load(maze_cells + i);
+        }
+    } while (maze_read_retry(show_reads, maze_ntiles));
+}
+
+void maze_snapshot(OBJECT *buf) {
+    pthread_mutex_lock(&show_lock);
+    maze_copy_locked();
+    for (int r = 0; r < maze_rows; r++) {
+        memcpy(buf + (long)r * maze_cols, show_copy + maze_index(r, 0), maze_cols);
+    }
+    pthread_mutex_unlock(&show_lock);
+}
+
 void show_maze() {
-    pthread_mutex_lock(&maze_mutex);
+    pthread_mutex_lock(&show_lock);
+    maze_copy_locked();
     fprintf(stderr, "rows=%d, cols=%d\n", maze_rows, maze_cols); // total rows and columns in maze
     for (int r = 0; r < maze_rows; r++) {
-        fprintf(stderr, "%s\n", maze_cells[r]);
+        fprintf(stderr, "%.*s\n", maze_cols, show_copy + maze_index(r, 0));
     }
-    pthread_mutex_unlock(&maze_mutex);
-}
\ No newline at end of file
+    pthread_mutex_unlock(&show_lock);
+}
@@ -1,9 +1,14 @@
 #include "player.h"
 #include "protocol.h"
 #include "maze.h"
+#include "timer_wheel.h"
 #include "csapp.h"
 #include "debug.h"
 #include <time.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 static const OBJECT valid_avatars[] = {
     'A','B','C','D','E','F','G','H','I','J','K','L','M',
@@ -13,6 +18,47 @@ static const int dr[NUM_DIRECTIONS] = {-1, 0, 1, 0};
 static const int dc[NUM_DIRECTIONS] = {0, -1, 0, 1};
 
 #define NUM_AVATARS 26 // hard limit available avatars to upper-case alphabetic characters (A-Z)
+#define PLAYER_OUTBUF_LIMIT 16384 // batched output is flushed early once this much has accumulated
+#define PLAYER_FRAME_LIMIT UINT16_MAX // most a BATCH packet can wrap, its size field is 16 bits
+#define PLAYER_DEFAULT_MSS 1448 // segment size assumed when the connection cannot report one
+#define PLAYER_DRAIN_MS 1000 // longest a queue being stopped may go without sending, before the connection is cut
+
+typedef enum {
+    PLAYER_EV_HIT // struck by a laser
+} PLAYER_EVENT_TYPE;
+
+typedef struct player_event { // one entry in a player's mailbox
+    PLAYER_EVENT_TYPE type;
+    OBJECT from; // avatar of the player who caused the event
+    struct player_event *next;
+} PLAYER_EVENT;
+
+typedef struct player_qentry {
+    MZW_PACKET pkt; // header in host byte order, already timestamped
+    void *data; // private copy of the payload, or NULL
+    PROTO_FRAME *frame; // a shared encoding sent instead of pkt and data, or NULL
+    int view; // the player's latest view, encoded only once the writer gets to it
+    int packed; // data already holds the encoded packet, len bytes of it
+    int version; // READY: the protocol version the connection switches to as it is written, else 0
+    size_t len; // bytes it takes on the wire, at most
+    struct timespec queued; // when the packet was enqueued, for flush latency
+} PLAYER_QENTRY;
+
+typedef struct player_queue {
+    PLAYER_QENTRY *entries; // ring buffer of capacity slots
+    int capacity;
+    int head; // oldest queued packet
+    int count; // number of queued packets
+    size_t bytes; // their len, in total
+    int closing; // writer exits once the queue has drained, nothing more is accepted
+    int failed; // a write failed, the connection is dead so packets are discarded
+    int exited; // the writer is done, only the join is left
+    pthread_mutex_t lock; // never held across a write, so senders do not wait on the socket
+    pthread_cond_t nonempty;
+    pthread_cond_t progress; // an entry has been taken care of, or the writer has exited
+    pthread_t writer; // dedicated thread that drains the queue onto the socket
+    PLAYER_QUEUE_STATS stats;
+} PLAYER_QUEUE;
 
 struct player{
     OBJECT avatar; // player's avatar (-a)
@@ -26,34 +72,509 @@ struct player{
     int prev_depth; // depth of prev_view
     int refcount; // reference counting
     pthread_mutex_t mutex;
-    pthread_t thread_id; // thread ID of specific player
-    volatile sig_atomic_t hit_pending; // flag set by SIGUSR1 to mark laser hit
+    PLAYER_EVENT *mailbox; // events posted by other players, newest first, pushed and taken without locks
+    int eventfd; // readable while the mailbox may hold events, for the thread serving the player to wait on
+    TW_TIMER respawn; // pending while the player is frozen after a hit
+    PLAYER_QUEUE *outq; // outbound queue, NULL if packets are written synchronously
+    char *outbuf; // packets encoded during a batch, not yet written
+    size_t outlen;
+    size_t outcap;
+    int outpkts; // number of packets in outbuf
+    int mss; // TCP maximum segment size, for estimating segments saved
+    int udp_fd; // socket views are sent from as datagrams, -1 = views go over the connection
+    struct sockaddr_storage udp_addr; // where the client receives them
+    socklen_t udp_addrlen;
+    uint32_t view_seq; // sequence number of the last VIEW datagram
+    int packed_views; // views go over the connection as VIEW packets rather than CLEAR and SHOW
+    int batch_frames; // what a batch buffers goes out wrapped in one BATCH packet
+    int ready_pending; // READY is queued but not yet written, so nothing is encoded ahead of the writer
+    int congested; // over the high watermark, until back under the low one
+    int view_lost; // view packets were discarded, so the next view update is a full one
+    int evicted; // connection shut down for not reading, nothing more is sent
+    char pending_view[VIEW_DEPTH][VIEW_WIDTH]; // newest view not yet taken by the writer thread
+    int pending_depth;
+    int pending_full; // the client needs a full update, not just the changes
+    int view_queued; // an entry in the outbound queue will send pending_view
+    char sent_view[VIEW_DEPTH][VIEW_WIDTH]; // last view the writer thread sent, only it uses this
+    int sent_depth; // -1 = none yet
 };
 
+static PLAYER_BATCH_STATS batch_stats; // updated atomically, shared by all players
+static PLAYER_BROADCAST_STATS broadcast_stats; // updated atomically
+static PLAYER_SLOW_POLICY slow_policy = PLAYER_SLOW_NONE;
+static size_t slow_high = PLAYER_HIGH_WATERMARK, slow_low = PLAYER_LOW_WATERMARK;
+static PLAYER_SLOW_STATS slow_stats; // updated atomically
+static PLAYER_VIEW_STATS view_stats; // likewise
+static __thread int batching; // nonzero between player_batch_begin() and player_batch_end()
+static __thread int view_batching; // nonzero between player_view_batch_begin() and player_view_batch_end()
+static __thread uint32_t view_dirty; // avatars whose view update this thread has put off, one bit each
+static __thread PLAYER *batch_dirty[NUM_AVATARS]; // players this thread has buffered output for, by avatar
+
+static int player_queue_depth = 0; // outbound queue capacity for new players, 0 = no queue
+static void (*respawn_handler)(PLAYER *player); // NULL = reset on the timer thread
+static void (*hit_handler)(PLAYER *player); // NULL = the thread serving the player hit takes the hit
 static pthread_mutex_t players_mutex; // shared mutex for players
 static PLAYER *players[NUM_AVATARS]; // array of player structs containing 26 max
-static void signal_no_restart(int signum, handler_t *handler){
-    struct sigaction action;
-    action.sa_handler = handler;
-    sigemptyset(&action.sa_mask);
-    action.sa_flags = 0; // no SA_RESTART
-    if(sigaction(signum, &action, NULL) < 0){
-        unix_error("signal_no_restart error");
+static uint32_t players_leaving; // avatars of players gone from players[] but still being seen out, one bit each
+// Lock-free push onto the mailbox (any number of posters), then wake whoever waits on the eventfd
+static void player_post_event(PLAYER *player, PLAYER_EVENT_TYPE type, OBJECT from) {
+    PLAYER_EVENT *ev = Malloc(sizeof *ev);
+    ev->type = type;
+    ev->from = from;
+    ev->next = __atomic_load_n(&player->mailbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&player->mailbox, &ev->next, ev, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ; // ev->next was refreshed with the current head
+    uint64_t one = 1;
+    if (write(player->eventfd, &one, sizeof one) < 0) {
+        debug("eventfd write failed for %s: %s", player->name, strerror(errno)); // counter saturated, still readable
     }
 }
-static void player_laser_handler(int sig){
-    pthread_t me = pthread_self();
-    for (int i = 0; i < NUM_AVATARS; i++){
-        PLAYER *player = players[i];
-        if(player && pthread_equal(player->thread_id, me)){
-            player->hit_pending = 1;
-            break;
+
+// Take every event posted so far, oldest first
+static PLAYER_EVENT *player_take_events(PLAYER *player) {
+    uint64_t count;
+    if (read(player->eventfd, &count, sizeof count) < 0 && errno != EAGAIN) { // reset before taking, so no post is missed
+        debug("eventfd read failed for %s: %s", player->name, strerror(errno));
+    }
+    PLAYER_EVENT *list = __atomic_exchange_n(&player->mailbox, NULL, __ATOMIC_ACQUIRE);
+    PLAYER_EVENT *oldest = NULL;
+    while (list) { // reverse into posting order
+        PLAYER_EVENT *next = list->next;
+        list->next = oldest;
+        oldest = list;
+        list = next;
+    }
+    return oldest;
+}
+
+static unsigned long elapsed_ns(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+static int player_write_view(PLAYER *player);
+
+// Writer thread: drain the outbound queue in order, the only thread that blocks on the client's socket
+static void *player_writer(void *arg) {
+    PLAYER *player = arg;
+    PLAYER_QUEUE *q = player->outq;
+    sigset_t mask; // signals are meant for the service threads
+    Sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        while (q->count == 0 && !q->closing) {
+            pthread_cond_wait(&q->nonempty, &q->lock);
+        }
+        if (q->count == 0) break; // closing and drained
+        PLAYER_QENTRY e = q->entries[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        q->bytes -= e.len;
+        int failed = q->failed;
+        pthread_mutex_unlock(&q->lock);
+        if (e.version) { // what follows READY is encoded in the version it grants
+            proto_set_version(player->fd, e.version);
+            __atomic_store_n(&player->ready_pending, 0, __ATOMIC_RELEASE);
+        }
+        int rc = failed ? -1 : e.view ? player_write_view(player) : e.packed ? proto_send_packed(player->fd, e.data, e.len) :
+                 e.frame ? proto_send_frame(player->fd, e.frame) : proto_send_packet(player->fd, &e.pkt, e.data);
+        struct timespec done;
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        if (e.data) Free(e.data);
+        if (e.frame) proto_frame_unref(e.frame);
+        pthread_mutex_lock(&q->lock);
+        if (rc == 0) {
+            unsigned long ns = elapsed_ns(&e.queued, &done);
+            q->stats.sent++;
+            q->stats.flush_ns_total += ns;
+            if (ns > q->stats.flush_ns_max) q->stats.flush_ns_max = ns;
+        } else {
+            q->failed = 1;
+            q->stats.dropped++;
+        }
+        pthread_cond_signal(&q->progress);
+    }
+    q->exited = 1;
+    pthread_cond_signal(&q->progress);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static void player_queue_start(PLAYER *player, int capacity) {
+    PLAYER_QUEUE *q = Calloc(1, sizeof *q);
+    q->entries = Malloc(capacity * sizeof *q->entries);
+    q->capacity = capacity;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->nonempty, NULL);
+    pthread_condattr_t attr; // timed waits are against CLOCK_MONOTONIC, like the queue statistics
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->progress, &attr);
+    pthread_condattr_destroy(&attr);
+    player->outq = q;
+    Pthread_create(&q->writer, NULL, player_writer, player);
+}
+
+// Stop accepting packets and wait for the writer to drain what is already queued.  A client that has stopped
+// reading would keep the writer in a write for good, so if nothing is sent for PLAYER_DRAIN_MS the connection is
+// shut down for writing, which fails the write, and what is left is discarded.
+static void player_queue_stop(PLAYER_QUEUE *q, int fd) {
+    pthread_mutex_lock(&q->lock);
+    int join = !q->closing;
+    q->closing = 1;
+    pthread_cond_signal(&q->nonempty);
+    unsigned long done = q->stats.sent + q->stats.dropped;
+    while (join && !q->exited) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += PLAYER_DRAIN_MS / 1000;
+        deadline.tv_nsec += (PLAYER_DRAIN_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&q->progress, &q->lock, &deadline) != ETIMEDOUT) continue;
+        if (q->stats.sent + q->stats.dropped == done && !q->failed) {
+            q->failed = 1;
+            if (fd >= 0) shutdown(fd, SHUT_WR);
+            debug("Outbound queue stuck for %d ms, connection %d shut down", PLAYER_DRAIN_MS, fd);
+        }
+        done = q->stats.sent + q->stats.dropped;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (join) Pthread_join(q->writer, NULL);
+}
+
+static void player_queue_free(PLAYER_QUEUE *q, int fd) {
+    player_queue_stop(q, fd);
+    pthread_cond_destroy(&q->progress);
+    pthread_cond_destroy(&q->nonempty);
+    pthread_mutex_destroy(&q->lock);
+    Free(q->entries);
+    Free(q);
+}
+
+// Queue an entry for the writer, which then owns its payload or frame reference, never blocks on the socket
+static int player_queue_put(PLAYER_QUEUE *q, PLAYER_QENTRY *entry, struct timespec *start) {
+    pthread_mutex_lock(&q->lock);
+    if (q->closing || q->failed || q->count == q->capacity) {
+        q->stats.dropped++;
+        pthread_mutex_unlock(&q->lock);
+        if (entry->data) Free(entry->data);
+        if (entry->frame) proto_frame_unref(entry->frame);
+        errno = ENOBUFS;
+        return -1;
+    }
+    PLAYER_QENTRY *e = &q->entries[(q->head + q->count) % q->capacity];
+    *e = *entry;
+    e->queued = *start;
+    q->count++;
+    q->bytes += e->len;
+    if (q->count > q->stats.max_depth) q->stats.max_depth = q->count;
+    q->stats.enqueued++;
+    struct timespec done;
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    unsigned long ns = elapsed_ns(start, &done);
+    q->stats.enqueue_ns_total += ns;
+    if (ns > q->stats.enqueue_ns_max) q->stats.enqueue_ns_max = ns;
+    pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Queue a timestamped packet for the writer
+static int player_queue_push(PLAYER_QUEUE *q, MZW_PACKET *pkt, struct iovec *iov, int iovcnt,
+                             struct timespec *start) {
+    PLAYER_QENTRY e = {.pkt = *pkt, .len = sizeof(MZW_PACKET) + pkt->size};
+    if (iovcnt > 0 && pkt->size > 0) { // gather the fragments into one copy, outside the lock
+        e.data = Malloc(pkt->size);
+        size_t off = 0;
+        for (int i = 0; i < iovcnt && off < pkt->size; i++) {
+            size_t n = iov[i].iov_len < pkt->size - off ? iov[i].iov_len : pkt->size - off;
+            memcpy((char *)e.data + off, iov[i].iov_base, n);
+            off += n;
+        }
+    }
+    return player_queue_put(q, &e, start);
+}
+
+// Queue a shared frame for the writer, taking a reference to it
+static int player_queue_push_frame(PLAYER_QUEUE *q, PROTO_FRAME *frame, size_t size, struct timespec *start) {
+    PLAYER_QENTRY e = {.frame = proto_frame_ref(frame), .len = sizeof(MZW_PACKET) + size};
+    return player_queue_put(q, &e, start);
+}
+
+// Append an encoded packet to the player's output buffer, caller holds the player mutex
+static void player_buffer_locked(PLAYER *player, MZW_PACKET *pkt, struct iovec *iov, int iovcnt) {
+    size_t need = player->outlen + sizeof(MZW_PACKET) + pkt->size;
+    if (need > player->outcap) {
+        player->outcap = need > 2 * player->outcap ? need : 2 * player->outcap;
+        player->outbuf = Realloc(player->outbuf, player->outcap);
+    }
+    player->outlen += proto_pack_packet(player->fd, player->outbuf + player->outlen, pkt, iov, iovcnt);
+    player->outpkts++;
+    __atomic_fetch_add(&batch_stats.packets, 1, __ATOMIC_RELAXED);
+}
+
+// Append a frame to the player's output buffer, caller holds the player mutex
+static void player_buffer_frame_locked(PLAYER *player, PROTO_FRAME *frame, size_t size) {
+    size_t need = player->outlen + sizeof(MZW_PACKET) + size;
+    if (need > player->outcap) {
+        player->outcap = need > 2 * player->outcap ? need : 2 * player->outcap;
+        player->outbuf = Realloc(player->outbuf, player->outcap);
+    }
+    player->outlen += proto_pack_frame(player->fd, player->outbuf + player->outlen, frame);
+    player->outpkts++;
+    __atomic_fetch_add(&batch_stats.packets, 1, __ATOMIC_RELAXED);
+}
+
+// Bytes written or queued for the player that the client has not yet taken
+static size_t player_pending_bytes(PLAYER *player) {
+    size_t pending = player->outlen;
+    if (player->outq) {
+        pthread_mutex_lock(&player->outq->lock);
+        pending += player->outq->bytes;
+        pthread_mutex_unlock(&player->outq->lock);
+    }
+    int unsent;
+    if (player->fd >= 0 && ioctl(player->fd, SIOCOUTQ, &unsent) == 0 && unsent > 0) { // not a socket, say in tests
+        pending += unsent;
+    }
+    return pending;
+}
+
+// Bring the player's congestion up to date with what is pending, caller holds the player mutex
+static void player_update_congestion_locked(PLAYER *player) {
+    if (player->evicted) return;
+    size_t pending = player_pending_bytes(player);
+    size_t high = slow_high, low = slow_low;
+    int sndbuf; // without a queue, a full socket blocks the sender before it is seen to be behind
+    socklen_t len = sizeof sndbuf;
+    if (!player->outq && player->fd >= 0 && getsockopt(player->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == 0 &&
+        (size_t)sndbuf / 2 < high) { // the kernel reports twice what it holds, the rest is its bookkeeping
+        high = sndbuf / 2;
+        if (low >= high) low = high / 4;
+    }
+    if (!player->congested && pending >= high) {
+        player->congested = 1;
+        __atomic_fetch_add(&slow_stats.congested, 1, __ATOMIC_RELAXED);
+        if (slow_policy == PLAYER_SLOW_DISCONNECT && player->fd >= 0) { // the service thread cleans up on EOF
+            player->evicted = 1;
+            shutdown(player->fd, SHUT_RDWR);
+            __atomic_fetch_add(&slow_stats.disconnected, 1, __ATOMIC_RELAXED);
+            info("%s disconnected, %zu bytes behind", player->name, pending);
         }
+    } else if (player->congested && pending <= low) {
+        player->congested = 0;
+        __atomic_fetch_add(&slow_stats.recovered, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Apply the slow client policy to a packet about to be sent, return 1 to discard it, -1 if the player is evicted,
+// caller holds the player mutex and says whether the congestion is to be brought up to date first
+static int player_slow_locked(PLAYER *player, int type, int update) {
+    if (slow_policy == PLAYER_SLOW_NONE) return 0;
+    if (update) player_update_congestion_locked(player);
+    int view = type == MZW_CLEAR_PKT || type == MZW_SHOW_PKT || type == MZW_VIEW_PKT;
+    if (player->evicted) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (player->congested && (slow_policy == PLAYER_SLOW_DROP || (slow_policy == PLAYER_SLOW_CONFLATE && view))) {
+        if (view) player->view_lost = 1;
+        __atomic_fetch_add(slow_policy == PLAYER_SLOW_DROP ? &slow_stats.dropped : &slow_stats.conflated, 1,
+                           __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+// Apply the slow client policy to a packet that goes out on its own
+static int player_check_slow(PLAYER *player, int type) {
+    if (slow_policy == PLAYER_SLOW_NONE) return 0;
+    pthread_mutex_lock(&player->mutex);
+    int rc = player_slow_locked(player, type, 1);
+    pthread_mutex_unlock(&player->mutex);
+    return rc;
+}
+
+// Whether a packet for the player goes into its output buffer, caller holds the player mutex.  Not while READY
+// waits in the queue: what is buffered is encoded at once, in the version the writer has yet to switch to.
+static int player_buffering_locked(PLAYER *player) {
+    return batching && !__atomic_load_n(&player->ready_pending, __ATOMIC_ACQUIRE);
+}
+
+// Whether the player's output buffer has to be written before more is added, caller holds the player mutex
+static int player_batch_full_locked(PLAYER *player) {
+    return player->outlen >= PLAYER_OUTBUF_LIMIT ||
+           (player->batch_frames && player->outpkts == MZW_BATCH_MAX_PACKETS);
+}
+
+// Timestamp a packet about to be sent to the player, as its protocol version requires
+static void player_stamp(PLAYER *player, MZW_PACKET *pkt, struct timespec *ts) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    if (proto_get_version(player->fd) < PROTO_VERSION_2) { // version 2 leaves timestamps out
+        pkt->timestamp_sec  = (uint32_t)ts->tv_sec;
+        pkt->timestamp_nsec = (uint32_t)ts->tv_nsec;
+    } else {
+        pkt->timestamp_sec = pkt->timestamp_nsec = 0;
+    }
+}
+
+// Send what is buffered as one BATCH packet, or through the outbound queue, caller holds the player mutex
+static int player_flush_frame_locked(PLAYER *player) {
+    MZW_PACKET pkt;
+    void *data;
+    struct iovec iov = {player->outbuf, player->outlen};
+    struct timespec ts;
+    if (player->outpkts > 1) {
+        pkt = (MZW_PACKET){.type = MZW_BATCH_PKT, .param1 = (uint8_t)player->outpkts, .size = player->outlen};
+        player_stamp(player, &pkt, &ts);
+        __atomic_fetch_add(&batch_stats.frames, 1, __ATOMIC_RELAXED);
+    } else { // not worth wrapping, and the queue takes packets rather than bytes
+        proto_parse_packet(player->fd, player->outbuf, player->outlen, &pkt, &data); // both versions agree here
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        iov.iov_base = data;
+        iov.iov_len = pkt.size;
+    }
+    if (player->outq) {
+        return player_queue_push(player->outq, &pkt, &iov, pkt.size ? 1 : 0, &ts);
+    }
+    return proto_send_packetv(player->fd, &pkt, &iov, pkt.size ? 1 : 0);
+}
+
+// Write everything buffered for the player with a single send, caller holds the player mutex
+static int player_flush_locked(PLAYER *player) {
+    if (player->outlen == 0) return 0;
+    int rc = player->fd < 0 ? -1 :
+             player->batch_frames ? player_flush_frame_locked(player) :
+             proto_send_packed(player->fd, player->outbuf, player->outlen);
+    unsigned long segments = (player->outlen + player->mss - 1) / player->mss;
+    __atomic_fetch_add(&batch_stats.flushes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&batch_stats.syscalls_saved, player->outpkts - 1, __ATOMIC_RELAXED);
+    if ((unsigned long)player->outpkts > segments) {
+        __atomic_fetch_add(&batch_stats.segments_saved, player->outpkts - segments, __ATOMIC_RELAXED);
     }
+    player->outlen = 0;
+    player->outpkts = 0;
+    return rc;
 }
 
-// Initialize player module with SIGUSR1 handler, mutex, and avatar array
+// Flush first if a packet of len bytes would take the BATCH frame past its limit, caller holds the player mutex
+static int player_frame_room_locked(PLAYER *player, size_t len) {
+    if (!player->batch_frames || player->outlen == 0 || player->outlen + len <= PLAYER_FRAME_LIMIT) return 0;
+    return player_flush_locked(player); // a packet too big for any frame is then flushed on its own, unwrapped
+}
+
+static int player_batch_release(PLAYER *player);
+
+// Remember that this thread's batch has output buffered for the player
+static void player_batch_mark(PLAYER *player) {
+    PLAYER **slot = &batch_dirty[player->avatar - 'A'];
+    if (*slot == player) return;
+    if (*slot) { // the avatar changed hands during the batch
+        player_batch_release(*slot);
+    }
+    *slot = player_ref(player, "batched output");
+}
+
+static int player_batch_release(PLAYER *player) {
+    pthread_mutex_lock(&player->mutex);
+    int rc = player_flush_locked(player);
+    pthread_mutex_unlock(&player->mutex);
+    player_unref(player, "batched output");
+    return rc;
+}
+
+void player_batch_begin(void) {
+    batching = 1;
+}
+
+int player_batch_end(void) {
+    int rc = 0;
+    batching = 0;
+    for (int i = 0; i < NUM_AVATARS; i++) {
+        if (batch_dirty[i]) {
+            if (player_batch_release(batch_dirty[i]) < 0) rc = -1;
+            batch_dirty[i] = NULL;
+        }
+    }
+    return rc;
+}
+
+// Batch what the calling thread sends from here on, unless it already is, return whether it was not
+static int player_batch_open(void) {
+    if (batching) return 0;
+    player_batch_begin();
+    return 1;
+}
+
+void player_view_batch_begin(void) {
+    view_batching = 1;
+}
+
+int player_view_batch_end(void) {
+    int views = 0;
+    view_batching = 0;
+    for (int i = 0; i < NUM_AVATARS; i++) {
+        if (!(view_dirty & (1u << i))) continue;
+        PLAYER *p = player_get('A' + i); // may have logged out, or been replaced, since it was marked
+        if (p) {
+            player_update_view(p);
+            player_unref(p, "player_view_batch_end");
+            views++;
+        }
+    }
+    view_dirty = 0;
+    return views;
+}
+
+void player_get_batch_stats(PLAYER_BATCH_STATS *stats) {
+    stats->packets = __atomic_load_n(&batch_stats.packets, __ATOMIC_RELAXED);
+    stats->flushes = __atomic_load_n(&batch_stats.flushes, __ATOMIC_RELAXED);
+    stats->syscalls_saved = __atomic_load_n(&batch_stats.syscalls_saved, __ATOMIC_RELAXED);
+    stats->segments_saved = __atomic_load_n(&batch_stats.segments_saved, __ATOMIC_RELAXED);
+    stats->frames = __atomic_load_n(&batch_stats.frames, __ATOMIC_RELAXED);
+}
+
+void player_get_view_stats(PLAYER_VIEW_STATS *stats) {
+    stats->updates = __atomic_load_n(&view_stats.updates, __ATOMIC_RELAXED);
+    stats->show_packets = __atomic_load_n(&view_stats.show_packets, __ATOMIC_RELAXED);
+    stats->conflated = __atomic_load_n(&view_stats.conflated, __ATOMIC_RELAXED);
+}
+
+
+void player_set_slow_policy(PLAYER_SLOW_POLICY policy, size_t high, size_t low) {
+    slow_policy = policy;
+    slow_high = high;
+    slow_low = low < high ? low : high / 4;
+}
+
+void player_get_slow_stats(PLAYER_SLOW_STATS *stats) {
+    stats->congested = __atomic_load_n(&slow_stats.congested, __ATOMIC_RELAXED);
+    stats->recovered = __atomic_load_n(&slow_stats.recovered, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&slow_stats.dropped, __ATOMIC_RELAXED);
+    stats->conflated = __atomic_load_n(&slow_stats.conflated, __ATOMIC_RELAXED);
+    stats->disconnected = __atomic_load_n(&slow_stats.disconnected, __ATOMIC_RELAXED);
+}
+
+void player_set_queue_depth(int depth) {
+    player_queue_depth = depth > 0 ? depth : 0;
+}
+
+int player_get_queue_stats(PLAYER *player, PLAYER_QUEUE_STATS *stats) {
+    PLAYER_QUEUE *q = player->outq;
+    if (!q) return -1;
+    pthread_mutex_lock(&q->lock);
+    *stats = q->stats;
+    stats->depth = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Initialize player module with mutex and avatar array, and the timer wheel that respawns players
 void player_init(void) {
+    tw_init(0);
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
@@ -62,11 +583,40 @@ void player_init(void) {
     for (int i = 0; i < NUM_AVATARS ; i++){ // initialize avatar map to NULL
         players[i] = NULL;
     }
-    signal_no_restart(SIGUSR1, player_laser_handler);
 }
 
 // Clean up player by forcefully decrementing ref
 void player_fini(void) {
+    PLAYER_BATCH_STATS st;
+    player_get_batch_stats(&st);
+    if (st.packets) {
+        info("Batched output: %lu packets in %lu writes (%lu as BATCH packets), %lu syscalls and ~%lu segments saved",
+             st.packets, st.flushes, st.frames, st.syscalls_saved, st.segments_saved);
+    }
+    PLAYER_BROADCAST_STATS bst;
+    player_get_broadcast_stats(&bst);
+    if (bst.broadcasts) {
+        info("Broadcasts: %lu packets encoded once for %lu deliveries", bst.broadcasts, bst.deliveries);
+    }
+    PLAYER_SLOW_STATS sst;
+    player_get_slow_stats(&sst);
+    if (sst.congested) {
+        info("Slow clients: behind %lu times, caught up %lu, %lu packets dropped, %lu conflated, %lu disconnected",
+             sst.congested, sst.recovered, sst.dropped, sst.conflated, sst.disconnected);
+    }
+    PLAYER_VIEW_STATS vst;
+    player_get_view_stats(&vst);
+    if (vst.updates) {
+        info("Packed views: %lu VIEW packets sent, instead of %lu CLEAR and SHOW packets",
+             vst.updates, vst.show_packets);
+    }
+    if (vst.conflated) {
+        info("Conflated views: %lu updates replaced by a newer one before being sent", vst.conflated);
+    }
+    for (int i = 0; i < NUM_AVATARS; i++) { // no respawn may run on a player being freed
+        PLAYER *p = players[i];
+        if (p) tw_cancel(&p->respawn);
+    }
     pthread_mutex_lock(&players_mutex);
     for (int i = 0; i < NUM_AVATARS; i++) {
         if (players[i]) {
@@ -79,6 +629,117 @@ void player_fini(void) {
     pthread_mutex_destroy(&players_mutex);
 }
 
+// Timer function: the freeze after a hit is over, put the player back in the maze
+static void player_respawn(void *arg) {
+    if (respawn_handler) {
+        respawn_handler(arg);
+    } else {
+        player_reset(arg);
+    }
+}
+
+void player_set_respawn_handler(void (*handler)(PLAYER *player)) {
+    respawn_handler = handler;
+}
+
+void player_set_hit_handler(void (*handler)(PLAYER *player)) {
+    hit_handler = handler;
+}
+
+// Reference every logged-in player, so they can be used without holding players_mutex
+static int player_snapshot(PLAYER **out) {
+    int n = 0;
+    pthread_mutex_lock(&players_mutex);
+    for (int i = 0; i < NUM_AVATARS; i++) {
+        if (players[i]) out[n++] = player_ref(players[i], "player_snapshot");
+    }
+    pthread_mutex_unlock(&players_mutex);
+    return n;
+}
+
+static void player_release_snapshot(PLAYER **ps, int n) {
+    for (int i = 0; i < n; i++) {
+        player_unref(ps[i], "player_snapshot");
+    }
+}
+
+// Send a shared frame to the player, the way player_send_packetv() sends a packet
+static int player_send_frame(PLAYER *player, PROTO_FRAME *frame, int type, size_t size, struct timespec *ts) {
+    if (player->outq && !player->batch_frames) {
+        int slow = player_check_slow(player, type);
+        if (slow) return slow < 0 ? -1 : 0;
+        return player_queue_push_frame(player->outq, frame, size, ts);
+    }
+    int rc;
+    pthread_mutex_lock(&player->mutex);
+    int slow = player_slow_locked(player, type, !batching || player->outlen == 0); // once per flush in a batch
+    if (slow) {
+        pthread_mutex_unlock(&player->mutex);
+        return slow < 0 ? -1 : 0;
+    }
+    int buffer = player_buffering_locked(player);
+    if (buffer) {
+        rc = player_frame_room_locked(player, sizeof(MZW_PACKET) + size);
+        player_buffer_frame_locked(player, frame, size);
+        if (player_batch_full_locked(player) && player_flush_locked(player) < 0) rc = -1;
+    } else {
+        rc = player_flush_locked(player);
+        if (rc == 0) {
+            rc = player->outq ? player_queue_push_frame(player->outq, frame, size, ts) :
+                 proto_send_frame(player->fd, frame);
+        }
+    }
+    pthread_mutex_unlock(&player->mutex);
+    if (buffer) {
+        player_batch_mark(player);
+    }
+    return rc;
+}
+
+// Encode a packet once and send it to each of the players given
+static void player_broadcast_to(PLAYER **ps, int n, MZW_PACKET *pkt, struct iovec *iov, int iovcnt) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pkt->timestamp_sec = (uint32_t)ts.tv_sec; // version 2 connections get the frame without it
+    pkt->timestamp_nsec = (uint32_t)ts.tv_nsec;
+    PROTO_FRAME *frame = proto_frame_create(pkt, iov, iovcnt);
+    for (int i = 0; i < n; i++) {
+        player_send_frame(ps[i], frame, pkt->type, pkt->size, &ts);
+    }
+    proto_frame_unref(frame); // whichever writer sends it last frees it
+    __atomic_fetch_add(&broadcast_stats.broadcasts, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&broadcast_stats.deliveries, n, __ATOMIC_RELAXED);
+}
+
+int player_broadcast(MZW_PACKET *pkt, struct iovec *iov, int iovcnt) {
+    PLAYER *ps[NUM_AVATARS];
+    int n = player_snapshot(ps);
+    player_broadcast_to(ps, n, pkt, iov, iovcnt);
+    player_release_snapshot(ps, n);
+    return n;
+}
+
+void player_get_broadcast_stats(PLAYER_BROADCAST_STATS *stats) {
+    stats->broadcasts = __atomic_load_n(&broadcast_stats.broadcasts, __ATOMIC_RELAXED);
+    stats->deliveries = __atomic_load_n(&broadcast_stats.deliveries, __ATOMIC_RELAXED);
+}
+
+// Update the view of every player, after a change in the maze
+static void player_update_all_views(int full) {
+    PLAYER *ps[NUM_AVATARS];
+    int n = player_snapshot(ps);
+    for (int i = 0; i < n; i++) {
+        if (full) player_invalidate_view(ps[i]);
+        player_update_view(ps[i]);
+    }
+    player_release_snapshot(ps, n);
+}
+
+// Whether an avatar can be given to a new player, caller holds players_mutex
+static int player_avatar_free_locked(OBJECT avatar) {
+    return players[avatar - 'A'] == NULL && !(players_leaving & (1u << (avatar - 'A')));
+}
+
 // Initializes a new player
 PLAYER *player_login(int clientfd, OBJECT avatar, char *name) {
     char *real_name;
@@ -104,18 +765,18 @@ PLAYER *player_login(int clientfd, OBJECT avatar, char *name) {
     }
     OBJECT real_avatar = 0;
     pthread_mutex_lock(&players_mutex);
-    if(IS_AVATAR(requested_avatar) && players[requested_avatar - 'A'] == NULL){
+    if(IS_AVATAR(requested_avatar) && player_avatar_free_locked(requested_avatar)){
         real_avatar = requested_avatar;
     }
     else{
         OBJECT first = (name && name[0] != '\0') ? (OBJECT)real_name[0] : 0;
-        if(IS_AVATAR(first) && players[first - 'A'] == NULL){
+        if(IS_AVATAR(first) && player_avatar_free_locked(first)){
             real_avatar = first;
         }
         else{
             for (int i = 0; i < NUM_AVATARS; i++){
                 OBJECT potential_avatar = valid_avatars[i];
-                if (players[potential_avatar - 'A'] == NULL){
+                if (player_avatar_free_locked(potential_avatar)){
                     real_avatar = potential_avatar;
                     break;
                 }
@@ -143,27 +804,59 @@ PLAYER *player_login(int clientfd, OBJECT avatar, char *name) {
     player->prev_view = NULL;
     player->prev_depth = 0;
     player->refcount = 1;
-    player->hit_pending = 0;
+    player->mailbox = NULL;
+    tw_timer_init(&player->respawn, player_respawn, player);
+    if ((player->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        pthread_mutex_unlock(&players_mutex);
+        free(real_name);
+        free(player);
+        return NULL;
+    }
+    player->outq = NULL;
+    player->outbuf = NULL;
+    player->outlen = player->outcap = 0;
+    player->outpkts = 0;
+    player->udp_fd = -1;
+    player->view_seq = 0;
+    player->packed_views = 0;
+    player->batch_frames = 0;
+    player->congested = 0;
+    player->view_lost = 0;
+    player->evicted = 0;
+    player->pending_depth = 0;
+    player->pending_full = 0;
+    player->view_queued = 0;
+    player->sent_depth = -1;
+    socklen_t optlen = sizeof player->mss;
+    if (getsockopt(clientfd, IPPROTO_TCP, TCP_MAXSEG, &player->mss, &optlen) < 0 || player->mss <= 0) {
+        player->mss = PLAYER_DEFAULT_MSS; // not a TCP connection
+    }
+    if (player_queue_depth > 0) {
+        player_queue_start(player, player_queue_depth);
+    }
     pthread_mutexattr_t mattr;
     pthread_mutexattr_init(&mattr);
     pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&player->mutex, &mattr);
     pthread_mutexattr_destroy(&mattr);
     players[real_avatar - 'A'] = player;
-    player->thread_id = pthread_self(); // record self ID for laser hits tracking
     pthread_mutex_unlock(&players_mutex);
     return player;
 }
 
-// Logs a player out by removing player and decrementing reference
-void player_logout(PLAYER *player) {
+// Takes the player out of the game, without waiting on its own connection
+void player_leave(PLAYER *player) {
     int row, col, dir;
-    if (player_get_location(player, &row, &col, &dir) == 0) {
+    tw_cancel(&player->respawn); // a frozen player must not be put back in the maze once gone
+    pthread_mutex_lock(&player->mutex);
+    int placed = player_get_location(player, &row, &col, &dir) == 0;
+    if (placed) {
         maze_remove_player(player->avatar, row, col);
-        for (int i = 0; i < NUM_AVATARS; i++) {
-            PLAYER *p = players[i];
-            if (p) player_update_view(p);
-        }
+        player->row = player->col = -1; // inputs still queued for a tick must not move a player who has left
+    }
+    pthread_mutex_unlock(&player->mutex);
+    if (placed) {
+        player_update_all_views(0);
     }
     // Send a score packet of -1
     MZW_PACKET pkt;
@@ -172,44 +865,76 @@ void player_logout(PLAYER *player) {
     pkt.param2 = -1;
     pkt.param3 = 0;
     pkt.size = 0;
+    // The player is gone before the recipients are taken, so anyone logging in later is never sent its score and
+    // needs no -1, and its avatar is kept from a new player until the -1 is out; the writes are made without the lock
+    uint32_t bit = 1u << (player->avatar - 'A');
     pthread_mutex_lock(&players_mutex);
+    players[player->avatar - 'A'] = NULL;
+    players_leaving |= bit;
+    PLAYER *ps[NUM_AVATARS];
+    int n = 0;
     for (int i = 0; i < NUM_AVATARS; i++){
-        PLAYER *p = players[i];
-        if (p && p != player){
-            player_send_packet(p, &pkt, NULL);
-        }
+        if (players[i]) ps[n++] = player_ref(players[i], "player_snapshot");
     }
-    players[player->avatar - 'A'] = NULL;
     pthread_mutex_unlock(&players_mutex);
+    player_broadcast_to(ps, n, &pkt, NULL, 0);
+    player_release_snapshot(ps, n);
+    pthread_mutex_lock(&players_mutex);
+    players_leaving &= ~bit;
+    pthread_mutex_unlock(&players_mutex);
+}
+
+// Sends the player what is left for it and releases the reference of the thread serving it
+void player_close(PLAYER *player) {
+    pthread_mutex_lock(&player->mutex);
+    player_flush_locked(player); // what a batch left buffered goes into the queue while it still takes packets
+    pthread_mutex_unlock(&player->mutex);
+    if (player->outq) { // drain before the service thread closes the connection
+        player_queue_stop(player->outq, player->fd);
+        PLAYER_QUEUE_STATS st;
+        player_get_queue_stats(player, &st);
+        info("%s outbound: sent %lu, dropped %lu, max depth %d, avg enqueue %lu ns, avg flush %lu ns",
+             player->name, st.sent, st.dropped, st.max_depth,
+             st.enqueued ? st.enqueue_ns_total / st.enqueued : 0, st.sent ? st.flush_ns_total / st.sent : 0);
+    }
+    pthread_mutex_lock(&player->mutex);
+    player->fd = -1; // the service thread closes the connection next, and its descriptor may be reused
+    pthread_mutex_unlock(&player->mutex);
     player_unref(player, "player_logout");
 }
 
+// Logs a player out by removing player and decrementing reference
+void player_logout(PLAYER *player) {
+    player_leave(player);
+    player_close(player);
+}
+
 // Resets the player as if they just joined, reset "stats" and randomly place on maze again
 void player_reset(PLAYER *player) {
     int row, col, dir;
+    pthread_mutex_lock(&player->mutex);
     if (player_get_location(player, &row, &col, &dir) == 0) { // Remove the player if present
         maze_remove_player(player->avatar, row, col);
     }
     // Attempt to randomly place if an empty spot is found
     if (maze_set_player_random(player->avatar, &row, &col) != 0) {
+        player->row = player->col = -1;
+        pthread_mutex_unlock(&player->mutex);
         // If failure, force the client service thread to ungracefully shutdown to force termination of service
         shutdown(player->fd, SHUT_RD);
         return;
     }
     player->row = row;
     player->col = col;
+    pthread_mutex_unlock(&player->mutex);
+    int opened = player->batch_frames && player_batch_open(); // the views and scores arrive as one BATCH
     // Perform full view update instead of incremental upon player reset
-    for (int i = 0; i < NUM_AVATARS; i++) {
-        PLAYER *p = players[i];
-        if (p) {
-            player_invalidate_view(p);
-            player_update_view(p);
-        }
-    }
+    player_update_all_views(1);
     // Refresh current player's scoreboard, send this data to all other players connected
-    for (int i = 0; i < NUM_AVATARS; i++) {
-        PLAYER *p = players[i];
-        if (!p) continue;
+    PLAYER *ps[NUM_AVATARS];
+    int n = player_snapshot(ps);
+    for (int i = 0; i < n; i++) {
+        PLAYER *p = ps[i];
         size_t name_len = strlen(p->name);
         MZW_PACKET pkt = {
             .type = MZW_SCORE_PKT,
@@ -220,9 +945,9 @@ void player_reset(PLAYER *player) {
         };
         player_send_packet(player, &pkt, p->name);
     }
-    for (int i = 0; i < NUM_AVATARS; i++) {
-        PLAYER *p = players[i];
-        if (p == NULL || p == player) continue;
+    for (int i = 0; i < n; i++) {
+        PLAYER *p = ps[i];
+        if (p == player) continue;
         size_t name_len = strlen(p->name);
         MZW_PACKET pkt = {
             .type = MZW_SCORE_PKT,
@@ -233,6 +958,8 @@ void player_reset(PLAYER *player) {
         };
         player_send_packet(p, &pkt, p->name);
     }
+    player_release_snapshot(ps, n);
+    if (opened) player_batch_end();
 }
 
 // Looks up a player by avatar, increments its reference count, returns that PLAYER if it exists else NULL
@@ -267,8 +994,19 @@ void player_unref(PLAYER *player, char *why) {
     if (player->refcount == 0) {
         pthread_mutex_unlock(&player->mutex);
         pthread_mutex_lock(&players_mutex);
-        players[player->avatar - 'A'] = NULL;
+        if (players[player->avatar - 'A'] == player) { // not a new player who has since taken the avatar
+            players[player->avatar - 'A'] = NULL;
+        }
         pthread_mutex_unlock(&players_mutex);
+        if (player->outq) {
+            player_queue_free(player->outq, player->fd);
+        }
+        for (PLAYER_EVENT *ev = player_take_events(player), *next; ev; ev = next) {
+            next = ev->next;
+            Free(ev);
+        }
+        Close(player->eventfd);
+        free(player->outbuf);
         free(player->name);
         if (player->prev_view) {
             free(player->prev_view);
@@ -282,13 +1020,70 @@ void player_unref(PLAYER *player, char *why) {
 
 // Sends packet via proto_send_packet
 int player_send_packet(PLAYER *player, MZW_PACKET *pkt, void *data) {
+    struct iovec payload = {data, data ? pkt->size : 0};
+    return player_send_packetv(player, pkt, &payload, data && pkt->size > 0 ? 1 : 0);
+}
+
+int player_send_packetv(PLAYER *player, MZW_PACKET *pkt, struct iovec *iov, int iovcnt) {
     struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    pkt->timestamp_sec  = (uint32_t)ts.tv_sec;
-    pkt->timestamp_nsec = (uint32_t)ts.tv_nsec;
+    if (player->outq && !player->batch_frames) { // nothing is ever buffered for the player
+        int slow = player_check_slow(player, pkt->type);
+        if (slow) return slow < 0 ? -1 : 0;
+        player_stamp(player, pkt, &ts);
+        return player_queue_push(player->outq, pkt, iov, iovcnt, &ts);
+    }
     int rc;
     pthread_mutex_lock(&player->mutex);
-    rc = proto_send_packet(player->fd, pkt, data);
+    int slow = player_slow_locked(player, pkt->type, !batching || player->outlen == 0); // once per flush in a batch
+    if (slow) {
+        pthread_mutex_unlock(&player->mutex);
+        return slow < 0 ? -1 : 0;
+    }
+    player_stamp(player, pkt, &ts);
+    int buffer = player_buffering_locked(player);
+    if (buffer) {
+        rc = player_frame_room_locked(player, sizeof(MZW_PACKET) + pkt->size);
+        player_buffer_locked(player, pkt, iov, iovcnt);
+        if (player_batch_full_locked(player) && player_flush_locked(player) < 0) rc = -1;
+    } else { // anything buffered by another thread's batch has to go out first
+        rc = player_flush_locked(player);
+        if (rc == 0) {
+            rc = player->outq ? player_queue_push(player->outq, pkt, iov, iovcnt, &ts) :
+                 proto_send_packetv(player->fd, pkt, iov, iovcnt);
+        }
+    }
+    pthread_mutex_unlock(&player->mutex);
+    if (buffer) {
+        player_batch_mark(player);
+    }
+    return rc;
+}
+
+int player_send_ready(PLAYER *player, MZW_PACKET *pkt, int version) {
+    int rc;
+    pthread_mutex_lock(&player->mutex); // nothing can be buffered or sent for the player meanwhile
+    if (player_flush_locked(player) < 0) { // encoded as version 1, so it goes out ahead of READY
+        pthread_mutex_unlock(&player->mutex);
+        return -1;
+    }
+    if (!player->outq) {
+        rc = proto_send_packet(player->fd, pkt, NULL);
+        proto_set_version(player->fd, version); // everything after it, both ways
+        pthread_mutex_unlock(&player->mutex);
+        return rc;
+    }
+    struct timespec ts;
+    player_stamp(player, pkt, &ts);
+    PLAYER_QENTRY e = {.packed = 1, .version = version, .len = sizeof(MZW_PACKET) + pkt->size};
+    e.data = Malloc(e.len);
+    proto_pack_packet(-1, e.data, pkt, NULL, 0); // version 1, whenever the writer gets to it
+    __atomic_store_n(&player->ready_pending, 1, __ATOMIC_RELAXED);
+    rc = player_queue_put(player->outq, &e, &ts);
+    if (rc < 0) {
+        __atomic_store_n(&player->ready_pending, 0, __ATOMIC_RELAXED); // never written, both ways stay at version 1
+    } else {
+        proto_set_recv_version(player->fd, version); // the client may answer as soon as READY is written
+    }
     pthread_mutex_unlock(&player->mutex);
     return rc;
 }
@@ -308,27 +1103,31 @@ int player_get_location(PLAYER *player, int *rowp, int *colp, int *dirp){
     return 0;
 }
 
+OBJECT player_get_avatar(PLAYER *player) {
+    return player->avatar;
+}
+
 // Attempt to move player avatar forward/backward one unit of distance (dir = sign)
 int player_move(PLAYER *player, int dir){
     int row, col, gaze;
+    // the location may be changed by a hit or a respawn on another thread
+    pthread_mutex_lock(&player->mutex);
     // Grab position + direction of gaze, fails if not within bound
     if (player_get_location(player, &row, &col, &gaze) != 0) {
+        pthread_mutex_unlock(&player->mutex);
         return -1;
     }
     DIRECTION move_direction = (dir == 1 ? gaze : REVERSE(gaze)); // current gaze if dir = 1, else reverse 
     int move = maze_move(row, col, move_direction);
-    // If move successful, must update this information to all clients
-    if (move == 0) { // calculate delta after move
+    if (move == 0) {
         player->row = row + dr[move_direction];
         player->col = col + dc[move_direction];
+    }
+    pthread_mutex_unlock(&player->mutex); // not held while taking the other players' locks below
+    // If move successful, must update this information to all clients
+    if (move == 0) {
         // Update view incrementally
-        for (int i = 0; i < NUM_AVATARS; i++) {
-            PLAYER *p = players[i];
-            if (p) {
-                // player_invalidate_view(p);
-                player_update_view(p);
-            }
-        }
+        player_update_all_views(0);
     }
     return move;
 }
@@ -357,8 +1156,7 @@ void player_fire_laser(PLAYER *player) {
         // Find target if maze_find_target found the target avatar to shoot the laser at
         PLAYER *victim = player_get(target);
         if (victim) {
-            pthread_kill(victim->thread_id, SIGUSR1); // sends SIGUSR1 to victim thread_id
-            player_unref(victim, "player_fire_laser");
+            player_post_event(victim, PLAYER_EV_HIT, player->avatar); // wakes whatever thread serves the victim
         }
         // Increment self score
         pthread_mutex_lock(&player->mutex);
@@ -372,14 +1170,11 @@ void player_fire_laser(PLAYER *player) {
             .param3 = 0,
             .size = 0
         };
-        pthread_mutex_lock(&players_mutex);
-        for (int i = 0; i < NUM_AVATARS; i++) {
-            PLAYER *p = players[i];
-            if (p){
-                player_send_packet(p, &pkt, NULL);
-            }
+        player_broadcast(&pkt, NULL, 0);
+        if (victim) {
+            if (hit_handler) hit_handler(victim);
+            player_unref(victim, "player_fire_laser");
         }
-        pthread_mutex_unlock(&players_mutex);
     }
 }
 
@@ -394,38 +1189,207 @@ void player_invalidate_view(PLAYER *player){
     pthread_mutex_unlock(&player->mutex);
 }
 
-void player_update_view(PLAYER *player){
-    int row, col, gaze;
-    player_get_location(player, &row, &col, &gaze); // grab current position + direction of gaze
-    // allocate space for new vice X3D and generate it
-    char (*new_view)[VIEW_WIDTH] = Malloc(VIEW_DEPTH * sizeof new_view[0]);
+// Send the whole view as one numbered datagram, and keep it as the previous view
+static void player_send_view_datagram(PLAYER *player, char (*view)[VIEW_WIDTH], int depth) {
+    MZW_PACKET pkt = {.type = MZW_VIEW_PKT, .param1 = depth, .size = depth * VIEW_WIDTH};
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pkt.timestamp_sec = (uint32_t)ts.tv_sec;
+    pkt.timestamp_nsec = (uint32_t)ts.tv_nsec;
+    struct iovec iov = {view, pkt.size};
+    pthread_mutex_lock(&player->mutex); // datagrams leave in the order they are numbered
+    if (proto_send_datagram(player->udp_fd, (struct sockaddr *)&player->udp_addr, player->udp_addrlen,
+                            ++player->view_seq, &pkt, &iov, 1) < 0) {
+        debug("VIEW datagram %u to %s lost: %s", player->view_seq, player->name, strerror(errno));
+    }
+    if (player->prev_view) free(player->prev_view);
+    player->prev_view = view;
+    player->prev_depth = depth;
+    pthread_mutex_unlock(&player->mutex);
+}
+
+void player_set_view_channel(PLAYER *player, int udp_fd, struct sockaddr *addr, socklen_t addrlen) {
+    if (addrlen > sizeof player->udp_addr) addrlen = sizeof player->udp_addr;
     pthread_mutex_lock(&player->mutex);
-    int new_depth = maze_get_view((VIEW *)new_view, row, col, player->gaze, VIEW_DEPTH );   
+    memcpy(&player->udp_addr, addr, addrlen);
+    player->udp_addrlen = addrlen;
+    player->udp_fd = udp_fd;
+    pthread_mutex_unlock(&player->mutex);
+}
+
+void player_set_batch_frames(PLAYER *player) {
+    pthread_mutex_lock(&player->mutex);
+    player->batch_frames = 1;
+    pthread_mutex_unlock(&player->mutex);
+}
+
+void player_set_packed_views(PLAYER *player) {
+    pthread_mutex_lock(&player->mutex);
+    player->packed_views = 1;
     pthread_mutex_unlock(&player->mutex);
-    int full_update = (player->prev_view == NULL || player->prev_depth != new_depth); // see if need full or incremental update
-    if (full_update) { // if full update, clear board, then resend full view
+}
+
+// Where the packets of a view update go: sent to the player as usual, or encoded by its writer thread
+typedef struct view_sink {
+    PLAYER *player;
+    int encode; // nonzero = append to buf instead of sending
+    char *buf;
+    size_t len;
+    size_t cap;
+    int pkts; // number of packets in buf
+} VIEW_SINK;
+
+static void view_sink_put(VIEW_SINK *sink, MZW_PACKET *pkt, void *data) {
+    if (!sink->encode) {
+        player_send_packet(sink->player, pkt, data);
+        return;
+    }
+    struct timespec ts;
+    player_stamp(sink->player, pkt, &ts);
+    size_t need = sink->len + sizeof(MZW_PACKET) + pkt->size;
+    if (need > sink->cap) {
+        sink->cap = need > 2 * sink->cap ? need : 2 * sink->cap;
+        sink->buf = Realloc(sink->buf, sink->cap);
+    }
+    struct iovec iov = {data, pkt->size};
+    sink->len += proto_pack_packet(sink->player->fd, sink->buf + sink->len, pkt, &iov, data ? 1 : 0);
+    sink->pkts++;
+}
+
+// Send a view update as one VIEW packet, if anything has changed
+static void player_emit_packed_view(VIEW_SINK *sink, char (*old)[VIEW_WIDTH], char (*view)[VIEW_WIDTH],
+                                    int depth, int full_update) {
+    char delta[(VIEW_DEPTH * VIEW_WIDTH + 7) / 8 + VIEW_DEPTH * VIEW_WIDTH];
+    MZW_PACKET pkt = {.type = MZW_VIEW_PKT, .param1 = depth, .param2 = MZW_VIEW_FULL, .size = depth * VIEW_WIDTH};
+    unsigned long shows;
+    if (full_update) {
+        view_sink_put(sink, &pkt, view);
+        shows = 1 + depth * VIEW_WIDTH; // CLEAR, then every cell
+    } else {
+        size_t len = proto_pack_view_delta(delta, old[0], view[0], depth);
+        if (len == 0) return; // nothing changed, nothing to send
+        pkt.param2 = MZW_VIEW_DELTA;
+        pkt.size = len;
+        view_sink_put(sink, &pkt, delta);
+        shows = len - (depth * VIEW_WIDTH + 7) / 8; // one byte per changed cell after the mask
+    }
+    __atomic_fetch_add(&view_stats.updates, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&view_stats.show_packets, shows, __ATOMIC_RELAXED);
+}
+
+// Emit the packets that take the client from the old view to the new one
+static void player_emit_view(VIEW_SINK *sink, char (*old)[VIEW_WIDTH], int old_depth,
+                             char (*view)[VIEW_WIDTH], int depth, int full_update) {
+    if (sink->player->packed_views) {
+        player_emit_packed_view(sink, old, view, depth, full_update);
+    } else if (full_update) { // if full update, clear board, then resend full view
         MZW_PACKET clear = {MZW_CLEAR_PKT, 0, 0, 0, 0};
-        player_send_packet(player, &clear, NULL);
+        view_sink_put(sink, &clear, NULL);
         // display all cells in new view
-        for (int d = 0; d < new_depth; d++) {
+        for (int d = 0; d < depth; d++) {
             for (int w = 0; w < VIEW_WIDTH; w++) {
                 // obj = object type, w = (l-wall,corridor,r-wall), d = depth, 0 = size of payload
-                MZW_PACKET show = {MZW_SHOW_PKT, new_view[d][w], w, d, 0};
-                player_send_packet(player, &show, NULL);
+                MZW_PACKET show = {MZW_SHOW_PKT, view[d][w], w, d, 0};
+                view_sink_put(sink, &show, NULL);
             }
         }
     } else {
         // Show incremental changed cells only, don't clear view
-        for (int d = 0; d < new_depth; d++) {
+        for (int d = 0; d < depth; d++) {
             for (int w = 0; w < VIEW_WIDTH; w++) {
-                char nc = new_view[d][w];
-                char oc = (d < player->prev_depth ? player->prev_view[d][w] : '\0');
+                char nc = view[d][w];
+                char oc = (d < old_depth ? old[d][w] : '\0');
                 if (nc == oc) continue;
                 MZW_PACKET show = {MZW_SHOW_PKT, nc, w, d, 0};
-                player_send_packet(player, &show, NULL);
+                view_sink_put(sink, &show, NULL);
             }
         }
     }
+}
+
+// Leave the view for the writer thread to send, replacing one it has not got to yet
+static void player_queue_view(PLAYER *player, char (*view)[VIEW_WIDTH], int depth, int full_update) {
+    if (player_check_slow(player, MZW_VIEW_PKT)) return;
+    pthread_mutex_lock(&player->mutex);
+    memcpy(player->pending_view, view, depth * sizeof view[0]);
+    player->pending_depth = depth;
+    player->pending_full |= full_update;
+    int queued = player->view_queued;
+    player->view_queued = 1;
+    pthread_mutex_unlock(&player->mutex);
+    if (queued) { // the one already queued now sends this
+        __atomic_fetch_add(&view_stats.conflated, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    PLAYER_QENTRY e = {.view = 1, .len = (1 + depth * VIEW_WIDTH) * sizeof(MZW_PACKET)};
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (player_queue_put(player->outq, &e, &ts) < 0) {
+        pthread_mutex_lock(&player->mutex);
+        player->view_queued = 0; // the next update tries again, in full
+        player->pending_full = 1;
+        pthread_mutex_unlock(&player->mutex);
+    }
+}
+
+// Writer thread: send the newest view left by player_queue_view(), as changes from the last one it sent
+static int player_write_view(PLAYER *player) {
+    char view[VIEW_DEPTH][VIEW_WIDTH];
+    pthread_mutex_lock(&player->mutex);
+    int depth = player->pending_depth;
+    memcpy(view, player->pending_view, depth * sizeof view[0]);
+    int full_update = player->pending_full || player->sent_depth != depth;
+    player->pending_full = 0;
+    player->view_queued = 0;
+    pthread_mutex_unlock(&player->mutex);
+    VIEW_SINK sink = {.player = player, .encode = 1};
+    player_emit_view(&sink, player->sent_view, player->sent_depth, view, depth, full_update);
+    int rc = 0;
+    if (sink.pkts > 1 && player->batch_frames) {
+        MZW_PACKET batch = {.type = MZW_BATCH_PKT, .param1 = (uint8_t)sink.pkts, .size = sink.len};
+        struct timespec ts;
+        player_stamp(player, &batch, &ts);
+        struct iovec iov = {sink.buf, sink.len};
+        rc = proto_send_packetv(player->fd, &batch, &iov, 1);
+        __atomic_fetch_add(&batch_stats.frames, 1, __ATOMIC_RELAXED);
+    } else if (sink.len) {
+        rc = proto_send_packed(player->fd, sink.buf, sink.len);
+    }
+    free(sink.buf);
+    memcpy(player->sent_view, view, depth * sizeof view[0]); // only the writer uses sent_view
+    player->sent_depth = depth;
+    return rc;
+}
+
+void player_update_view(PLAYER *player){
+    if (view_batching) { // computed once, when the batch ends
+        view_dirty |= 1u << (player->avatar - 'A');
+        return;
+    }
+    int row, col, gaze;
+    if (player_get_location(player, &row, &col, &gaze) < 0) { // not in the maze while frozen, nothing to see
+        return;
+    }
+    // allocate space for new vice X3D and generate it
+    char (*new_view)[VIEW_WIDTH] = Malloc(VIEW_DEPTH * sizeof new_view[0]);
+    pthread_mutex_lock(&player->mutex);
+    int new_depth = maze_get_view((VIEW *)new_view, row, col, player->gaze, VIEW_DEPTH );   
+    pthread_mutex_unlock(&player->mutex);
+    if (player->udp_fd >= 0) {
+        player_send_view_datagram(player, new_view, new_depth);
+        return;
+    }
+    // see if need full or incremental update, the client may also have missed some of the last one
+    int full_update = (player->prev_view == NULL || player->prev_depth != new_depth ||
+                       __atomic_exchange_n(&player->view_lost, 0, __ATOMIC_RELAXED));
+    if (player->outq) { // latest view wins, the writer works out what the client is missing
+        player_queue_view(player, new_view, new_depth, full_update);
+    } else {
+        int opened = player->batch_frames && player_batch_open(); // the update arrives as one BATCH
+        VIEW_SINK sink = {.player = player};
+        player_emit_view(&sink, player->prev_view, player->prev_depth, new_view, new_depth, full_update);
+        if (opened) player_batch_end();
+    }
     pthread_mutex_lock(&player->mutex);
     if (player->prev_view) free(player->prev_view);
     player->prev_view = new_view;
@@ -433,54 +1397,60 @@ void player_update_view(PLAYER *player){
     pthread_mutex_unlock(&player->mutex);
 }
 
-// Check if a player got hit via hit_pending flag
-void player_check_for_laser_hit(PLAYER *player) {
+int player_get_eventfd(PLAYER *player) {
+    return player->eventfd;
+}
+
+int player_has_events(PLAYER *player) {
+    return __atomic_load_n(&player->mailbox, __ATOMIC_ACQUIRE) != NULL;
+}
+
+// Check the mailbox for laser hits, take them out of the maze and schedule the respawn if so
+int player_take_laser_hit(PLAYER *player) {
     int hit = 0;
-    pthread_mutex_lock(&player->mutex);
-    if (player->hit_pending) { hit = 1; player->hit_pending = 0; }
-    pthread_mutex_unlock(&player->mutex);
-    if (!hit) return;
+    for (PLAYER_EVENT *ev = player_take_events(player), *next; ev; ev = next) {
+        next = ev->next;
+        if (ev->type == PLAYER_EV_HIT) {
+            debug("%s was hit by '%c'", player->name, ev->from);
+            hit = 1; // several hits before the player noticed still freeze it once
+        }
+        Free(ev);
+    }
+    if (!hit || tw_pending(&player->respawn)) return 0; // a hit fired before the last one landed
     int r, c, d; // if hit, remove from avatar from location, update other players view about this change
-    if (player_get_location(player, &r, &c, &d) == 0) {
+    pthread_mutex_lock(&player->mutex);
+    int placed = player_get_location(player, &r, &c, &d) == 0;
+    if (placed) {
         maze_remove_player(player->avatar, r, c);
-        for (int i = 0; i < NUM_AVATARS; i++) {
-            PLAYER *p = players[i];
-            if (p) player_update_view(p);
-        }
+        player->row = -1; // off the maze, so moves and shots fail until the respawn
+        player->col = -1;
+    }
+    pthread_mutex_unlock(&player->mutex);
+    if (placed) {
+        player_update_all_views(0);
     }
     MZW_PACKET alert = {.type = MZW_ALERT_PKT, .param1 = 0, .param2 = 0, .param3 = 0, .size = 0}; // send alert packet
     player_send_packet(player, &alert, NULL);
-    // freezes for 3 seconds, then reset player into maze
-    sleep(3);
-    player_reset(player);
+    tw_add(&player->respawn, PLAYER_FREEZE_SECS * 1000UL); // player_reset() on the timer thread
+    return 1;
+}
+
+void player_check_for_laser_hit(PLAYER *player) {
+    player_take_laser_hit(player);
 }
 
 void player_send_chat(PLAYER *player, char *msg, size_t len){
     size_t name_len = strlen(player->name);
-    size_t prefix_len = name_len + 4;  // '[' + avatar + ']' + ' ' (basically [avatar] _ where _ is whitespace)
-    size_t total_len  = prefix_len + len;
-    char *buf = Malloc(total_len);
-    memcpy(buf, player->name, name_len); // copy username, and format the [] brackets
-    buf[name_len + 0] = '[';
-    buf[name_len + 1] = player->avatar;
-    buf[name_len + 2] = ']';
-    buf[name_len + 3] = ' ';
-    memcpy(buf + prefix_len, msg, len); // copy their msg
+    // '[' + avatar + ']' + ' ' (basically [avatar] _ where _ is whitespace)
+    char tag[4] = {'[', player->avatar, ']', ' '};
     MZW_PACKET pkt = {
         .type = MZW_CHAT_PKT,
         .param1 = 0,
         .param2 = 0,
         .param3 = 0,
-        .size = (uint16_t)total_len
+        .size = (uint16_t)(name_len + sizeof tag + len)
     };
-    pthread_mutex_lock(&players_mutex);
-    // Send this structured chat packet to all players
-    for (int i = 0; i < NUM_AVATARS; i++) {
-        PLAYER *p = players[i];
-        if (p) {
-            player_send_packet(p, &pkt, buf);
-        }
-    }
-    pthread_mutex_unlock(&players_mutex);
-    free(buf);
+    // Send this structured chat packet to all players, gathered once from the name and message
+    struct iovec iov[3] = {{player->name, name_len}, {tag, sizeof tag}, {msg, len}};
+    player_broadcast(&pkt, iov, 3);
 }
\ No newline at end of file
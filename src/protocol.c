@@ -1,14 +1,76 @@
 #include "protocol.h"
 #include "csapp.h"
+#include "uring.h"
 #include "debug.h"
 
+static PROTO_BACKEND proto_backend = PROTO_BACKEND_RW;
+static unsigned char fd_version[PROTO_MAX_FDS]; // protocol version sent on each connection less one, so 0 = version 1
+static unsigned char fd_recv_version[PROTO_MAX_FDS]; // and the version received on it, which may switch first
+
+#define V2_NPARAMS 0x03 // flags: number of parameters present, trailing zero parameters are left out
+#define V2_TIMESTAMP 0x04 // flags: timestamp present
+#define V2_TYPE_BITS 5 // the type and size share a varint, type in the low bits
+#define V2_MAX_VARINT 3 // enough for a 16 bit size and the type
+
+int proto_set_version(int fd, int version) {
+    if (fd < 0 || fd >= PROTO_MAX_FDS || version < PROTO_VERSION_1 || version > PROTO_VERSION_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    __atomic_store_n(&fd_recv_version[fd], version - 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&fd_version[fd], version - 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int proto_set_recv_version(int fd, int version) {
+    if (fd < 0 || fd >= PROTO_MAX_FDS || version < PROTO_VERSION_1 || version > PROTO_VERSION_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    __atomic_store_n(&fd_recv_version[fd], version - 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int proto_get_version(int fd) {
+    if (fd < 0 || fd >= PROTO_MAX_FDS) return PROTO_VERSION_1;
+    return __atomic_load_n(&fd_version[fd], __ATOMIC_ACQUIRE) + 1;
+}
+
+// The version packets arriving on a connection are in
+static int recv_version(int fd) {
+    if (fd < 0 || fd >= PROTO_MAX_FDS) return PROTO_VERSION_1;
+    return __atomic_load_n(&fd_recv_version[fd], __ATOMIC_ACQUIRE) + 1;
+}
+
+int proto_init_backend(PROTO_BACKEND backend) {
+    if (backend == PROTO_BACKEND_URING && uring_init(URING_ENTRIES) < 0) {
+        return -1;
+    }
+    proto_backend = backend;
+    return 0;
+}
+
+void proto_fini_backend(void) {
+    if (proto_backend == PROTO_BACKEND_URING) {
+        uring_fini();
+    }
+    proto_backend = PROTO_BACKEND_RW;
+}
+
+static __thread char *oversize_buf; // payloads too large for a rio_t buffer, borrowed by the caller
+static __thread size_t oversize_cap;
+
+static ssize_t backend_read(int fd, void *buf, size_t n) {
+    return proto_backend == PROTO_BACKEND_URING ? uring_read(fd, buf, n) : read(fd, buf, n);
+}
+
 // readn without EINTR retry (modification of CSAPP wrapper rio_readn)
 static ssize_t readn(int fd, void *usrbuf, size_t n) {
     size_t nleft = n;
     ssize_t nread;
     char *bufp = usrbuf;
     while (nleft > 0) {
-        nread = read(fd, bufp, nleft);
+        nread = backend_read(fd, bufp, nleft);
         if (nread < 0)
             return -1; // no retry on EINTR
         else if (nread == 0)
@@ -19,45 +81,240 @@ static ssize_t readn(int fd, void *usrbuf, size_t n) {
     return (n - nleft);
 }
 
+// One gathering write: sendmsg() on sockets so the header and payload share a segment, writev() on anything else
+static ssize_t gather_write(int fd, struct iovec *iov, int iovcnt) {
+    if (proto_backend == PROTO_BACKEND_URING) {
+        return uring_writev(fd, iov, iovcnt);
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) {
+        n = writev(fd, iov, iovcnt);
+    }
+    return n;
+}
+
+// Gathering write until done (modification of CSAPP wrapper rio_writen), iov is consumed
+static ssize_t writevn(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t nwritten = gather_write(fd, iov, iovcnt);
+        if (nwritten < 0 && errno == EINTR) continue; // interrupted by a signal, nothing written
+        if (nwritten <= 0) return -1;
+        total += nwritten;
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) { // skip buffers fully written
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) { // short write, resume partway through a buffer
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return total;
+}
+
+// Convert a header into network byte order for transmission
+static void encode_header(MZW_PACKET *pkt, MZW_PACKET *netpkt) {
+    netpkt->type = pkt->type;
+    netpkt->param1 = pkt->param1;
+    netpkt->param2 = pkt->param2;
+    netpkt->param3 = pkt->param3;
+    netpkt->size = htons(pkt->size);
+    netpkt->timestamp_sec = htonl(pkt->timestamp_sec);
+    netpkt->timestamp_nsec = htonl(pkt->timestamp_nsec);
+}
+
+// Convert a header received off the wire into host byte order
+static void decode_header(MZW_PACKET *netpkt, MZW_PACKET *pkt) {
+    pkt->type = netpkt->type;
+    pkt->param1 = netpkt->param1;
+    pkt->param2 = netpkt->param2;
+    pkt->param3 = netpkt->param3;
+    pkt->size = ntohs(netpkt->size);
+    pkt->timestamp_sec = ntohl(netpkt->timestamp_sec);
+    pkt->timestamp_nsec = ntohl(netpkt->timestamp_nsec);
+}
+
+// Encode a version 2 header: flags, varint of size and type, parameters, timestamp; at most 15 bytes
+static size_t encode_header_v2(MZW_PACKET *pkt, unsigned char *out) {
+    unsigned char *p = out;
+    int nparams = pkt->param3 ? 3 : pkt->param2 ? 2 : pkt->param1 ? 1 : 0;
+    int stamped = pkt->timestamp_sec || pkt->timestamp_nsec;
+    *p++ = nparams | (stamped ? V2_TIMESTAMP : 0);
+    uint32_t v = (uint32_t)pkt->size << V2_TYPE_BITS | (pkt->type & ((1 << V2_TYPE_BITS) - 1));
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    int8_t params[3] = {pkt->param1, pkt->param2, pkt->param3};
+    memcpy(p, params, nparams);
+    p += nparams;
+    if (stamped) {
+        uint32_t ts[2] = {htonl(pkt->timestamp_sec), htonl(pkt->timestamp_nsec)};
+        memcpy(p, ts, sizeof ts);
+        p += sizeof ts;
+    }
+    return p - out;
+}
+
+// Decode a version 2 header, return its length, or 0 if buf does not hold all of it yet
+static size_t decode_header_v2(const unsigned char *buf, size_t len, MZW_PACKET *pkt) {
+    if (len < 2) return 0;
+    const unsigned char *p = buf + 1;
+    uint32_t v = 0;
+    for (int i = 0; i < V2_MAX_VARINT; i++) { // a continuation bit on the last byte allowed is ignored
+        if ((size_t)(p - buf) >= len) return 0;
+        v |= (uint32_t)(*p & 0x7f) << (7 * i);
+        if (!(*p++ & 0x80)) break;
+    }
+    int nparams = buf[0] & V2_NPARAMS;
+    int stamped = (buf[0] & V2_TIMESTAMP) != 0;
+    size_t hlen = (p - buf) + nparams + (stamped ? 8 : 0);
+    if (len < hlen) return 0;
+    memset(pkt, 0, sizeof *pkt);
+    pkt->type = v & ((1 << V2_TYPE_BITS) - 1);
+    pkt->size = v >> V2_TYPE_BITS;
+    int8_t params[3] = {0};
+    memcpy(params, p, nparams);
+    p += nparams;
+    pkt->param1 = params[0];
+    pkt->param2 = params[1];
+    pkt->param3 = params[2];
+    if (stamped) {
+        uint32_t ts[2];
+        memcpy(ts, p, sizeof ts);
+        pkt->timestamp_sec = ntohl(ts[0]);
+        pkt->timestamp_nsec = ntohl(ts[1]);
+    }
+    return hlen;
+}
+
+// Encode a header as the connection's version requires, into at least sizeof(MZW_PACKET) bytes
+static size_t encode_header_for(int fd, MZW_PACKET *pkt, void *out) {
+    if (proto_get_version(fd) >= PROTO_VERSION_2) {
+        return encode_header_v2(pkt, out);
+    }
+    MZW_PACKET netpkt = {0};
+    encode_header(pkt, &netpkt);
+    memcpy(out, &netpkt, sizeof netpkt); // out need not be aligned
+    return sizeof netpkt;
+}
+
 int proto_send_packet(int fd, MZW_PACKET *pkt, void *data) {
-    if(!pkt){ // ensure incoming pkt is non-NULL
+    struct iovec payload = {data, data ? pkt->size : 0};
+    return proto_send_packetv(fd, pkt, &payload, data && pkt->size > 0 ? 1 : 0);
+}
+
+int proto_send_packetv(int fd, MZW_PACKET *pkt, const struct iovec *iov, int iovcnt) {
+    if(!pkt || iovcnt < 0 || iovcnt > PROTO_MAX_FRAGMENTS){ // ensure incoming pkt is non-NULL
+        errno = EINVAL;
         return -1;
     }
-    MZW_PACKET netpkt = {
-        .type = pkt->type,
-        .param1 = pkt->param1,
-        .param2 = pkt->param2,
-        .param3 = pkt->param3,
-        .size = htons(pkt->size),
-        .timestamp_sec = htonl(pkt->timestamp_sec),
-        .timestamp_nsec = htonl(pkt->timestamp_nsec)
-    };
-    // send header
-    ssize_t size = rio_writen(fd, &netpkt, sizeof netpkt);
-    if (size != sizeof(netpkt)) return -1;
-    // send payload if exists
-    if (pkt->size > 0 && data) {
-        size = rio_writen(fd, data, pkt->size);
-        if (size != pkt->size) return -1;
+    unsigned char hdr[sizeof(MZW_PACKET)];
+    size_t len = encode_header_for(fd, pkt, hdr);
+    // header and payload fragments go out in a single system call
+    struct iovec vec[PROTO_MAX_FRAGMENTS + 1] = {{hdr, len}};
+    int n = 1;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) continue;
+        vec[n++] = iov[i];
+        len += iov[i].iov_len;
+    }
+    return writevn(fd, vec, n) == (ssize_t)len ? 0 : -1;
+}
+
+size_t proto_pack_packet(int fd, void *buf, MZW_PACKET *pkt, const struct iovec *iov, int iovcnt) {
+    size_t hlen = encode_header_for(fd, pkt, buf);
+    size_t len = hlen;
+    for (int i = 0; i < iovcnt && len - hlen < pkt->size; i++) {
+        size_t n = iov[i].iov_len;
+        if (n > pkt->size - (len - hlen)) n = pkt->size - (len - hlen);
+        memcpy((char *)buf + len, iov[i].iov_base, n);
+        len += n;
+    }
+    return len;
+}
+
+int proto_send_packed(int fd, void *buf, size_t len) {
+    struct iovec iov = {buf, len};
+    return writevn(fd, &iov, 1) == (ssize_t)len ? 0 : -1;
+}
+
+struct proto_frame {
+    int refcount; // changed atomically
+    size_t hdrlen[PROTO_VERSION_MAX]; // by version - 1
+    unsigned char hdr[PROTO_VERSION_MAX][sizeof(MZW_PACKET)];
+    size_t size; // of the payload
+    char data[]; // the payload, shared by every encoding
+};
+
+PROTO_FRAME *proto_frame_create(MZW_PACKET *pkt, const struct iovec *iov, int iovcnt) {
+    PROTO_FRAME *frame = Malloc(sizeof *frame + pkt->size);
+    frame->refcount = 1;
+    MZW_PACKET netpkt = {0};
+    encode_header(pkt, &netpkt);
+    memcpy(frame->hdr[PROTO_VERSION_1 - 1], &netpkt, sizeof netpkt);
+    frame->hdrlen[PROTO_VERSION_1 - 1] = sizeof netpkt;
+    MZW_PACKET unstamped = *pkt;
+    unstamped.timestamp_sec = unstamped.timestamp_nsec = 0;
+    frame->hdrlen[PROTO_VERSION_2 - 1] = encode_header_v2(&unstamped, frame->hdr[PROTO_VERSION_2 - 1]);
+    size_t len = 0;
+    for (int i = 0; i < iovcnt && len < pkt->size; i++) {
+        size_t n = iov[i].iov_len < pkt->size - len ? iov[i].iov_len : pkt->size - len;
+        memcpy(frame->data + len, iov[i].iov_base, n);
+        len += n;
+    }
+    frame->size = len;
+    return frame;
+}
+
+PROTO_FRAME *proto_frame_ref(PROTO_FRAME *frame) {
+    __atomic_fetch_add(&frame->refcount, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void proto_frame_unref(PROTO_FRAME *frame) {
+    if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        Free(frame);
     }
-    return 0;
+}
+
+size_t proto_pack_frame(int fd, void *buf, PROTO_FRAME *frame) {
+    int v = proto_get_version(fd);
+    memcpy(buf, frame->hdr[v - 1], frame->hdrlen[v - 1]);
+    memcpy((char *)buf + frame->hdrlen[v - 1], frame->data, frame->size);
+    return frame->hdrlen[v - 1] + frame->size;
+}
+
+int proto_send_frame(int fd, PROTO_FRAME *frame) {
+    int v = proto_get_version(fd);
+    struct iovec vec[2] = {{frame->hdr[v - 1], frame->hdrlen[v - 1]}, {frame->data, frame->size}};
+    size_t len = vec[0].iov_len + vec[1].iov_len;
+    return writevn(fd, vec, frame->size ? 2 : 1) == (ssize_t)len ? 0 : -1;
 }
 
 int proto_recv_packet(int fd, MZW_PACKET *pkt, void **datap) {
     if(!pkt || !datap){ // ensure incoming pkt and datap are non-NULL
         return -1;
     }
-    MZW_PACKET netpkt;
-    ssize_t size = readn(fd, &netpkt, sizeof(netpkt)); // read header
-    if (size != sizeof(netpkt)) return -1; // real error or EOF
-    // convert data into network-byte order
-    pkt->type = netpkt.type;
-    pkt->param1 = netpkt.param1;
-    pkt->param2 = netpkt.param2;
-    pkt->param3 = netpkt.param3;
-    pkt->size = ntohs(netpkt.size);
-    pkt->timestamp_sec = ntohl(netpkt.timestamp_sec);
-    pkt->timestamp_nsec = ntohl(netpkt.timestamp_nsec);
+    ssize_t size;
+    if (recv_version(fd) >= PROTO_VERSION_2) { // flags and the first varint byte, then the rest once known
+        unsigned char hdr[sizeof(MZW_PACKET)];
+        size_t have = 2, hlen;
+        if (readn(fd, hdr, have) != (ssize_t)have) return -1;
+        while ((hlen = decode_header_v2(hdr, have, pkt)) == 0) {
+            if (readn(fd, hdr + have, 1) != 1) return -1; // one byte at a time, never past the header
+            have++;
+        }
+    } else {
+        MZW_PACKET netpkt;
+        size = readn(fd, &netpkt, sizeof(netpkt)); // read header
+        if (size != sizeof(netpkt)) return -1; // real error or EOF
+        decode_header(&netpkt, pkt); // convert data into host-byte order
+    }
     // read payload if exists
     if (pkt->size > 0) {
         void *buf = Malloc(pkt->size);
@@ -72,4 +329,210 @@ int proto_recv_packet(int fd, MZW_PACKET *pkt, void **datap) {
         *datap = NULL; // else NULL
     }
     return 0;
-}
\ No newline at end of file
+}
+
+// Read until the rio_t buffer holds at least n bytes, without EINTR retry (modification of CSAPP rio_read)
+static int rio_fill(rio_t *rp, size_t n) {
+    if (rp->rio_bufptr + n > rp->rio_buf + RIO_BUFSIZE) { // not enough room behind the unread bytes
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    while ((size_t)rp->rio_cnt < n) {
+        char *end = rp->rio_bufptr + rp->rio_cnt;
+        ssize_t nread = backend_read(rp->rio_fd, end, rp->rio_buf + RIO_BUFSIZE - end); // as much as fits
+        if (nread < 0)
+            return -1; // no retry on EINTR, bytes already buffered are kept for the next call
+        else if (nread == 0)
+            return -1; // EOF in the middle of a packet
+        rp->rio_cnt += nread;
+    }
+    return 0;
+}
+
+int proto_recv_packetb(rio_t *rp, MZW_PACKET *pkt, void **datap) {
+    if(!rp || !pkt || !datap){ // ensure incoming arguments are non-NULL
+        return -1;
+    }
+    size_t hlen;
+    if (recv_version(rp->rio_fd) >= PROTO_VERSION_2) { // the header is complete once it decodes
+        size_t need = 2;
+        while (1) {
+            if (rio_fill(rp, need) < 0) return -1;
+            if ((hlen = decode_header_v2((unsigned char *)rp->rio_bufptr, rp->rio_cnt, pkt)) > 0) break;
+            need = rp->rio_cnt + 1;
+        }
+    } else {
+        if (rio_fill(rp, sizeof(MZW_PACKET)) < 0) return -1;
+        MZW_PACKET netpkt;
+        memcpy(&netpkt, rp->rio_bufptr, sizeof netpkt); // buffer need not be aligned
+        decode_header(&netpkt, pkt);
+        hlen = sizeof(MZW_PACKET);
+    }
+    size_t total = hlen + pkt->size;
+    if (total <= RIO_BUFSIZE) { // common case, the whole packet is parsed in place
+        if (rio_fill(rp, total) < 0) return -1;
+        *datap = pkt->size > 0 ? rp->rio_bufptr + hlen : NULL; // borrowed, not a copy
+        rp->rio_bufptr += total;
+        rp->rio_cnt -= total;
+        return 0;
+    }
+    // Payload larger than the buffer: move what has arrived and read the rest directly
+    if (pkt->size > oversize_cap) {
+        oversize_buf = Realloc(oversize_buf, pkt->size);
+        oversize_cap = pkt->size;
+    }
+    size_t have = rp->rio_cnt - hlen;
+    memcpy(oversize_buf, rp->rio_bufptr + hlen, have);
+    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_cnt = 0;
+    if (readn(rp->rio_fd, oversize_buf + have, pkt->size - have) != (ssize_t)(pkt->size - have)) {
+        return -1;
+    }
+    *datap = oversize_buf;
+    return 0;
+}
+
+void proto_recv_release(void) {
+    Free(oversize_buf);
+    oversize_buf = NULL;
+    oversize_cap = 0;
+}
+
+size_t proto_parse_packet(int fd, void *buf, size_t len, MZW_PACKET *pkt, void **datap) {
+    size_t hlen;
+    MZW_PACKET hdr;
+    if (recv_version(fd) >= PROTO_VERSION_2) {
+        if ((hlen = decode_header_v2(buf, len, &hdr)) == 0) return 0; // header not complete yet
+    } else {
+        if (len < sizeof(MZW_PACKET)) return 0; // header not complete yet
+        MZW_PACKET netpkt;
+        memcpy(&netpkt, buf, sizeof netpkt); // buf need not be aligned
+        decode_header(&netpkt, &hdr);
+        hlen = sizeof(MZW_PACKET);
+    }
+    size_t total = hlen + hdr.size;
+    if (len < total) return 0; // payload not complete yet
+    *pkt = hdr;
+    *datap = pkt->size > 0 ? (char *)buf + hlen : NULL; // borrowed, not a copy
+    return total;
+}
+
+int proto_seq_after(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+int proto_send_datagram(int fd, const struct sockaddr *to, socklen_t tolen, uint32_t seq,
+                        MZW_PACKET *pkt, const struct iovec *iov, int iovcnt) {
+    if (!pkt || iovcnt < 0 || iovcnt > PROTO_MAX_FRAGMENTS) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t len = sizeof(MZW_PACKET) + PROTO_SEQ_SIZE + pkt->size;
+    if (len > PROTO_MAX_DATAGRAM) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    MZW_PACKET wire = *pkt;
+    wire.size += PROTO_SEQ_SIZE; // the sequence number leads the payload
+    MZW_PACKET netpkt = {0};
+    encode_header(&wire, &netpkt);
+    uint32_t netseq = htonl(seq);
+    struct iovec vec[PROTO_MAX_FRAGMENTS + 2] = {{&netpkt, sizeof netpkt}, {&netseq, sizeof netseq}};
+    int n = 2;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0) vec[n++] = iov[i];
+    }
+    struct msghdr msg = {.msg_name = (void *)to, .msg_namelen = to ? tolen : 0, .msg_iov = vec, .msg_iovlen = n};
+    ssize_t sent;
+    while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0 && errno == EINTR)
+        ; // nothing was sent
+    return sent == (ssize_t)len ? 0 : -1;
+}
+
+int proto_recv_datagram(int fd, PROTO_SEQ *seq, void *buf, MZW_PACKET *pkt, void **datap) {
+    if (!seq || !buf || !pkt || !datap) {
+        errno = EINVAL;
+        return -1;
+    }
+    ssize_t len = recv(fd, buf, PROTO_MAX_DATAGRAM, MSG_TRUNC); // a longer datagram reports its full length
+    if (len < 0) return -1;
+    void *data;
+    if ((size_t)len > PROTO_MAX_DATAGRAM || len < (ssize_t)(sizeof(MZW_PACKET) + PROTO_SEQ_SIZE) ||
+        proto_parse_packet(-1, buf, len, pkt, &data) != (size_t)len) { // datagrams are always version 1
+        errno = EBADMSG;
+        return -1;
+    }
+    uint32_t netseq;
+    memcpy(&netseq, data, sizeof netseq); // data need not be aligned
+    uint32_t n = ntohl(netseq);
+    if (seq->started && !proto_seq_after(n, seq->last)) {
+        seq->stale++;
+        return 0;
+    }
+    if (seq->started) seq->missed += n - seq->last - 1;
+    seq->last = n;
+    seq->started = 1;
+    seq->accepted++;
+    pkt->size -= PROTO_SEQ_SIZE;
+    *datap = pkt->size > 0 ? (char *)data + PROTO_SEQ_SIZE : NULL;
+    return 1;
+}
+
+int proto_batch_next(int fd, void *data, size_t len, size_t *offp, MZW_PACKET *pkt, void **datap) {
+    if (*offp >= len) return 0;
+    size_t used = proto_parse_packet(fd, (char *)data + *offp, len - *offp, pkt, datap);
+    if (used == 0 || pkt->type == MZW_BATCH_PKT) {
+        errno = EBADMSG;
+        return -1;
+    }
+    *offp += used;
+    return 1;
+}
+
+size_t proto_pack_view_delta(void *buf, const char *old_cells, const char *new_cells, int depth) {
+    int ncells = depth * MZW_VIEW_WIDTH;
+    size_t masklen = (ncells + 7) / 8;
+    unsigned char *mask = buf;
+    char *out = (char *)buf + masklen;
+    memset(mask, 0, masklen);
+    for (int i = 0; i < ncells; i++) {
+        if (old_cells[i] == new_cells[i]) continue;
+        mask[i / 8] |= 1 << (i % 8);
+        *out++ = new_cells[i];
+    }
+    return out == (char *)buf + masklen ? 0 : (size_t)(out - (char *)buf);
+}
+
+int proto_apply_view(char *cells, char empty, MZW_PACKET *pkt, void *data) {
+    int depth = pkt->param1;
+    int ncells = depth * MZW_VIEW_WIDTH;
+    if (pkt->type != MZW_VIEW_PKT || depth < 0 || depth > MZW_VIEW_MAX_DEPTH || (pkt->size && !data)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    if (pkt->param2 == MZW_VIEW_FULL) {
+        if (pkt->size != ncells) {
+            errno = EBADMSG;
+            return -1;
+        }
+        memcpy(cells, data, ncells);
+        memset(cells + ncells, empty, (MZW_VIEW_MAX_DEPTH - depth) * MZW_VIEW_WIDTH);
+        return depth;
+    }
+    size_t masklen = (ncells + 7) / 8;
+    const unsigned char *mask = data;
+    size_t changed = 0;
+    for (size_t i = 0; pkt->param2 == MZW_VIEW_DELTA && i < masklen && i < pkt->size; i++) {
+        changed += __builtin_popcount(mask[i]);
+    }
+    if (pkt->param2 != MZW_VIEW_DELTA || pkt->size != masklen + changed ||
+        (ncells % 8 && masklen && (mask[masklen - 1] >> (ncells % 8)))) { // no bits past the last cell
+        errno = EBADMSG;
+        return -1;
+    }
+    const char *in = (const char *)data + masklen;
+    for (int i = 0; i < ncells; i++) {
+        if (mask[i / 8] & (1 << (i % 8))) cells[i] = *in++;
+    }
+    return depth;
+}
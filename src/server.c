@@ -4,10 +4,15 @@
 #include "client_registry.h"
 #include "maze.h"
 #include "player.h"
+#include "tick.h"
+#include "actor.h"
 #include "debug.h"
+#include <poll.h>
 
 int debug_show_maze = 0;
 
+static int view_fd = -1; // UDP socket views are sent from, -1 = no view channel
+
 static void signal_no_restart(int signum, handler_t *handler){
     struct sigaction sa;
     sa.sa_handler = handler;
@@ -17,75 +22,197 @@ static void signal_no_restart(int signum, handler_t *handler){
         unix_error("Signal error");
 }
 
+int mzw_open_view_socket(char *port) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM,
+                             .ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV};
+    struct addrinfo *list, *p;
+    if (getaddrinfo(NULL, port, &hints, &list) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = -1;
+    for (p = list; p; p = p->ai_next) { // same preference as Open_listenfd(), so the families match
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0) continue;
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    if (fd < 0) return -1;
+    view_fd = fd;
+    debug("Views may be sent over UDP from port %s", port);
+    return 0;
+}
+
+// UDP request: send the client's views as datagrams to its UDP port, at the address of its connection
+static void mzw_open_view_channel(int connfd, PLAYER *player, MZW_PACKET *pkt, void *data) {
+    struct sockaddr_storage addr, own;
+    socklen_t len = sizeof addr, ownlen = sizeof own;
+    uint16_t port;
+    int ok = view_fd >= 0 && data && pkt->size == sizeof port &&
+             getpeername(connfd, (SA *)&addr, &len) == 0 && getsockname(view_fd, (SA *)&own, &ownlen) == 0 &&
+             addr.ss_family == own.ss_family && (addr.ss_family == AF_INET || addr.ss_family == AF_INET6);
+    if (ok) {
+        memcpy(&port, data, sizeof port); // already in network byte order
+        if (addr.ss_family == AF_INET) {
+            ((struct sockaddr_in *)&addr)->sin_port = port;
+        } else {
+            ((struct sockaddr_in6 *)&addr)->sin6_port = port;
+        }
+        player_set_view_channel(player, view_fd, (SA *)&addr, len);
+    }
+    MZW_PACKET rsp = {.type = MZW_UDP_PKT, .param1 = ok};
+    player_send_packet(player, &rsp, NULL);
+    if (ok) { // the first datagram carries the whole view
+        player_invalidate_view(player);
+        player_update_view(player);
+    }
+}
+
+void mzw_handle_packet(int connfd, PLAYER **playerp, MZW_PACKET *pkt, void *data) {
+    int login = !*playerp && pkt->type == MZW_LOGIN_PKT;
+    if (actor_enabled()) { // the actor thread calls mzw_apply_packet() for us
+        actor_handle_packet(connfd, playerp, pkt, data);
+    } else {
+        mzw_apply_packet(connfd, playerp, pkt, data);
+    }
+    if (login && !*playerp) { // send INUSE if unsuccessful LOGIN, from here so the actor never writes to a socket
+        MZW_PACKET rsp = {.type = MZW_INUSE_PKT, .size = 0};
+        unsigned char buf[sizeof(MZW_PACKET)];
+        size_t len = proto_pack_packet(connfd, buf, &rsp, NULL, 0);
+        ssize_t n; // without waiting, an event loop serves other clients too
+        while ((n = send(connfd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            ; // nothing was sent
+        if (n != (ssize_t)len) {
+            shutdown(connfd, SHUT_RDWR); // the client leaves its replies unread, or this one was cut short
+        }
+    }
+}
+
+void mzw_logout(PLAYER *player) {
+    if (actor_enabled()) {
+        actor_logout(player);
+    } else {
+        player_logout(player);
+    }
+}
+
+void mzw_leave(PLAYER *player) {
+    if (actor_enabled()) {
+        actor_leave(player);
+    } else {
+        player_leave(player);
+    }
+}
+
+void mzw_apply_packet(int connfd, PLAYER **playerp, MZW_PACKET *pkt, void *data) {
+    PLAYER *player = *playerp;
+    // Since not player, must be LOGIN phase, silently ignore other packets until LOGIN packet successful
+    if (!player) {
+        if (pkt->type == MZW_LOGIN_PKT) {
+            OBJECT avatar = pkt->param1; // avatar is parameter 1
+            char *name = data ? strndup(data, pkt->size) : NULL; // payload is not null-terminated, else Anonymous
+            PLAYER *p = player_login(connfd, avatar, name);
+            free(name);
+            if (p) {
+                *playerp = p; // if player logins, send READY packet to the client
+                MZW_PACKET rsp = {.type = MZW_READY_PKT, .size = 0};
+                rsp.param2 = pkt->param2 & (MZW_FEATURE_PACKED_VIEWS | MZW_FEATURE_BATCH); // the features granted, of those asked for
+                if (rsp.param2 & MZW_FEATURE_PACKED_VIEWS) player_set_packed_views(p);
+                if (rsp.param2 & MZW_FEATURE_BATCH) player_set_batch_frames(p);
+                int version = pkt->param3 > PROTO_VERSION_MAX ? PROTO_VERSION_MAX : pkt->param3; // highest asked for
+                if (version < PROTO_VERSION_1 || connfd >= PROTO_MAX_FDS) version = PROTO_VERSION_1;
+                rsp.param3 = version;
+                player_send_ready(p, &rsp, version); // READY itself is still version 1, queued like any reply
+                player_reset(p); // place player randomly location in maze
+            } // mzw_handle_packet() sends INUSE if unsuccessful LOGIN
+        }
+        return;
+    }
+    // In tick mode the simulation inputs wait for the next tick, chat still goes out at once
+    if (tick_enabled() && pkt->type >= MZW_MOVE_PKT && pkt->type <= MZW_REFRESH_PKT) {
+        tick_submit(player, pkt->type, (int8_t)pkt->param1);
+        return;
+    }
+    // Handle different packet types (MOVE, TURN, FIRE, REFRESH, SEND) POST-LOGIN Successful Phase
+    switch (pkt->type) {
+        case MZW_MOVE_PKT:
+            player_move(player, pkt->param1); // 1 = mv fwd, -1 = mv bkwd
+            break;
+        case MZW_TURN_PKT:
+            player_rotate(player, pkt->param1); // 1 = ccw 90, -1 = cw 90 in degrees
+            break;
+        case MZW_FIRE_PKT:
+            player_fire_laser(player); // fire laser in current direction of gaze
+            break;
+        case MZW_REFRESH_PKT: // invalidate view to provide full update rather than incremental via update_view
+            player_invalidate_view(player);
+            player_update_view(player);
+            break;
+        case MZW_SEND_PKT:
+            player_send_chat(player, data ? (char *)data : NULL, pkt->size); // send message to chat for all clients
+            break;
+        case MZW_UDP_PKT:
+            mzw_open_view_channel(connfd, player, pkt, data);
+            break;
+        default:
+            break; // silently ignore other packet types
+    }
+    if (debug_show_maze) show_maze();
+}
+
 void *mzw_client_service(void *arg) {
     int connfd = *((int *)arg);
     Free(arg); // free descriptor storage
     Pthread_detach(Pthread_self()); // detach itself for implict reaping
+    mzw_serve_client(connfd);
+    return NULL;
+}
+
+void mzw_serve_client(int connfd) {
     creg_register(client_registry, connfd); // register clientfd into creg
     PLAYER *player = NULL;
+    rio_t rio; // pipelined packets are parsed out of one read
+    rio_readinitb(&rio, connfd);
+    int own_hits = !actor_enabled(); // otherwise the actor takes hits and owns the mailbox
     while (1) {
-        if(player){ // Check if a client is hit first before blocking
+        if(own_hits && player && player_has_events(player)){ // Check if a client is hit first before blocking
             player_check_for_laser_hit(player);
         }
+        if (rio.rio_cnt == 0) { // nothing buffered, wait for the client or for an event such as a hit
+            struct pollfd fds[2] = {
+                {.fd = connfd, .events = POLLIN},
+                {.fd = own_hits && player ? player_get_eventfd(player) : -1, .events = POLLIN} // ignored until LOGIN
+            };
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (fds[1].revents & POLLIN) { // also clears a wakeup whose events were already taken
+                player_check_for_laser_hit(player);
+            }
+            if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        }
         // Start receiving packets again normally
         MZW_PACKET pkt;
-        void *data = NULL;
-        int rc = proto_recv_packet(connfd, &pkt, &data);
-        if (rc < 0) { // means interrupted by SIGUSR1, loop back for player_check_for_laser_hit to handle it
+        void *data = NULL; // borrowed from rio, valid until the next receive
+        int rc = proto_recv_packetb(&rio, &pkt, &data);
+        if (rc < 0) { // EOF or error, retry only if some stray signal interrupted the receive
             if (errno == EINTR){
                 continue;
             }
             break;
         }
-        // Since not player, must be LOGIN phase, silently ignore other packets until LOGIN packet successful
-        if (!player) {
-            if (pkt.type == MZW_LOGIN_PKT) {
-                OBJECT avatar = pkt.param1; // avatar is parameter 1
-                char *name = data ? (char *)data : NULL; // data = name if exist otherwise Anonymous
-                PLAYER *p = player_login(connfd, avatar, name);
-                MZW_PACKET rsp = {.size = 0};
-                if (p) {
-                    player = p; // if player logins, send READY packet to the client
-                    rsp.type = MZW_READY_PKT;
-                    proto_send_packet(connfd, &rsp, NULL);
-                    player_reset(player); // place player randomly location in maze
-                } else { // send INUSE if unsuccessful LOGIN
-                    rsp.type = MZW_INUSE_PKT;
-                    proto_send_packet(connfd, &rsp, NULL);
-                }
-            }
-            if (data) Free(data);
-            continue;
-        }
-        // Handle different packet types (MOVE, TURN, FIRE, REFRESH, SEND) POST-LOGIN Successful Phase
-        switch (pkt.type) {
-            case MZW_MOVE_PKT:
-                player_move(player, pkt.param1); // 1 = mv fwd, -1 = mv bkwd
-                break;
-            case MZW_TURN_PKT:
-                player_rotate(player, pkt.param1); // 1 = ccw 90, -1 = cw 90 in degrees
-                break;
-            case MZW_FIRE_PKT:
-                player_fire_laser(player); // fire laser in current direction of gaze
-                break;
-            case MZW_REFRESH_PKT: // invalidate view to provide full update rather than incremental via update_view
-                player_invalidate_view(player);
-                player_update_view(player);
-                break;
-            case MZW_SEND_PKT:
-                player_send_chat(player, data ? (char *)data : NULL, pkt.size); // send message to chat for all clients
-                break;
-            default:
-                break; // silently ignore other packet types
-        }
-        if (data) Free(data);
-        if (debug_show_maze) show_maze();
+        player_batch_begin(); // everything this packet causes to be sent goes out at the end of the iteration
+        mzw_handle_packet(connfd, &player, &pkt, data);
+        player_batch_end();
     }
     // clean up after a player disconnects from server
     if (player) {
-        player_logout(player);
+        mzw_logout(player);
     }
+    proto_recv_release(); // a large payload's storage would otherwise outlive this thread
     creg_unregister(client_registry, connfd);
+    proto_set_version(connfd, PROTO_VERSION_1); // the descriptor may be reused by a new connection
     Close(connfd);
-    return NULL;
-}
\ No newline at end of file
+}
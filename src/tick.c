@@ -0,0 +1,181 @@
+#include "tick.h"
+#include "protocol.h"
+#include "csapp.h"
+#include "debug.h"
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#define TICK_AVATARS ('Z' - 'A' + 1)
+
+typedef struct tick_input { // a packet waiting for the next tick
+    PLAYER *player; // referenced until the input is applied
+    uint8_t type;
+    int8_t param;
+} TICK_INPUT;
+
+static struct {
+    TICK_INPUT *buf;
+    int head; // first input not yet taken by a tick
+    int count; // inputs in buf, including those before head
+    int cap; // enough for every avatar's limit, so the queue never grows
+    int queued[TICK_AVATARS]; // inputs in the queue not yet taken, by avatar
+    char refresh[TICK_AVATARS]; // a REFRESH is among them
+    pthread_mutex_t lock; // protects the queue and the statistics
+} queue;
+
+static int tick_hz; // 0 = tick mode off
+static int timerfd;
+static pthread_t tick_tid;
+static TICK_STATS stats;
+
+static unsigned long elapsed_ns(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+// Take up to TICK_MAX_INPUTS inputs, oldest first, leaving the rest for the next tick
+static int tick_take_inputs(TICK_INPUT *inputs) {
+    pthread_mutex_lock(&queue.lock);
+    int waiting = queue.count - queue.head;
+    int n = waiting < TICK_MAX_INPUTS ? waiting : TICK_MAX_INPUTS;
+    memcpy(inputs, queue.buf + queue.head, n * sizeof *inputs);
+    for (int i = 0; i < n; i++) {
+        int a = player_get_avatar(inputs[i].player) - 'A';
+        queue.queued[a]--;
+        if (inputs[i].type == MZW_REFRESH_PKT) queue.refresh[a] = 0;
+    }
+    queue.head += n;
+    if (queue.head == queue.count) {
+        queue.head = queue.count = 0;
+    }
+    if (waiting > stats.peak_queued) stats.peak_queued = waiting;
+    stats.carried += waiting - n;
+    pthread_mutex_unlock(&queue.lock);
+    return n;
+}
+
+static void tick_apply(TICK_INPUT *in) {
+    switch (in->type) {
+        case MZW_MOVE_PKT:
+            player_move(in->player, in->param);
+            break;
+        case MZW_TURN_PKT:
+            player_rotate(in->player, in->param);
+            break;
+        case MZW_FIRE_PKT:
+            player_fire_laser(in->player);
+            break;
+        case MZW_REFRESH_PKT:
+            player_invalidate_view(in->player);
+            player_update_view(in->player);
+            break;
+    }
+    player_unref(in->player, "tick_apply");
+}
+
+static void *tick_thread(void *arg) {
+    sigset_t mask; // leave SIGHUP to the main thread
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    static TICK_INPUT inputs[TICK_MAX_INPUTS];
+    while (1) {
+        uint64_t expirations;
+        if (read(timerfd, &expirations, sizeof expirations) < 0) {
+            if (errno == EINTR) continue;
+            unix_error("timerfd read error");
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int n = tick_take_inputs(inputs);
+        player_batch_begin(); // everything the tick sends goes out once per player at the end
+        player_view_batch_begin(); // and each view is computed once, after all the inputs
+        for (int i = 0; i < n; i++) {
+            tick_apply(&inputs[i]);
+        }
+        int views = player_view_batch_end();
+        player_batch_end();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        unsigned long ns = elapsed_ns(&start, &end);
+        pthread_mutex_lock(&queue.lock);
+        stats.ticks++;
+        stats.overruns += expirations - 1;
+        stats.inputs += n;
+        stats.views += views;
+        stats.tick_ns_total += ns;
+        if (ns > stats.tick_ns_max) stats.tick_ns_max = ns;
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return NULL;
+}
+
+void tick_init(int hz) {
+    if (hz < 1) hz = 1;
+    if (hz > TICK_MAX_HZ) hz = TICK_MAX_HZ;
+    if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+        unix_error("timerfd_create error");
+    }
+    long period_ns = 1000000000L / hz;
+    struct itimerspec its = {
+        .it_interval = {period_ns / 1000000000L, period_ns % 1000000000L},
+        .it_value = {period_ns / 1000000000L, period_ns % 1000000000L}
+    };
+    if (timerfd_settime(timerfd, 0, &its, NULL) < 0) {
+        unix_error("timerfd_settime error");
+    }
+    pthread_mutex_init(&queue.lock, NULL);
+    queue.cap = TICK_AVATARS * TICK_MAX_PLAYER_INPUTS;
+    queue.buf = Malloc(queue.cap * sizeof *queue.buf);
+    queue.head = queue.count = 0;
+    memset(queue.queued, 0, sizeof queue.queued);
+    memset(queue.refresh, 0, sizeof queue.refresh);
+    memset(&stats, 0, sizeof stats);
+    stats.hz = hz;
+    tick_hz = hz;
+    Pthread_create(&tick_tid, NULL, tick_thread, NULL);
+    debug("Simulation ticks at %d Hz", hz);
+}
+
+int tick_enabled(void) {
+    return tick_hz != 0;
+}
+
+void tick_submit(PLAYER *player, int type, int param) {
+    int a = player_get_avatar(player) - 'A';
+    pthread_mutex_lock(&queue.lock);
+    if (type == MZW_REFRESH_PKT && queue.refresh[a]) { // the one queued does the same
+        stats.coalesced++;
+        pthread_mutex_unlock(&queue.lock);
+        return;
+    }
+    if (queue.queued[a] == TICK_MAX_PLAYER_INPUTS) { // a client sending faster than the ticks take its inputs
+        stats.dropped++;
+        pthread_mutex_unlock(&queue.lock);
+        return;
+    }
+    if (queue.count == queue.cap) { // reclaim the space of inputs already taken, the limits leave some
+        memmove(queue.buf, queue.buf + queue.head, (queue.count - queue.head) * sizeof *queue.buf);
+        queue.count -= queue.head;
+        queue.head = 0;
+    }
+    queue.queued[a]++;
+    if (type == MZW_REFRESH_PKT) queue.refresh[a] = 1;
+    queue.buf[queue.count++] = (TICK_INPUT){.player = player_ref(player, "tick_submit"), .type = type, .param = param};
+    pthread_mutex_unlock(&queue.lock);
+}
+
+void tick_get_stats(TICK_STATS *st) {
+    pthread_mutex_lock(&queue.lock);
+    *st = stats;
+    pthread_mutex_unlock(&queue.lock);
+}
+
+void tick_report(void) {
+    if (!tick_enabled()) return;
+    TICK_STATS st;
+    tick_get_stats(&st);
+    info("Ticks: %lu at %d Hz, %lu overruns, %lu inputs (%lu carried over, peak %d queued, %lu dropped, "
+         "%lu coalesced), %lu views, avg tick %lu ns, max %lu ns",
+         st.ticks, st.hz, st.overruns, st.inputs, st.carried, st.peak_queued, st.dropped, st.coalesced, st.views,
+         st.ticks ? st.tick_ns_total / st.ticks : 0, st.tick_ns_max);
+}
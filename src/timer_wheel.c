@@ -0,0 +1,252 @@
+#include "timer_wheel.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_MAX_DELTA ((1ULL << (TW_LEVEL_BITS * TW_LEVELS)) - 1) // furthest a timer can be placed from the current tick
+
+static struct {
+    TW_TIMER *slots[TW_LEVELS][TW_SLOTS];
+    uint64_t current; // last tick whose timers have been fired
+    struct timespec start; // tick zero
+    long tick_ns;
+    TW_TIMER *running; // timer whose function is being called, NULL if none
+    int started;
+    int stop;
+    pthread_t tid;
+    pthread_mutex_t lock; // protects everything above and the statistics
+    pthread_cond_t wake; // signalled when a timer is added or the thread should stop
+    pthread_cond_t done; // broadcast whenever a timer function returns
+    TW_STATS stats;
+} wheel;
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long elapsed_ns(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+// Number of whole ticks elapsed since the wheel started
+static uint64_t tw_now_tick(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)elapsed_ns(&wheel.start, &now) / wheel.tick_ns;
+}
+
+// Place a timer in the slot matching how far its expiry is from the current tick
+static void tw_enqueue_locked(TW_TIMER *t) {
+    if (t->expires < wheel.current) t->expires = wheel.current;
+    uint64_t delta = t->expires - wheel.current;
+    if (delta > TW_MAX_DELTA) {
+        t->expires = wheel.current + TW_MAX_DELTA; // fires early rather than wrapping; about 46 hours at 10 ms
+        delta = TW_MAX_DELTA;
+    }
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= 1ULL << (TW_LEVEL_BITS * (level + 1))) {
+        level++;
+    }
+    TW_TIMER **slot = &wheel.slots[level][(t->expires >> (TW_LEVEL_BITS * level)) & TW_MASK];
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void tw_unlink_locked(TW_TIMER *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+// Move the timers of one slot of a coarser wheel down into finer ones, return the slot index
+static int tw_cascade_locked(int level) {
+    int index = (wheel.current >> (TW_LEVEL_BITS * level)) & TW_MASK;
+    TW_TIMER *t = wheel.slots[level][index];
+    wheel.slots[level][index] = NULL;
+    while (t) {
+        TW_TIMER *next = t->next;
+        tw_enqueue_locked(t);
+        wheel.stats.cascaded++;
+        t = next;
+    }
+    return index;
+}
+
+// Advance one tick, cascading as the finer wheels wrap, and fire what is due
+static void tw_tick_locked(void) {
+    wheel.current++;
+    if ((wheel.current & TW_MASK) == 0) { // each coarser wheel is cascaded when the one below it wraps
+        for (int level = 1; level < TW_LEVELS && tw_cascade_locked(level) == 0; level++)
+            ;
+    }
+    TW_TIMER **slot = &wheel.slots[0][wheel.current & TW_MASK];
+    TW_TIMER *t;
+    while ((t = *slot) != NULL) { // one at a time, a timer further down may be cancelled while unlocked
+        tw_unlink_locked(t);
+        wheel.stats.pending--;
+        wheel.running = t;
+        pthread_mutex_unlock(&wheel.lock);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long late = elapsed_ns(&t->due, &now);
+        t->fn(t->arg);
+        pthread_mutex_lock(&wheel.lock);
+        wheel.running = NULL;
+        wheel.stats.fired++;
+        if (late > 0) {
+            wheel.stats.late_ns_total += late;
+            if ((unsigned long)late > wheel.stats.late_ns_max) wheel.stats.late_ns_max = late;
+        }
+        pthread_cond_broadcast(&wheel.done);
+    }
+}
+
+static void *tw_thread(void *arg) {
+    sigset_t mask; // timer functions run with no signals to interrupt them
+    Sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    pthread_mutex_lock(&wheel.lock);
+    while (!wheel.stop) {
+        if (wheel.stats.pending == 0) { // nothing to advance for, sleep until a timer is added
+            pthread_cond_wait(&wheel.wake, &wheel.lock);
+            continue;
+        }
+        uint64_t now = tw_now_tick();
+        while (wheel.current < now && wheel.stats.pending > 0) {
+            tw_tick_locked();
+        }
+        if (wheel.stats.pending == 0) {
+            wheel.current = now; // nothing left that could be skipped over
+            continue;
+        }
+        long ns = (wheel.current + 1) * wheel.tick_ns; // start of the next tick
+        struct timespec next = wheel.start;
+        next.tv_sec += ns / 1000000000L;
+        next.tv_nsec += ns % 1000000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wheel.wake, &wheel.lock, &next);
+    }
+    pthread_mutex_unlock(&wheel.lock);
+    return NULL;
+}
+
+void tw_init(int tick_ms) {
+    pthread_mutex_lock(&init_lock);
+    if (wheel.started) {
+        pthread_mutex_unlock(&init_lock);
+        return;
+    }
+    memset(wheel.slots, 0, sizeof wheel.slots);
+    memset(&wheel.stats, 0, sizeof wheel.stats);
+    wheel.tick_ns = (tick_ms > 0 ? tick_ms : TW_TICK_MS) * 1000000L;
+    wheel.current = 0;
+    wheel.running = NULL;
+    wheel.stop = 0;
+    clock_gettime(CLOCK_MONOTONIC, &wheel.start);
+    pthread_mutex_init(&wheel.lock, NULL);
+    pthread_condattr_t attr; // timed waits are against CLOCK_MONOTONIC, like the tick arithmetic
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&wheel.done, NULL);
+    Pthread_create(&wheel.tid, NULL, tw_thread, NULL);
+    wheel.started = 1;
+    debug("Timer wheel started with %ld ms ticks", wheel.tick_ns / 1000000L);
+    pthread_mutex_unlock(&init_lock);
+}
+
+void tw_fini(void) {
+    pthread_mutex_lock(&init_lock);
+    if (!wheel.started) {
+        pthread_mutex_unlock(&init_lock);
+        return;
+    }
+    pthread_mutex_lock(&wheel.lock);
+    wheel.stop = 1;
+    pthread_cond_signal(&wheel.wake);
+    pthread_mutex_unlock(&wheel.lock);
+    Pthread_join(wheel.tid, NULL);
+    pthread_cond_destroy(&wheel.done);
+    pthread_cond_destroy(&wheel.wake);
+    pthread_mutex_destroy(&wheel.lock);
+    wheel.started = 0;
+    pthread_mutex_unlock(&init_lock);
+}
+
+void tw_timer_init(TW_TIMER *timer, void (*fn)(void *), void *arg) {
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->expires = 0;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void tw_add(TW_TIMER *timer, unsigned long delay_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timer->due = now;
+    timer->due.tv_sec += delay_ms / 1000;
+    timer->due.tv_nsec += (delay_ms % 1000) * 1000000L;
+    if (timer->due.tv_nsec >= 1000000000L) {
+        timer->due.tv_sec++;
+        timer->due.tv_nsec -= 1000000000L;
+    }
+    // first tick that starts at or after the due time
+    uint64_t due_ns = elapsed_ns(&wheel.start, &timer->due);
+    pthread_mutex_lock(&wheel.lock);
+    if (wheel.stats.pending == 0 && !wheel.running) {
+        wheel.current = tw_now_tick(); // the thread was idle and has not kept up, nothing is skipped
+    }
+    timer->expires = (due_ns + wheel.tick_ns - 1) / wheel.tick_ns;
+    if (timer->expires <= wheel.current) timer->expires = wheel.current + 1; // the current tick has already fired
+    tw_enqueue_locked(timer);
+    wheel.stats.added++;
+    wheel.stats.pending++;
+    pthread_cond_signal(&wheel.wake);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+int tw_cancel(TW_TIMER *timer) {
+    int rc = -1;
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->pprev) {
+        tw_unlink_locked(timer);
+        wheel.stats.pending--;
+        wheel.stats.cancelled++;
+        rc = 0;
+    } else {
+        while (wheel.running == timer) { // let the function finish with its argument
+            pthread_cond_wait(&wheel.done, &wheel.lock);
+        }
+    }
+    pthread_mutex_unlock(&wheel.lock);
+    return rc;
+}
+
+int tw_pending(TW_TIMER *timer) {
+    pthread_mutex_lock(&wheel.lock);
+    int pending = timer->pprev != NULL;
+    pthread_mutex_unlock(&wheel.lock);
+    return pending;
+}
+
+void tw_get_stats(TW_STATS *stats) {
+    pthread_mutex_lock(&wheel.lock);
+    *stats = wheel.stats;
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+void tw_report(void) {
+    if (!wheel.started) return;
+    TW_STATS st;
+    tw_get_stats(&st);
+    info("Timer wheel: %lu added, %lu fired, %lu cancelled, %lu cascaded, %lu pending, "
+         "avg lateness %lu ns, max %lu ns",
+         st.added, st.fired, st.cancelled, st.cascaded, st.pending,
+         st.fired ? st.late_ns_total / st.fired : 0, st.late_ns_max);
+}
@@ -0,0 +1,245 @@
+#include "uring.h"
+#include "csapp.h"
+#include "debug.h"
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#define URING_STOP (~0ULL) // user_data of the NOP that tells the reaper to exit
+
+// An operation in flight, lives on the stack of the thread waiting for it
+typedef struct uring_req {
+    sem_t done; // posted by the reaper when the completion arrives
+    int res; // result of the operation, or negative errno
+} UREQ;
+
+static struct {
+    int fd; // io_uring instance
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned cq_mask;
+    unsigned *sq_head; // advanced by the kernel as it consumes submissions
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail; // advanced by the kernel as it posts completions
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_len;
+    size_t cq_map_len;
+    unsigned sq_local_tail; // next free submission slot
+    int flushing; // a thread is submitting the ring on behalf of all others
+    pthread_mutex_t sq_lock; // protects the submission side
+    pthread_cond_t sq_space; // signalled when a flush has drained the ring
+    pthread_mutex_t cq_lock; // protects the completion side, reaped by the reaper and by submitters
+    int stopped; // the reaper's NOP has completed
+    pthread_t reaper;
+} ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Submit everything queued in the ring, including entries added by other threads while we are in the kernel
+static void uring_flush_locked(void) {
+    unsigned pending;
+    ring.flushing = 1;
+    while ((pending = ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)) > 0) {
+        pthread_mutex_unlock(&ring.sq_lock);
+        int rc = sys_io_uring_enter(pending, 0, 0);
+        pthread_mutex_lock(&ring.sq_lock);
+        // EAGAIN/EBUSY mean the completion side is backed up, the reaper will make room
+        if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            unix_error("io_uring_enter error");
+        }
+    }
+    ring.flushing = 0;
+    pthread_cond_broadcast(&ring.sq_space);
+}
+
+static void uring_submit(struct io_uring_sqe *sqe) {
+    pthread_mutex_lock(&ring.sq_lock);
+    while (ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) {
+        if (ring.flushing) {
+            pthread_cond_wait(&ring.sq_space, &ring.sq_lock);
+        } else {
+            uring_flush_locked();
+        }
+    }
+    unsigned idx = ring.sq_local_tail & ring.sq_mask;
+    ring.sqes[idx] = *sqe;
+    ring.sq_array[idx] = idx;
+    ring.sq_local_tail++;
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    if (!ring.flushing) { // otherwise the thread already flushing picks this entry up
+        uring_flush_locked();
+    }
+    pthread_mutex_unlock(&ring.sq_lock);
+}
+
+// Hand out every completion posted so far to the thread waiting for it
+static void uring_reap(void) {
+    pthread_mutex_lock(&ring.cq_lock);
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+        if (cqe->user_data == URING_STOP) {
+            ring.stopped = 1;
+        } else if (cqe->user_data) { // cancellations carry no request
+            UREQ *req = (UREQ *)(uintptr_t)cqe->user_data;
+            req->res = cqe->res;
+            sem_post(&req->done); // req may be gone as soon as this returns
+        }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ring.cq_lock);
+}
+
+// Wait for an operation to complete, optionally giving up if a signal arrives.  Operations the kernel
+// finished while they were submitted, as socket writes usually are, are reaped here and then, without
+// waking the reaper's thread and then this one.
+static int uring_wait(UREQ *req, int interruptible) {
+    uring_reap();
+    while (sem_wait(&req->done) < 0) {
+        if (errno != EINTR) unix_error("sem_wait error");
+        if (interruptible) return -1;
+    }
+    return 0;
+}
+
+static void *uring_reaper(void *arg) {
+    sigset_t mask; // signals are for the threads waiting on operations, not for us
+    Sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    // Only operations still in progress once submitted, such as reads waiting for a client, are left to us
+    while (!ring.stopped) {
+        if (sys_io_uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EBUSY) {
+            unix_error("io_uring_enter error");
+        }
+        uring_reap();
+    }
+    return NULL;
+}
+
+int uring_init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    if ((ring.fd = sys_io_uring_setup(entries, &p)) < 0) {
+        return -1;
+    }
+    ring.sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0; // both rings in one mapping
+    if (single_mmap) {
+        if (ring.cq_map_len > ring.sq_map_len) ring.sq_map_len = ring.cq_map_len;
+        ring.cq_map_len = ring.sq_map_len;
+    }
+    ring.sq_map = mmap(NULL, ring.sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_map = single_mmap ? ring.sq_map :
+                  mmap(NULL, ring.cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sq_map == MAP_FAILED || ring.cq_map == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        int err = errno;
+        close(ring.fd);
+        errno = err;
+        return -1;
+    }
+    char *sq = ring.sq_map;
+    char *cq = ring.cq_map;
+    ring.sq_entries = p.sq_entries;
+    ring.sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.flushing = 0;
+    ring.stopped = 0;
+    pthread_mutex_init(&ring.sq_lock, NULL);
+    pthread_mutex_init(&ring.cq_lock, NULL);
+    pthread_cond_init(&ring.sq_space, NULL);
+    Pthread_create(&ring.reaper, NULL, uring_reaper, NULL);
+    debug("io_uring ready with %u entries", ring.sq_entries);
+    return 0;
+}
+
+void uring_fini(void) {
+    struct io_uring_sqe stop = {0};
+    stop.opcode = IORING_OP_NOP;
+    stop.user_data = URING_STOP;
+    uring_submit(&stop);
+    Pthread_join(ring.reaper, NULL);
+    munmap(ring.sqes, ring.sq_entries * sizeof(struct io_uring_sqe));
+    if (ring.cq_map != ring.sq_map) munmap(ring.cq_map, ring.cq_map_len);
+    munmap(ring.sq_map, ring.sq_map_len);
+    close(ring.fd);
+    pthread_cond_destroy(&ring.sq_space);
+    pthread_mutex_destroy(&ring.sq_lock);
+    pthread_mutex_destroy(&ring.cq_lock);
+}
+
+ssize_t uring_read(int fd, void *buf, size_t n) {
+    UREQ req;
+    Sem_init(&req.done, 0, 0);
+    struct io_uring_sqe sqe = {0};
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = (uintptr_t)buf;
+    sqe.len = n;
+    sqe.off = (uint64_t)-1; // current file position, as read() would use
+    sqe.user_data = (uintptr_t)&req;
+    uring_submit(&sqe);
+    if (uring_wait(&req, 1) < 0) {
+        // Interrupted: cancel the read, but it may complete with data before the cancel takes effect
+        struct io_uring_sqe cancel = {0};
+        cancel.opcode = IORING_OP_ASYNC_CANCEL;
+        cancel.fd = -1;
+        cancel.addr = (uintptr_t)&req;
+        uring_submit(&cancel);
+        uring_wait(&req, 0); // buf must not be released until the kernel is done with it
+        if (req.res == -ECANCELED || req.res == -EINTR) {
+            sem_destroy(&req.done);
+            errno = EINTR;
+            return -1;
+        }
+    }
+    sem_destroy(&req.done);
+    if (req.res < 0) {
+        errno = -req.res;
+        return -1;
+    }
+    return req.res;
+}
+
+ssize_t uring_writev(int fd, const struct iovec *iov, int iovcnt) {
+    UREQ req;
+    Sem_init(&req.done, 0, 0);
+    struct io_uring_sqe sqe = {0};
+    sqe.opcode = IORING_OP_WRITEV;
+    sqe.fd = fd;
+    sqe.addr = (uintptr_t)iov;
+    sqe.len = iovcnt;
+    sqe.off = (uint64_t)-1;
+    sqe.user_data = (uintptr_t)&req;
+    uring_submit(&sqe);
+    uring_wait(&req, 0);
+    sem_destroy(&req.done);
+    if (req.res < 0) {
+        errno = -req.res;
+        return -1;
+    }
+    return req.res;
+}
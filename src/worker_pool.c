@@ -0,0 +1,222 @@
+#include "worker_pool.h"
+#include "server.h"
+#include "csapp.h"
+#include "debug.h"
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct wp_item { // a connection waiting for a worker
+    int connfd;
+    struct timespec queued;
+} WP_ITEM;
+
+typedef struct wp_slice WP_SLICE;
+
+typedef struct wp_worker {
+    pthread_t tid;
+    WP_SLICE *slice;
+    struct timespec busy_since; // when its current connection was taken, zero if idle
+} WP_WORKER;
+
+// A share of the workers with its own bounded admission queue, after CSAPP's sbuf
+struct wp_slice {
+    WP_ITEM *buf;
+    int n; // capacity
+    int front; // buf[(front+1)%n] is the first item
+    int rear; // buf[rear%n] is the last item
+    sem_t slots; // available slots
+    sem_t items; // available items
+    pthread_mutex_t lock; // protects buf and the statistics below
+    int started; // workers have been created
+    int nworkers;
+    WP_WORKER *workers;
+    WP_STATS stats; // workers, busy, queued and their peaks, counters
+    unsigned long busy_ns; // time spent serving connections that have finished
+};
+
+static WP_SLICE *slices;
+static int num_slices;
+static size_t worker_stack_size; // zero for the system default
+static struct timespec started;
+
+static unsigned long elapsed_ns(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+// P() that is not ended by signals, a stray one must not make an idle worker quit
+static void sem_wait_noeintr(sem_t *sem) {
+    while (sem_wait(sem) < 0) {
+        if (errno != EINTR) unix_error("sem_wait error");
+    }
+}
+
+static void *wp_worker(void *arg) {
+    WP_WORKER *self = arg;
+    WP_SLICE *s = self->slice;
+    sigset_t mask; // leave SIGHUP to the main thread, terminate() waits for connections to drain
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    while (1) {
+        sem_wait_noeintr(&s->items);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&s->lock);
+        WP_ITEM item = s->buf[(++s->front) % s->n];
+        unsigned long wait = elapsed_ns(&item.queued, &now);
+        s->stats.queued--;
+        s->stats.served++;
+        s->stats.wait_ns_total += wait;
+        if (wait > s->stats.wait_ns_max) s->stats.wait_ns_max = wait;
+        if (++s->stats.busy > s->stats.peak_busy) s->stats.peak_busy = s->stats.busy;
+        self->busy_since = now;
+        pthread_mutex_unlock(&s->lock);
+        V(&s->slots);
+        mzw_serve_client(item.connfd);
+        struct timespec done;
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        pthread_mutex_lock(&s->lock);
+        s->stats.busy--;
+        s->busy_ns += elapsed_ns(&now, &done);
+        self->busy_since.tv_sec = self->busy_since.tv_nsec = 0;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+void wp_init(int nworkers, size_t stack_size, int queue_size, int nslices) {
+    if (nslices < 1) nslices = 1;
+    if (nworkers < nslices) nworkers = nslices; // every slice needs a worker
+    if (stack_size && stack_size < PTHREAD_STACK_MIN) stack_size = PTHREAD_STACK_MIN;
+    worker_stack_size = stack_size;
+    slices = Calloc(nslices, sizeof(WP_SLICE));
+    for (int i = 0; i < nslices; i++) {
+        WP_SLICE *s = &slices[i];
+        s->nworkers = nworkers / nslices + (i < nworkers % nslices); // the first slices take the remainder
+        s->n = queue_size < 1 ? WP_QUEUE_PER_WORKER * s->nworkers : (queue_size + nslices - 1) / nslices;
+        s->buf = Calloc(s->n, sizeof(WP_ITEM));
+        s->front = s->rear = 0;
+        Sem_init(&s->slots, 0, s->n);
+        Sem_init(&s->items, 0, 0);
+        pthread_mutex_init(&s->lock, NULL);
+        s->workers = Calloc(s->nworkers, sizeof(WP_WORKER));
+        s->stats.workers = s->nworkers;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    num_slices = nslices;
+    debug("Worker pool of %d workers in %d slices", nworkers, nslices);
+}
+
+int wp_enabled(void) {
+    return num_slices > 0;
+}
+
+void wp_start(int slice) {
+    WP_SLICE *s = &slices[slice % num_slices];
+    pthread_mutex_lock(&s->lock);
+    if (s->started) { // e.g. the main accept loop and an AF_UNIX listener both use slice 0
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    s->started = 1;
+    pthread_mutex_unlock(&s->lock);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (worker_stack_size) {
+        int rc = pthread_attr_setstacksize(&attr, worker_stack_size);
+        if (rc) posix_error(rc, "pthread_attr_setstacksize error");
+    }
+    for (int i = 0; i < s->nworkers; i++) {
+        s->workers[i].slice = s;
+        Pthread_create(&s->workers[i].tid, &attr, wp_worker, &s->workers[i]);
+    }
+    pthread_attr_destroy(&attr);
+    debug("Started slice %d: %d workers, admission queue of %d", (int)(s - slices), s->nworkers, s->n);
+}
+
+void wp_submit(int slice, int connfd) {
+    WP_SLICE *s = &slices[slice % num_slices];
+    if (sem_trywait(&s->slots) < 0) { // queue full, the accepting thread waits for a worker
+        pthread_mutex_lock(&s->lock);
+        s->stats.full_waits++;
+        pthread_mutex_unlock(&s->lock);
+        sem_wait_noeintr(&s->slots);
+    }
+    pthread_mutex_lock(&s->lock);
+    WP_ITEM *item = &s->buf[(++s->rear) % s->n];
+    item->connfd = connfd;
+    clock_gettime(CLOCK_MONOTONIC, &item->queued);
+    if (++s->stats.queued > s->stats.peak_queued) s->stats.peak_queued = s->stats.queued;
+    pthread_mutex_unlock(&s->lock);
+    V(&s->items);
+}
+
+// Statistics of one slice as of now, and the time its workers have spent serving
+static void wp_slice_stats(WP_SLICE *s, WP_STATS *sp, struct timespec *now, unsigned long *busyp) {
+    pthread_mutex_lock(&s->lock);
+    *sp = s->stats;
+    unsigned long total = s->busy_ns;
+    for (int i = 0; i < s->nworkers; i++) { // connections still being served count up to now
+        struct timespec *since = &s->workers[i].busy_since;
+        if (since->tv_sec || since->tv_nsec) total += elapsed_ns(since, now);
+    }
+    pthread_mutex_unlock(&s->lock);
+    double capacity = (double)elapsed_ns(&started, now) * (s->nworkers ? s->nworkers : 1);
+    sp->utilization = capacity > 0 ? total / capacity : 0;
+    *busyp = total;
+}
+
+int wp_get_slice_stats(int slice, WP_STATS *sp) {
+    if (slice < 0 || slice >= num_slices) return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long busy;
+    wp_slice_stats(&slices[slice], sp, &now, &busy);
+    return 0;
+}
+
+void wp_get_stats(WP_STATS *sp) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(sp, 0, sizeof *sp);
+    unsigned long total = 0;
+    for (int i = 0; i < num_slices; i++) {
+        WP_STATS st;
+        unsigned long busy;
+        wp_slice_stats(&slices[i], &st, &now, &busy);
+        total += busy;
+        sp->workers += st.workers;
+        sp->busy += st.busy;
+        sp->peak_busy += st.peak_busy;
+        sp->queued += st.queued;
+        sp->peak_queued += st.peak_queued;
+        sp->served += st.served;
+        sp->full_waits += st.full_waits;
+        sp->wait_ns_total += st.wait_ns_total;
+        if (st.wait_ns_max > sp->wait_ns_max) sp->wait_ns_max = st.wait_ns_max;
+    }
+    double capacity = (double)elapsed_ns(&started, &now) * (sp->workers ? sp->workers : 1);
+    sp->utilization = capacity > 0 ? total / capacity : 0;
+}
+
+static void wp_log(const char *what, WP_STATS *st) {
+    info("%s: %d workers, %lu served, peak busy %d, utilization %.1f%%, peak queued %d, "
+         "avg queue wait %lu ns, max %lu ns, %lu submissions waited for room",
+         what, st->workers, st->served, st->peak_busy, 100.0 * st->utilization, st->peak_queued,
+         st->served ? st->wait_ns_total / st->served : 0, st->wait_ns_max, st->full_waits);
+}
+
+void wp_report(void) {
+    if (!wp_enabled()) return;
+    WP_STATS st;
+    wp_get_stats(&st);
+    wp_log("Worker pool", &st);
+    if (num_slices == 1) return;
+    for (int i = 0; i < num_slices; i++) {
+        char what[32];
+        snprintf(what, sizeof what, "Worker slice %d", i);
+        wp_get_slice_stats(i, &st);
+        wp_log(what, &st);
+    }
+}
@@ -176,6 +176,28 @@ Test(maze_suite, remove_test, .init = init_empty, .timeout = 5) {
     cr_assert_eq(ret, exp, "Expected %d, was %d", exp, ret);
 }
 
+// Fill the maze with random placements, then check that the only free cell is the one picked.
+Test(maze_suite, set_player_random_test, .init = init_empty, .timeout = 5) {
+#ifdef NO_MAZE
+    cr_assert_fail("Maze module was not implemented");
+#endif
+    int seen[5][10] = {{0}};
+    int row, col;
+    for(int i = 0; i < 50; i++) {
+	cr_assert_eq(maze_set_player_random('A' + i % 26, &row, &col), 0, "Placement %d failed", i);
+	cr_assert(row >= 0 && row < 5 && col >= 0 && col < 10, "Placed out of bounds at (%d, %d)", row, col);
+	cr_assert_eq(seen[row][col], 0, "Placed twice at (%d, %d)", row, col);
+	seen[row][col] = 1;
+    }
+    int ret = maze_set_player_random('Z', &row, &col);
+    cr_assert_neq(ret, 0, "Placed in a full maze at (%d, %d)", row, col);
+    OBJECT a = maze_find_target(2, 3, NORTH); // whatever avatar is at (1, 3)
+    maze_remove_player(a, 1, 3);
+    cr_assert_eq(maze_move(2, 3, NORTH), 0, "Could not move into the hole");
+    cr_assert_eq(maze_set_player_random('Z', &row, &col), 0, "Could not place in the last free cell");
+    cr_assert(row == 2 && col == 3, "Expected (2, 3), was (%d, %d)", row, col);
+}
+
 Test(maze_suite, find_target_test_1, .init = init_empty, .timeout = 5) {
 #ifdef NO_MAZE
     cr_assert_fail("Maze module was not implemented");
@@ -459,3 +481,174 @@ Test(data_suite, random_motion_test, .init = init_empty, .timeout = 10) {
     cr_assert(ap0->row == 0 && ap0->col == 0,
 	      "Actual final position of avatar did not match calculated position");
 }
+
+static volatile int shuttle_done;
+
+// Move an avatar back and forth between two cells until told to stop
+static void *shuttle_thread(void *arg) {
+    int col = 4;
+    while(!shuttle_done) {
+	int dir = (col == 4 ? EAST : WEST);
+	if(!maze_move(2, col, dir))
+	    col += col_incs[dir];
+    }
+    maze_remove_player('B', 2, col);
+    return NULL;
+}
+
+// Watch an avatar being moved back and forth, return the number of times it was not seen
+static int watch_shuttle() {
+    maze_set_player('A', 2, 0);
+    maze_set_player('B', 2, 4);
+    pthread_t tid;
+    shuttle_done = 0;
+    pthread_create(&tid, NULL, shuttle_thread, NULL);
+    int missed = 0;
+    for(int i = 0; i < NITER; i++) {
+	if(maze_find_target(2, 0, EAST) != 'B')
+	    missed++;
+    }
+    shuttle_done = 1;
+    pthread_join(tid, NULL);
+    return missed;
+}
+
+/*
+ * A move empties the source cell and fills the destination, but queries
+ * running alongside it must see the avatar in one cell or the other, never
+ * in neither.
+ */
+Test(data_suite, find_target_concurrent_move, .init = init_empty, .timeout = 10) {
+#ifdef NO_MAZE
+    cr_assert_fail("Maze module was not implemented");
+#endif
+    int missed = watch_shuttle();
+    cr_assert_eq(missed, 0, "The moving avatar was missed %d times", missed);
+}
+
+static void init_empty_small_tiles() {
+    maze_set_tile_size(2);
+    maze_init(empty_maze);
+}
+
+static void fini_small_tiles() {
+    maze_fini();
+    maze_set_tile_size(MAZE_TILE_WHOLE);
+}
+
+static int walkers_done;
+
+static void *tiled_motion_thread(void *arg) {
+    random_motion(arg);
+    __atomic_fetch_add(&walkers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Place four avatars in the corners of the maze and have a thread move each
+ * of them at random.  While they run, snapshots of the maze are checked:
+ * every avatar must be in exactly one cell and no other cell may be occupied,
+ * so that no move ever shows an avatar twice, or not at all.  Then each
+ * avatar must be where the thread moving it thinks it is.
+ */
+static void run_walkers(struct random_motion_args args[4]) {
+    pthread_t tid[4];
+    for(int i = 0; i < 4; i++) {
+	struct random_motion_args *ap = &args[i];
+	*ap = (struct random_motion_args){.avatar = 'A' + i, .row = (i < 2 ? 0 : 4),
+					  .col = (i % 2 == 0 ? 0 : 9), .iters = NITER / 4};
+	cr_assert_eq(maze_set_player(ap->avatar, ap->row, ap->col), 0, "Could not place avatar %c", ap->avatar);
+    }
+    walkers_done = 0;
+    for(int i = 0; i < 4; i++)
+	pthread_create(&tid[i], NULL, tiled_motion_thread, &args[i]);
+    int ncells = maze_get_rows() * maze_get_cols();
+    OBJECT snap[ncells];
+    int samples = 0, bad = 0, done, seen[4];
+    do { // sample at least once after the walkers are done
+	done = __atomic_load_n(&walkers_done, __ATOMIC_ACQUIRE) == 4;
+	maze_snapshot(snap);
+	samples++;
+	int stray = 0;
+	for(int i = 0; i < 4; i++)
+	    seen[i] = 0;
+	for(int i = 0; i < ncells; i++) {
+	    if(snap[i] >= 'A' && snap[i] < 'A' + 4)
+		seen[snap[i] - 'A']++;
+	    else if(!IS_EMPTY(snap[i]))
+		stray++;
+	}
+	if(stray || seen[0] != 1 || seen[1] != 1 || seen[2] != 1 || seen[3] != 1) {
+	    if(!bad++)
+		fprintf(stderr, "Sample %d: A x%d, B x%d, C x%d, D x%d, %d stray\n",
+			samples, seen[0], seen[1], seen[2], seen[3], stray);
+	}
+    } while(!done);
+    for(int i = 0; i < 4; i++)
+	pthread_join(tid[i], NULL);
+    cr_assert_eq(bad, 0, "%d of %d snapshots lost or duplicated an avatar", bad, samples);
+    // Removing an avatar from where it is and putting it back succeeds only if it was there.
+    for(int i = 0; i < 4; i++) {
+	struct random_motion_args *ap = &args[i];
+	maze_remove_player(ap->avatar, ap->row, ap->col);
+	cr_assert_eq(maze_set_player(ap->avatar, ap->row, ap->col), 0,
+		     "Avatar %c was not at (%d, %d)", ap->avatar, ap->row, ap->col);
+    }
+}
+
+/*
+ * With tiles of 2x2 cells, most moves cross from one tile to another.
+ */
+Test(data_suite, small_tiles_motion_test, .init = init_empty_small_tiles, .fini = fini_small_tiles,
+     .timeout = 10) {
+#ifdef NO_MAZE
+    cr_assert_fail("Maze module was not implemented");
+#endif
+    struct random_motion_args args[4];
+    run_walkers(args);
+}
+
+static void init_empty_lock_free() {
+    maze_set_lock_free(1);
+    maze_set_tile_size(2);
+    maze_init(empty_maze);
+}
+
+static void fini_lock_free() {
+    maze_fini();
+    maze_set_lock_free(0);
+    maze_set_tile_size(MAZE_TILE_WHOLE);
+}
+
+/*
+ * The walkers again, with moves made by compare-and-swap.  Afterwards every
+ * other cell must be free, for placement as well.
+ */
+Test(data_suite, lock_free_motion_test, .init = init_empty_lock_free, .fini = fini_lock_free,
+     .timeout = 10) {
+#ifdef NO_MAZE
+    cr_assert_fail("Maze module was not implemented");
+#endif
+    struct random_motion_args args[4];
+    run_walkers(args);
+    for(int i = 0; i < 4; i++)
+	maze_remove_player(args[i].avatar, args[i].row, args[i].col);
+    for(int row = 0; row < maze_get_rows(); row++) {
+	for(int col = 0; col < maze_get_cols(); col++) {
+	    cr_assert_eq(maze_set_player('Z', row, col), 0, "Cell (%d, %d) was left occupied", row, col);
+	    maze_remove_player('Z', row, col);
+	}
+    }
+    int row, col; // and random placement must know every cell is free
+    for(int i = 0; i < 50; i++)
+	cr_assert_eq(maze_set_player_random('Z', &row, &col), 0, "Placement %d failed", i);
+    cr_assert_neq(maze_set_player_random('Z', &row, &col), 0, "Placed in a full maze");
+}
+
+Test(data_suite, lock_free_find_target, .init = init_empty_lock_free, .fini = fini_lock_free, .timeout = 10) {
+#ifdef NO_MAZE
+    cr_assert_fail("Maze module was not implemented");
+#endif
+    int missed = watch_shuttle();
+    cr_assert_eq(missed, 0, "The moving avatar was missed %d times", missed);
+}
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
 
 #include "debug.h"
 #include "protocol.h"
@@ -214,7 +215,7 @@ void move_player_to_boundary(PLAYER *pp) {
     }
 }
 
-Test(player_suite, fire_laser_hit, .init = init_null, .signal = SIGUSR1, .timeout = 5) {
+Test(player_suite, fire_laser_hit, .init = init_null, .timeout = 5) {
 #ifdef NO_PLAYER
     cr_assert_fail("Player module was not implemented");
 #endif
@@ -231,13 +232,19 @@ Test(player_suite, fire_laser_hit, .init = init_null, .signal = SIGUSR1, .timeou
     turn_player_to_face(bob, WEST);
     // Bob should now be gazing at Alice.
     // Firing his laser should now result in a hit.
-    // Reset SIGUSR1 handling to default before doing this.
+    // The hit is posted to Alice's mailbox, no signal is sent:
+    // with SIGUSR1 at its default disposition one would kill the test.
     struct sigaction sact;
     sact.sa_handler = SIG_DFL;
     sigemptyset(&sact.sa_mask);
     sact.sa_flags = 0;
     sigaction(SIGUSR1, &sact, NULL);
     player_fire_laser(bob);
+    struct pollfd pfd = {.fd = player_get_eventfd(alice), .events = POLLIN};
+    cr_assert_eq(poll(&pfd, 1, 0), 1, "Expected Alice's event fd to be readable");
+    cr_assert(player_has_events(alice), "Expected a pending event for Alice");
+    cr_assert_eq(player_take_laser_hit(alice), 1, "Expected Alice to have been hit");
+    cr_assert(!player_has_events(alice), "Expected the mailbox to be empty");
 }
 
 Test(player_suite, fire_laser_miss, .init = init_null, .timeout = 5) {
@@ -342,6 +349,70 @@ Test(player_suite, move_check_view, .init = init_file, .timeout = 5) {
     }
 }
 
+/*
+ * As move_check_view, for a client that asked for packed views: the view is
+ * rebuilt from VIEW packets alone, each of which stands for a CLEAR and
+ * SHOW packets or for several SHOW packets.
+ */
+#define PACKED_FILE "test_output/packed_packet.out"
+
+static int calculate_packed_view(char *name, VIEW *view, int *views) {
+    int fd = open(name, O_RDONLY);
+    cr_assert(fd >= 0, "Open file failed");
+    MZW_PACKET pkt;
+    void *payload;
+    int depth = 0;
+    *views = 0;
+    while(!proto_recv_packet(fd, &pkt, &payload)) {
+	cr_assert(pkt.type != MZW_CLEAR_PKT && pkt.type != MZW_SHOW_PKT, "CLEAR or SHOW sent with packed views");
+	if(pkt.type == MZW_VIEW_PKT) {
+	    depth = proto_apply_view(&(*view)[0][0], EMPTY, &pkt, payload);
+	    cr_assert(depth >= 0, "Malformed VIEW packet");
+	    (*views)++;
+	}
+	if(payload)
+	    free(payload);
+    }
+    close(fd);
+    return depth;
+}
+
+Test(player_suite, packed_view_check_view, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    int fd = open(PACKED_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0777);
+    cr_assert(fd >= 0, "Open failed");
+    maze_init(default_maze);
+    player_init();
+    PLAYER *pp = player_login(fd, 'J', "Jo");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    player_set_packed_views(pp);
+    player_reset(pp);
+    char displayed_view[VIEW_DEPTH][VIEW_WIDTH];
+    char actual_view[VIEW_DEPTH][VIEW_WIDTH];
+    unsigned int seed = 1;
+    int row, col, dir, depth, views = 0;
+    for(int i = 0; i < 100; i++) {
+	if(rand_r(&seed) % 3)
+	    player_rotate(pp, rand_r(&seed) % 2 ? -1 : 1);
+	else
+	    player_move(pp, rand_r(&seed) % 2 ? -1 : 1);
+	player_get_location(pp, &row, &col, &dir);
+	depth = maze_get_view(&actual_view, row, col, dir, VIEW_DEPTH);
+	int shown = calculate_packed_view(PACKED_FILE, &displayed_view, &views);
+	cr_assert_eq(shown, depth, "Displayed depth %d, actual %d", shown, depth);
+	cr_assert_eq(compare_view(&displayed_view, &actual_view, depth), 0,
+		     "Inferred display view does not match actual view");
+    }
+    PLAYER_VIEW_STATS st;
+    player_get_view_stats(&st);
+    cr_assert_eq(st.updates, views, "Expected %d VIEW packets counted, got %lu", views, st.updates);
+    cr_assert(st.show_packets > st.updates, "Packed views saved nothing (%lu VIEW, %lu CLEAR and SHOW)",
+	      st.updates, st.show_packets);
+    close(fd);
+}
+
 /*
  * Concurrency stress test:
  * Threads that repeatedly runs login/reset/logout, then terminates.
@@ -402,3 +473,474 @@ Test(player_suite, login_logout_stress, .init = init_null, .timeout = 20) {
     // The test is deemed successful if it completes without crashing, deadlocking,
     // or having any of the logins fail along the way.
 }
+
+/*
+ * With an outbound queue, packets sent to a player are written by the
+ * player's writer thread, in order, and are all flushed by logout.
+ */
+#define QUEUE_FILE "test_output/queued_packet.out"
+
+Test(player_suite, queued_send_flush, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    int fd = open(QUEUE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    cr_assert(fd >= 0, "Open failed");
+    maze_init(empty_maze);
+    player_init();
+    player_set_queue_depth(64);
+    PLAYER *pp = player_login(fd, 'Q', "Quinn");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    MZW_PACKET pkt = {0};
+    pkt.type = MZW_CHAT_PKT;
+    pkt.size = 4;
+    for(int i = 0; i < 32; i++)
+	cr_assert_eq(player_send_packet(pp, &pkt, "ping"), 0, "Send %d was refused", i);
+    PLAYER_QUEUE_STATS stats;
+    cr_assert_eq(player_get_queue_stats(pp, &stats), 0, "Expected an outbound queue");
+    cr_assert_eq(stats.enqueued, 32, "Expected 32 packets queued, got %lu", stats.enqueued);
+    player_ref(pp, "queued_send_flush");
+    player_logout(pp);
+    player_get_queue_stats(pp, &stats);
+    cr_assert_eq(stats.depth, 0, "Queue was not drained at logout");
+    cr_assert_eq(stats.sent, 32, "Expected 32 packets sent, got %lu", stats.sent);
+    cr_assert_eq(player_send_packet(pp, &pkt, "ping"), -1, "Send after logout was accepted");
+    player_unref(pp, "queued_send_flush");
+    close(fd);
+    FILE *f = fopen(QUEUE_FILE, "r");
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    cr_assert_eq(size, 32 * (sizeof(MZW_PACKET) + 4), "Unexpected output size %ld", size);
+}
+
+/*
+ * What a batch has buffered for a queued player who then logs out goes
+ * into the queue before it is drained, rather than after it is closed.
+ */
+Test(player_suite, queued_batch_flush_at_logout, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    player_set_queue_depth(8);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    PLAYER *pp = player_login(sv[0], 'L', "Leaving");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    player_set_queue_depth(0);
+    player_set_batch_frames(pp);
+    player_batch_begin();
+    MZW_PACKET pkt = {.type = MZW_SCORE_PKT, .param1 = 'L'};
+    for(int i = 0; i < 2; i++)
+	cr_assert_eq(player_send_packet(pp, &pkt, NULL), 0, "Score %d was refused", i);
+    player_logout(pp); // the batch still holds a reference
+    player_batch_end();
+    MZW_PACKET rcv;
+    void *payload;
+    cr_assert_eq(proto_recv_packet(sv[1], &rcv, &payload), 0, "The batched output was lost");
+    cr_assert_eq(rcv.type, MZW_BATCH_PKT, "Expected a BATCH, got type %d", rcv.type);
+    free(payload);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Logging out a queued player whose client has stopped reading does not
+ * wait for the client for good: the rest of the queue is dropped.
+ */
+Test(player_suite, queued_logout_unread_client, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    player_set_queue_depth(64);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    shutdown(sv[1], SHUT_WR); // half-closed, and never read
+    char junk[4096] = {0};
+    while(send(sv[0], junk, sizeof(junk), MSG_DONTWAIT) > 0)
+	; // fill the socket, so the writer blocks
+    PLAYER *pp = player_login(sv[0], 'U', "Unread");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    player_set_queue_depth(0);
+    MZW_PACKET chat = {.type = MZW_CHAT_PKT, .size = 1000};
+    char text[1000] = {0};
+    for(int i = 0; i < 8; i++)
+	cr_assert_eq(player_send_packet(pp, &chat, text), 0, "CHAT %d was not queued", i);
+    player_leave(pp);
+    player_close(pp);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+// Read packets in version 1 up to READY, then expect the one after it in version 2
+static void expect_chats_around_ready(int fd, char *before, char *after) {
+    MZW_PACKET pkt;
+    void *payload;
+    int chats = 0;
+    while(1) {
+	cr_assert_eq(proto_recv_packet(fd, &pkt, &payload), 0, "Failed to receive up to READY");
+	if(pkt.type == MZW_READY_PKT)
+	    break;
+	if(pkt.type == MZW_CHAT_PKT) {
+	    cr_assert(pkt.size == strlen(before) && !memcmp(payload, before, pkt.size), "Garbled CHAT before READY");
+	    chats++;
+	}
+	if(payload)
+	    free(payload);
+    }
+    cr_assert_eq(chats, 1, "The CHAT sent before READY did not precede it");
+    proto_set_version(fd, PROTO_VERSION_2);
+    cr_assert_eq(proto_recv_packet(fd, &pkt, &payload), 0, "Failed to receive after READY");
+    cr_assert(pkt.type == MZW_CHAT_PKT && pkt.size == strlen(after) && !memcmp(payload, after, pkt.size),
+	      "Expected the CHAT sent after READY in version 2, got type %d", pkt.type);
+    free(payload);
+    proto_set_version(fd, PROTO_VERSION_1);
+}
+
+/*
+ * Output another thread's batch has buffered for a player goes out in
+ * version 1 ahead of READY, not behind it.
+ */
+Test(player_suite, ready_after_batched_output, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    PLAYER *pp = player_login(sv[0], 'R', "Ready");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    MZW_PACKET chat = {.type = MZW_CHAT_PKT, .size = 6};
+    player_batch_begin();
+    cr_assert_eq(player_send_packet(pp, &chat, "before"), 0, "CHAT was refused");
+    MZW_PACKET ready = {.type = MZW_READY_PKT, .param3 = PROTO_VERSION_2};
+    cr_assert_eq(player_send_ready(pp, &ready, PROTO_VERSION_2), 0, "READY was refused");
+    player_batch_end();
+    chat.size = 5;
+    cr_assert_eq(player_send_packet(pp, &chat, "after"), 0, "CHAT was refused");
+    expect_chats_around_ready(sv[1], "before", "after");
+    player_logout(pp);
+    proto_set_version(sv[0], PROTO_VERSION_1);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * A packet queued for a player before READY is written in version 1, even
+ * when the writer only gets to it after READY has been queued.
+ */
+Test(player_suite, queued_ready_after_queued_output, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    player_set_queue_depth(8);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    char junk[4096] = {0};
+    ssize_t n;
+    size_t filled = 0;
+    while((n = send(sv[0], junk, sizeof(junk), MSG_DONTWAIT)) > 0)
+	filled += n; // so the writer is held up until the client reads
+    PLAYER *pp = player_login(sv[0], 'R', "Ready");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    player_set_queue_depth(0);
+    MZW_PACKET chat = {.type = MZW_CHAT_PKT, .size = 6};
+    cr_assert_eq(player_send_packet(pp, &chat, "before"), 0, "CHAT was refused");
+    MZW_PACKET ready = {.type = MZW_READY_PKT, .param3 = PROTO_VERSION_2};
+    cr_assert_eq(player_send_ready(pp, &ready, PROTO_VERSION_2), 0, "READY was refused");
+    chat.size = 5;
+    cr_assert_eq(player_send_packet(pp, &chat, "after"), 0, "CHAT was refused");
+    while(filled > 0 && (n = read(sv[1], junk, filled < sizeof(junk) ? filled : sizeof(junk))) > 0)
+	filled -= n;
+    expect_chats_around_ready(sv[1], "before", "after");
+    player_logout(pp);
+    proto_set_version(sv[0], PROTO_VERSION_1);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void *plain_logout_thread(void *arg) {
+    player_logout(arg);
+    return NULL;
+}
+
+/*
+ * The SCORE packets of a logout are written without holding up logins,
+ * even when one of the other players is not reading, but the avatar of
+ * the player leaving is not given out until they have been written.
+ */
+Test(player_suite, logout_broadcast_does_not_block_login, .init = init_null, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    int stuck[2], leaving[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, stuck), 0, "Failed to create sockets");
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, leaving), 0, "Failed to create sockets");
+    char junk[4096] = {0};
+    while(send(stuck[0], junk, sizeof(junk), MSG_DONTWAIT) > 0)
+	; // fill the socket of a player who never reads
+    PLAYER *sp = player_login(stuck[0], 'S', "Stuck");
+    PLAYER *lp = player_login(leaving[0], 'L', "Leaving");
+    cr_assert(sp && lp, "Expected non-NULL pointers");
+    pthread_t tid;
+    pthread_create(&tid, NULL, plain_logout_thread, lp);
+    usleep(100000); // let the logout block writing to the stuck player
+    PLAYER *np = player_login(nullfd, 'L', "Newcomer");
+    cr_assert_not_null(np, "Login was held up by the logout");
+    cr_assert_neq(player_get_avatar(np), 'L', "The avatar was given out before the SCORE packets were sent");
+    close(stuck[1]); // the blocked write fails, and the logout goes on
+    pthread_join(tid, NULL);
+    player_logout(np);
+    player_logout(sp);
+    close(stuck[0]);
+    close(leaving[0]);
+    close(leaving[1]);
+}
+
+/*
+ * A broadcast reaches every player once, whether its packets are written
+ * directly or through an outbound queue.
+ */
+Test(player_suite, broadcast_shared_frame, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    int sv[3][2];
+    PLAYER *pp[3];
+    for(int i = 0; i < 3; i++) {
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]), 0, "Failed to create sockets");
+	player_set_queue_depth(i == 2 ? 8 : 0); // the last one has a writer thread
+	pp[i] = player_login(sv[i][0], 'A' + i, "Broadcast");
+	cr_assert_not_null(pp[i], "Expected non-NULL pointer");
+    }
+    player_set_queue_depth(0);
+    PLAYER_BROADCAST_STATS before, after;
+    player_get_broadcast_stats(&before);
+    MZW_PACKET pkt = {.type = MZW_CHAT_PKT, .size = 9};
+    struct iovec iov[2] = {{"[A] ", 4}, {"hello", 5}};
+    cr_assert_eq(player_broadcast(&pkt, iov, 2), 3, "Expected 3 recipients");
+    player_get_broadcast_stats(&after);
+    cr_assert_eq(after.broadcasts - before.broadcasts, 1, "Expected one broadcast");
+    cr_assert_eq(after.deliveries - before.deliveries, 3, "Expected three deliveries");
+    for(int i = 0; i < 3; i++) {
+	MZW_PACKET rcv;
+	void *payload;
+	cr_assert_eq(proto_recv_packet(sv[i][1], &rcv, &payload), 0, "Player %d received nothing", i);
+	cr_assert(rcv.type == MZW_CHAT_PKT && rcv.size == 9, "Player %d got the wrong header", i);
+	cr_assert_eq(memcmp(payload, "[A] hello", 9), 0, "Player %d got the wrong payload", i);
+	free(payload);
+    }
+    for(int i = 0; i < 3; i++) {
+	player_logout(pp[i]);
+	close(sv[i][0]);
+	close(sv[i][1]);
+    }
+}
+
+/*
+ * A BATCH never wraps more than its 16-bit size field can hold: what is
+ * batched goes out before a packet that would not fit, and a packet too
+ * large for any BATCH is sent on its own.
+ */
+Test(player_suite, batch_frame_size_limit, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    int bufsize = 1 << 18;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof bufsize);
+    PLAYER *pp = player_login(sv[0], 'B', "Batcher");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    player_set_batch_frames(pp);
+    size_t big = 65500;
+    char *chat = calloc(1, big);
+    player_batch_begin();
+    MZW_PACKET pkt = {.type = MZW_SCORE_PKT, .param1 = 'B'};
+    for(int i = 0; i < 10; i++)
+	cr_assert_eq(player_send_packet(pp, &pkt, NULL), 0, "Score %d was refused", i);
+    pkt = (MZW_PACKET){.type = MZW_CHAT_PKT, .size = big};
+    cr_assert_eq(player_send_packet(pp, &pkt, chat), 0, "Chat was refused");
+    player_batch_end();
+    MZW_PACKET rcv;
+    void *payload;
+    cr_assert_eq(proto_recv_packet(sv[1], &rcv, &payload), 0, "Nothing received");
+    cr_assert_eq(rcv.type, MZW_BATCH_PKT, "Expected the scores in a BATCH, got type %d", rcv.type);
+    cr_assert_eq((uint8_t)rcv.param1, 10, "Expected 10 packets in the BATCH, got %d", (uint8_t)rcv.param1);
+    free(payload);
+    cr_assert_eq(proto_recv_packet(sv[1], &rcv, &payload), 0, "Chat not received");
+    cr_assert(rcv.type == MZW_CHAT_PKT && rcv.size == big, "Expected the chat unwrapped, got type %d size %d",
+	      rcv.type, rcv.size);
+    free(payload);
+    free(chat);
+    player_logout(pp);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Under the conflate policy, view packets for a client that is not
+ * reading are discarded once it is over the high watermark, other packets
+ * still go out, and it is caught up once it has read what was pending.
+ */
+Test(player_suite, slow_client_conflate, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    player_set_slow_policy(PLAYER_SLOW_CONFLATE, 4096, 1024);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    PLAYER *pp = player_login(sv[0], 'S', "Slow");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    MZW_PACKET show = {.type = MZW_SHOW_PKT, .param1 = '*'};
+    for(int i = 0; i < 1000; i++)
+	cr_assert_eq(player_send_packet(pp, &show, NULL), 0, "Send %d failed", i);
+    PLAYER_SLOW_STATS st;
+    player_get_slow_stats(&st);
+    cr_assert_eq(st.congested, 1, "Expected the client to be behind once, was %lu", st.congested);
+    cr_assert(st.conflated > 0 && st.conflated < 1000, "Expected some SHOW packets conflated, %lu were", st.conflated);
+    MZW_PACKET score = {.type = MZW_SCORE_PKT, .param1 = 'S', .param2 = 1};
+    cr_assert_eq(player_send_packet(pp, &score, NULL), 0, "SCORE was not sent");
+
+    // Read everything: the SHOW packets that got through, then the SCORE
+    MZW_PACKET pkt;
+    void *payload;
+    int shows = 0;
+    do {
+	cr_assert_eq(proto_recv_packet(sv[1], &pkt, &payload), 0, "Receive failed");
+	if(pkt.type == MZW_SHOW_PKT) shows++;
+    } while(pkt.type != MZW_SCORE_PKT);
+    cr_assert_eq(shows + st.conflated, 1000, "Expected %lu SHOW packets, got %d", 1000 - st.conflated, shows);
+    cr_assert_eq(player_send_packet(pp, &show, NULL), 0, "Send after catching up failed");
+    player_get_slow_stats(&st);
+    cr_assert_eq(st.recovered, 1, "Expected the client to have caught up");
+    player_set_slow_policy(PLAYER_SLOW_NONE, PLAYER_HIGH_WATERMARK, PLAYER_LOW_WATERMARK);
+    player_logout(pp);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * A high watermark above what the socket send buffer holds is lowered to
+ * fit it, so a client that is not reading is found to be behind before a
+ * send would block.
+ */
+Test(player_suite, slow_client_small_sndbuf, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(empty_maze);
+    player_init();
+    player_set_slow_policy(PLAYER_SLOW_DROP, 1 << 20, 1 << 18);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    int bufsize = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof bufsize);
+    PLAYER *pp = player_login(sv[0], 'S', "Small");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    PLAYER_SLOW_STATS before, after;
+    player_get_slow_stats(&before);
+    char msg[100] = {0};
+    MZW_PACKET chat = {.type = MZW_CHAT_PKT, .size = sizeof(msg)};
+    for(int i = 0; i < 10000; i++)
+	cr_assert_eq(player_send_packet(pp, &chat, msg), 0, "Send %d failed", i);
+    player_get_slow_stats(&after);
+    cr_assert_eq(after.congested - before.congested, 1, "Expected the client to be behind once");
+    cr_assert(after.dropped > before.dropped, "Expected packets to be dropped");
+    player_set_slow_policy(PLAYER_SLOW_NONE, PLAYER_HIGH_WATERMARK, PLAYER_LOW_WATERMARK);
+    close(sv[1]);
+    player_logout(pp);
+    close(sv[0]);
+}
+
+struct logout_args {
+    PLAYER *player;
+    int fd;
+};
+
+// Log out, then close the connection for writing, so that the client reads to EOF once the queue is drained
+static void *logout_thread(void *arg) {
+    struct logout_args *ap = arg;
+    player_logout(ap->player);
+    shutdown(ap->fd, SHUT_WR);
+    return NULL;
+}
+
+/*
+ * A client whose writer thread is stuck behind a full socket is sent only
+ * the newest of the views produced meanwhile, as changes from the last
+ * one it was sent, and ends up seeing the current view.
+ */
+Test(player_suite, queued_view_conflation, .timeout = 5) {
+#ifdef NO_PLAYER
+    cr_assert_fail("Player module was not implemented");
+#endif
+    maze_init(default_maze);
+    player_init();
+    player_set_queue_depth(64);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    PLAYER *pp = player_login(sv[0], 'C', "Conflated");
+    cr_assert_not_null(pp, "Expected non-NULL pointer");
+    player_set_queue_depth(0);
+    player_set_packed_views(pp);
+    player_reset(pp);
+    MZW_PACKET chat = {.type = MZW_CHAT_PKT, .size = 1000};
+    char text[1000] = {0};
+    for(int i = 0; i < 32; i++) // far more than the socket holds, so the writer blocks
+	cr_assert_eq(player_send_packet(pp, &chat, text), 0, "CHAT %d was not queued", i);
+    unsigned int seed = 1;
+    for(int i = 0; i < 100; i++) {
+	if(rand_r(&seed) % 3)
+	    player_rotate(pp, rand_r(&seed) % 2 ? -1 : 1);
+	else
+	    player_move(pp, rand_r(&seed) % 2 ? -1 : 1);
+    }
+    char actual_view[VIEW_DEPTH][VIEW_WIDTH];
+    int row, col, dir;
+    player_get_location(pp, &row, &col, &dir);
+    int depth = maze_get_view(&actual_view, row, col, dir, VIEW_DEPTH);
+
+    player_ref(pp, "queued_view_conflation");
+    pthread_t tid;
+    struct logout_args args = {.player = pp, .fd = sv[0]};
+    pthread_create(&tid, NULL, logout_thread, &args);
+    char displayed_view[VIEW_DEPTH][VIEW_WIDTH];
+    int shown = -1, views = 0;
+    MZW_PACKET pkt;
+    void *payload;
+    while(proto_recv_packet(sv[1], &pkt, &payload) == 0) { // until EOF, after the logout has drained the queue
+	if(pkt.type == MZW_VIEW_PKT) {
+	    shown = proto_apply_view(&displayed_view[0][0], EMPTY, &pkt, payload);
+	    cr_assert(shown >= 0, "Malformed VIEW packet");
+	    views++;
+	}
+	if(payload)
+	    free(payload);
+    }
+    pthread_join(tid, NULL);
+    cr_assert_eq(shown, depth, "Displayed depth %d, actual %d", shown, depth);
+    cr_assert_eq(compare_view(&displayed_view, &actual_view, depth), 0,
+		 "Displayed view does not match actual view");
+    PLAYER_VIEW_STATS st;
+    player_get_view_stats(&st);
+    cr_assert(st.conflated > 0 && views < 100, "Expected views to be conflated, %d of them were sent", views);
+    player_unref(pp, "queued_view_conflation");
+    close(sv[0]);
+    close(sv[1]);
+}
@@ -64,6 +64,33 @@ Test(protocol_suite, send_with_payload, .init = init, .timeout = 5) {
     cr_assert_eq(ret, 0, "Packet sent did not match expected");
 }
 
+Test(protocol_suite, send_gathered_payload, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+
+    int fd;
+    struct iovec iov[3] = {{"0123", 4}, {"", 0}, {"45678901234", 11}};
+    MZW_PACKET pkt = {0};
+
+    pkt.type = MZW_CHAT_PKT;
+    pkt.param1 = 0101;
+    pkt.param2 = 0202;
+    pkt.param3 = 0303;
+    pkt.size = 0xf;
+    pkt.timestamp_sec = 0x11223344;
+    pkt.timestamp_nsec = 0x55667788;
+
+    fd = open("test_output/pkt_gathered_payload", O_CREAT|O_TRUNC|O_RDWR, 0644);
+    cr_assert(fd > 0, "Failed to create output file");
+    int ret = proto_send_packetv(fd, &pkt, iov, 3);
+    cr_assert_eq(ret, 0, "Returned value was %d not 0", ret);
+    close(fd);
+
+    ret = system("cmp test_output/pkt_gathered_payload tests/rsrc/pkt_with_payload");
+    cr_assert_eq(ret, 0, "Packet sent did not match expected");
+}
+
 Test(protocol_suite, send_error, .init = init, .timeout = 5) {
 #ifdef NO_PROTOCOL
     cr_assert_fail("Protocol was not implemented");
@@ -152,6 +179,85 @@ Test(protocol_suite, recv_with_payload, .init = init, .timeout = 5) {
     cr_assert_eq(n, 0, "Received message payload did not match expected");
 }
 
+Test(protocol_suite, recv_buffered_pipelined, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+    rio_t rio;
+    void *payload = NULL;
+    MZW_PACKET pkt = {0};
+
+    int ret = system("cat tests/rsrc/pkt_with_payload tests/rsrc/pkt_no_payload"
+		     " tests/rsrc/pkt_with_payload > test_output/pkt_pipelined");
+    cr_assert_eq(ret, 0, "Failed to create test input file");
+    int fd = open("test_output/pkt_pipelined", O_RDONLY, 0);
+    cr_assert(fd > 0, "Failed to open test input file");
+    rio_readinitb(&rio, fd);
+
+    ret = proto_recv_packetb(&rio, &pkt, &payload);
+    cr_assert_eq(ret, 0, "Returned value was not 0");
+    cr_assert_eq(pkt.type, MZW_CHAT_PKT, "Received packet type %d did not match expected %d",
+		 pkt.type, MZW_CHAT_PKT);
+    cr_assert_eq(pkt.size, 0xf, "Received payload size was %u not %u", pkt.size, 0xf);
+    cr_assert_eq(strncmp(payload, "0123456789012345", 0xf), 0,
+		 "Received message payload did not match expected");
+    cr_assert_eq(rio.rio_cnt, 2 * sizeof(MZW_PACKET) + 0xf,
+		 "Packets were not all taken in by the first read");
+
+    ret = proto_recv_packetb(&rio, &pkt, &payload);
+    cr_assert_eq(ret, 0, "Returned value was not 0");
+    cr_assert_eq(pkt.type, MZW_READY_PKT, "Received packet type %d did not match expected %d",
+		 pkt.type, MZW_READY_PKT);
+    cr_assert_null(payload, "Expected no payload");
+
+    ret = proto_recv_packetb(&rio, &pkt, &payload);
+    cr_assert_eq(ret, 0, "Returned value was not 0");
+    cr_assert_eq(pkt.timestamp_nsec, 0x55667788,
+		 "Received message timestamp_nsec 0x%x did not match expected 0x%x",
+		 pkt.timestamp_nsec, 0x55667788);
+    cr_assert_eq(strncmp(payload, "0123456789012345", 0xf), 0,
+		 "Received message payload did not match expected");
+
+    ret = proto_recv_packetb(&rio, &pkt, &payload);
+    cr_assert_neq(ret, 0, "Returned value was 0 at end of file");
+    close(fd);
+}
+
+/*
+ * Payloads larger than the reader's buffer go in storage kept for the
+ * thread, which can be released between connections and is taken again
+ * for the next large payload.
+ */
+Test(protocol_suite, recv_buffered_oversize, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+    static char big[2 * RIO_BUFSIZE];
+    for(size_t i = 0; i < sizeof(big); i++)
+	big[i] = 'a' + i % 26;
+    MZW_PACKET out = {.type = MZW_CHAT_PKT, .size = sizeof(big)};
+    int fd = open("test_output/pkt_oversize", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    cr_assert(fd > 0, "Failed to create test input file");
+    cr_assert_eq(proto_send_packet(fd, &out, big), 0, "Failed to write the packet");
+    cr_assert_eq(proto_send_packet(fd, &out, big), 0, "Failed to write the packet");
+    close(fd);
+
+    fd = open("test_output/pkt_oversize", O_RDONLY, 0);
+    cr_assert(fd > 0, "Failed to open test input file");
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    for(int i = 0; i < 2; i++) {
+	MZW_PACKET pkt = {0};
+	void *payload = NULL;
+	int ret = proto_recv_packetb(&rio, &pkt, &payload);
+	cr_assert_eq(ret, 0, "Returned value was not 0 for packet %d", i);
+	cr_assert_eq(pkt.size, sizeof(big), "Received payload size was %u not %zu", pkt.size, sizeof(big));
+	cr_assert_eq(memcmp(payload, big, sizeof(big)), 0, "Payload %d did not match", i);
+	proto_recv_release();
+    }
+    close(fd);
+}
+
 Test(protocol_suite, recv_empty, .init = init, .timeout = 5) {
 #ifdef NO_PROTOCOL
     cr_assert_fail("Protocol was not implemented");
@@ -221,3 +327,263 @@ Test(protocol_suite, recv_error, .init = init, .timeout = 5) {
     int ret = proto_recv_packet(fd, &pkt, &payload);
     cr_assert_neq(ret, 0, "Returned value was zero");
 }
+
+Test(protocol_suite, seq_wraparound, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+    cr_assert(proto_seq_after(2, 1), "Expected 2 to be after 1");
+    cr_assert(!proto_seq_after(1, 2), "Expected 1 not to be after 2");
+    cr_assert(!proto_seq_after(7, 7), "Expected 7 not to be after itself");
+    cr_assert(proto_seq_after(3, 0xfffffffe), "Expected 3 to be after 0xfffffffe across the wrap");
+    cr_assert(!proto_seq_after(0xfffffffe, 3), "Expected 0xfffffffe not to be after 3");
+}
+
+/*
+ * Send numbered datagrams over loopback, simulating loss by skipping every
+ * third one and reordering by sending some pairs the wrong way round.
+ * Only datagrams newer than everything received before them should be
+ * accepted, with their payload intact.
+ */
+Test(protocol_suite, datagram_loss_and_reorder, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+    int rfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int sfd = socket(AF_INET, SOCK_DGRAM, 0);
+    cr_assert(rfd >= 0 && sfd >= 0, "Failed to create sockets");
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof addr;
+    cr_assert_eq(bind(rfd, (struct sockaddr *)&addr, len), 0, "Failed to bind receiver");
+    cr_assert_eq(getsockname(rfd, (struct sockaddr *)&addr, &len), 0, "Failed to get receiver address");
+
+    uint32_t order[] = {1, 2, 4, 5, 8, 7, 10, 11, 13, 14, 14, 16};
+    int expect[] =     {1, 1, 1, 1, 1, 0,  1,  1,  1,  1,  0,  1};
+    int n = sizeof order / sizeof order[0];
+    for (int i = 0; i < n; i++) {
+	char payload[8];
+	snprintf(payload, sizeof payload, "v%u", order[i]);
+	MZW_PACKET pkt = {.type = MZW_VIEW_PKT, .param1 = order[i], .size = strlen(payload)};
+	struct iovec iov = {payload, pkt.size};
+	int ret = proto_send_datagram(sfd, (struct sockaddr *)&addr, len, order[i], &pkt, &iov, 1);
+	cr_assert_eq(ret, 0, "Sending datagram %u failed", order[i]);
+    }
+
+    PROTO_SEQ seq = {0};
+    char buf[PROTO_MAX_DATAGRAM];
+    for (int i = 0; i < n; i++) {
+	MZW_PACKET pkt;
+	void *payload;
+	int ret = proto_recv_datagram(rfd, &seq, buf, &pkt, &payload);
+	cr_assert_eq(ret, expect[i], "Datagram %u: returned %d, expected %d", order[i], ret, expect[i]);
+	if (ret == 1) {
+	    char want[8];
+	    snprintf(want, sizeof want, "v%u", order[i]);
+	    cr_assert_eq(pkt.type, MZW_VIEW_PKT, "Received packet type %d was not VIEW", pkt.type);
+	    cr_assert_eq(pkt.param1, (int8_t)order[i], "Received param1 %d, expected %u", pkt.param1, order[i]);
+	    cr_assert_eq(pkt.size, strlen(want), "Received payload size %u, expected %zu", pkt.size, strlen(want));
+	    cr_assert_eq(strncmp(payload, want, pkt.size), 0, "Payload of datagram %u did not match", order[i]);
+	}
+    }
+    cr_assert_eq(seq.last, 16, "Expected last sequence number 16, was %u", seq.last);
+    cr_assert_eq(seq.accepted, 10, "Expected 10 accepted, was %lu", seq.accepted);
+    cr_assert_eq(seq.stale, 2, "Expected 2 stale, was %lu", seq.stale);
+    cr_assert_eq(seq.missed, 6, "Expected 6 missed, was %lu", seq.missed);
+    close(sfd);
+    close(rfd);
+}
+
+Test(protocol_suite, view_delta_round_trip, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+    char old_cells[MZW_VIEW_MAX_DEPTH * MZW_VIEW_WIDTH];
+    char new_cells[MZW_VIEW_MAX_DEPTH * MZW_VIEW_WIDTH];
+    char shown[MZW_VIEW_MAX_DEPTH * MZW_VIEW_WIDTH];
+    char buf[(MZW_VIEW_MAX_DEPTH * MZW_VIEW_WIDTH + 7) / 8 + MZW_VIEW_MAX_DEPTH * MZW_VIEW_WIDTH];
+    int depth = 5;
+    memset(old_cells, '*', sizeof old_cells);
+    memcpy(new_cells, old_cells, sizeof new_cells);
+
+    cr_assert_eq(proto_pack_view_delta(buf, old_cells, new_cells, depth), 0,
+		 "Expected no payload for an unchanged view");
+
+    // A full view, then a delta changing two cells, one in the last byte of the mask
+    MZW_PACKET pkt = {.type = MZW_VIEW_PKT, .param1 = depth, .param2 = MZW_VIEW_FULL,
+		      .size = depth * MZW_VIEW_WIDTH};
+    memset(shown, '?', sizeof shown);
+    cr_assert_eq(proto_apply_view(shown, ' ', &pkt, old_cells), depth, "Full view was not applied");
+    cr_assert_eq(shown[depth * MZW_VIEW_WIDTH], ' ', "Cells beyond the depth were not cleared");
+    new_cells[1] = 'A';
+    new_cells[14] = ' ';
+    size_t len = proto_pack_view_delta(buf, old_cells, new_cells, depth);
+    cr_assert_eq(len, 2 + 2, "Expected a 2 byte mask and 2 cells, got %zu bytes", len);
+    pkt.param2 = MZW_VIEW_DELTA;
+    pkt.size = len;
+    cr_assert_eq(proto_apply_view(shown, ' ', &pkt, buf), depth, "Delta was not applied");
+    cr_assert_eq(memcmp(shown, new_cells, depth * MZW_VIEW_WIDTH), 0, "View after delta did not match");
+
+    // Malformed: size not matching the mask, and a bit past the last cell
+    pkt.size = len - 1;
+    cr_assert_eq(proto_apply_view(shown, ' ', &pkt, buf), -1, "Short delta was accepted");
+    pkt.size = len + 1;
+    buf[1] |= 0x80;
+    cr_assert_eq(proto_apply_view(shown, ' ', &pkt, buf), -1, "Delta with a bit past the view was accepted");
+    cr_assert_eq(memcmp(shown, new_cells, depth * MZW_VIEW_WIDTH), 0, "Malformed delta changed the view");
+}
+
+/*
+ * Packets sent on a version 2 connection have compact headers, and are
+ * received intact by each of the receive functions.
+ */
+Test(protocol_suite, version2_round_trip, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    cr_assert_eq(proto_get_version(sv[0]), PROTO_VERSION_1, "Expected a new connection to be version 1");
+    cr_assert_eq(proto_set_version(sv[0], PROTO_VERSION_2), 0, "Failed to set version 2");
+    cr_assert_eq(proto_set_version(sv[1], PROTO_VERSION_2), 0, "Failed to set version 2");
+    cr_assert_neq(proto_set_version(sv[0], PROTO_VERSION_MAX + 1), 0, "Set an unknown version");
+
+    MZW_PACKET show = {.type = MZW_SHOW_PKT, .param1 = '*', .param2 = 2, .param3 = 15};
+    MZW_PACKET chat = {.type = MZW_CHAT_PKT, .param1 = -1, .size = 300,
+		       .timestamp_sec = 0x11223344, .timestamp_nsec = 0x55667788};
+    MZW_PACKET clear = {.type = MZW_CLEAR_PKT};
+    char text[300];
+    memset(text, 'x', sizeof text);
+    cr_assert_eq(proto_send_packet(sv[0], &show, NULL), 0, "Send failed");
+    cr_assert_eq(proto_send_packet(sv[0], &chat, text), 0, "Send failed");
+    cr_assert_eq(proto_send_packet(sv[0], &clear, NULL), 0, "Send failed");
+    cr_assert_eq(proto_send_packet(sv[0], &show, NULL), 0, "Send failed");
+    cr_assert_eq(proto_send_packet(sv[0], &clear, NULL), 0, "Send failed");
+
+    // flags, varint, 3 params; flags, 2 byte varint, 1 param, timestamp; flags, varint
+    char wire[5 + 12 + 300 + 2];
+    cr_assert_eq(recv(sv[1], wire, sizeof wire, MSG_WAITALL), sizeof wire, "Unexpected encoded length");
+    MZW_PACKET pkt;
+    void *payload;
+    cr_assert_eq(proto_parse_packet(sv[1], wire, 4, &pkt, &payload), 0, "Parsed an incomplete header");
+    cr_assert_eq(proto_parse_packet(sv[1], wire, sizeof wire, &pkt, &payload), 5, "SHOW was not 5 bytes");
+    cr_assert(pkt.type == MZW_SHOW_PKT && pkt.param1 == '*' && pkt.param2 == 2 && pkt.param3 == 15,
+	      "SHOW did not match");
+    cr_assert_eq(proto_parse_packet(sv[1], wire + 5, 12 + 299, &pkt, &payload), 0, "Parsed an incomplete payload");
+    cr_assert_eq(proto_parse_packet(sv[1], wire + 5, sizeof wire - 5, &pkt, &payload), 12 + 300,
+		 "CHAT was not 312 bytes");
+    cr_assert(pkt.type == MZW_CHAT_PKT && pkt.param1 == -1 && pkt.param2 == 0 && pkt.size == 300,
+	      "CHAT header did not match");
+    cr_assert(pkt.timestamp_sec == 0x11223344 && pkt.timestamp_nsec == 0x55667788, "Timestamp did not match");
+    cr_assert_eq(memcmp(payload, text, sizeof text), 0, "CHAT payload did not match");
+
+    // The SHOW and CLEAR not yet read, then the same packets again, through the blocking and buffered receives
+    cr_assert_eq(write(sv[0], wire, sizeof wire), sizeof wire, "Write failed");
+    cr_assert_eq(proto_send_packet(sv[0], &show, NULL), 0, "Send failed");
+    int types[] = {MZW_SHOW_PKT, MZW_CLEAR_PKT, MZW_SHOW_PKT, MZW_CHAT_PKT, MZW_CLEAR_PKT, MZW_SHOW_PKT};
+    for (int i = 0; i < 4; i++) {
+	cr_assert_eq(proto_recv_packet(sv[1], &pkt, &payload), 0, "Receive failed");
+	cr_assert_eq(pkt.type, types[i], "Packet type %d, expected %d", pkt.type, types[i]);
+	if (pkt.type == MZW_CHAT_PKT) {
+	    cr_assert(pkt.size == 300 && memcmp(payload, text, sizeof text) == 0, "CHAT did not match");
+	    free(payload);
+	}
+	if (pkt.type == MZW_SHOW_PKT)
+	    cr_assert(pkt.param3 == 15 && payload == NULL, "SHOW did not match");
+    }
+    rio_t rio;
+    rio_readinitb(&rio, sv[1]);
+    for (int i = 4; i < 6; i++) {
+	cr_assert_eq(proto_recv_packetb(&rio, &pkt, &payload), 0, "Buffered receive failed");
+	cr_assert_eq(pkt.type, types[i], "Packet type %d, expected %d", pkt.type, types[i]);
+    }
+    proto_set_version(sv[0], PROTO_VERSION_1);
+    proto_set_version(sv[1], PROTO_VERSION_1);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * The packets of a BATCH are taken out one at a time, in order, and a
+ * truncated or nested BATCH is rejected.
+ */
+Test(protocol_suite, batch_round_trip, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+    MZW_PACKET clear = {.type = MZW_CLEAR_PKT};
+    MZW_PACKET show = {.type = MZW_SHOW_PKT, .param1 = '*', .param2 = 1, .param3 = 3};
+    MZW_PACKET score = {.type = MZW_SCORE_PKT, .param1 = 'A', .param2 = 7, .size = 5};
+    struct iovec name = {"Alice", 5};
+    char buf[3 * sizeof(MZW_PACKET) + 5];
+    size_t len = proto_pack_packet(-1, buf, &clear, NULL, 0);
+    len += proto_pack_packet(-1, buf + len, &show, NULL, 0);
+    len += proto_pack_packet(-1, buf + len, &score, &name, 1);
+
+    MZW_PACKET pkt;
+    void *payload;
+    size_t off = 0;
+    int types[] = {MZW_CLEAR_PKT, MZW_SHOW_PKT, MZW_SCORE_PKT};
+    for (int i = 0; i < 3; i++) {
+	cr_assert_eq(proto_batch_next(-1, buf, len, &off, &pkt, &payload), 1, "Packet %d was not taken", i);
+	cr_assert_eq(pkt.type, types[i], "Packet type %d, expected %d", pkt.type, types[i]);
+    }
+    cr_assert(pkt.param2 == 7 && pkt.size == 5 && memcmp(payload, "Alice", 5) == 0, "SCORE did not match");
+    cr_assert_eq(proto_batch_next(-1, buf, len, &off, &pkt, &payload), 0, "Expected the end of the batch");
+
+    off = 0;
+    cr_assert_eq(proto_batch_next(-1, buf, len - 1, &off, &pkt, &payload), 1, "CLEAR was not taken");
+    cr_assert_eq(proto_batch_next(-1, buf, len - 1, &off, &pkt, &payload), 1, "SHOW was not taken");
+    cr_assert_eq(proto_batch_next(-1, buf, len - 1, &off, &pkt, &payload), -1, "Truncated SCORE was taken");
+    cr_assert_eq(errno, EBADMSG, "Expected EBADMSG, errno was %d", errno);
+
+    MZW_PACKET batch = {.type = MZW_BATCH_PKT, .param1 = 1};
+    len = proto_pack_packet(-1, buf, &batch, NULL, 0);
+    off = 0;
+    cr_assert_eq(proto_batch_next(-1, buf, len, &off, &pkt, &payload), -1, "Nested BATCH was taken");
+}
+
+/*
+ * A frame is encoded as a packet would be for each protocol version, and
+ * is received intact when sent.
+ */
+Test(protocol_suite, frame_round_trip, .init = init, .timeout = 5) {
+#ifdef NO_PROTOCOL
+    cr_assert_fail("Protocol was not implemented");
+#endif
+    MZW_PACKET chat = {.type = MZW_CHAT_PKT, .size = 10, .timestamp_sec = 12, .timestamp_nsec = 34};
+    struct iovec iov[2] = {{"[A] ", 4}, {"hello!", 6}};
+    PROTO_FRAME *frame = proto_frame_create(&chat, iov, 2);
+    proto_frame_ref(frame);
+
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create sockets");
+    char expected[sizeof(MZW_PACKET) + 10], packed[sizeof(MZW_PACKET) + 10];
+    size_t len = proto_pack_packet(sv[0], expected, &chat, iov, 2);
+    cr_assert_eq(proto_pack_frame(sv[0], packed, frame), len, "Version 1 frame length differs");
+    cr_assert_eq(memcmp(packed, expected, len), 0, "Version 1 frame differs from the packet");
+
+    proto_set_version(sv[0], PROTO_VERSION_2);
+    proto_set_version(sv[1], PROTO_VERSION_2);
+    MZW_PACKET unstamped = chat;
+    unstamped.timestamp_sec = unstamped.timestamp_nsec = 0;
+    len = proto_pack_packet(sv[0], expected, &unstamped, iov, 2);
+    cr_assert_eq(proto_pack_frame(sv[0], packed, frame), len, "Version 2 frame length differs");
+    cr_assert_eq(memcmp(packed, expected, len), 0, "Version 2 frame differs from the unstamped packet");
+
+    cr_assert_eq(proto_send_frame(sv[0], frame), 0, "Send failed");
+    proto_frame_unref(frame);
+    cr_assert_eq(proto_send_frame(sv[0], frame), 0, "Send with the last reference failed");
+    proto_frame_unref(frame);
+    for (int i = 0; i < 2; i++) {
+	MZW_PACKET pkt;
+	void *payload;
+	cr_assert_eq(proto_recv_packet(sv[1], &pkt, &payload), 0, "Receive failed");
+	cr_assert(pkt.type == MZW_CHAT_PKT && pkt.size == 10, "Header did not match");
+	cr_assert_eq(memcmp(payload, "[A] hello!", 10), 0, "Payload did not match");
+	free(payload);
+    }
+    proto_set_version(sv[0], PROTO_VERSION_1);
+    proto_set_version(sv[1], PROTO_VERSION_1);
+    close(sv[0]);
+    close(sv[1]);
+}
@@ -0,0 +1,118 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "debug.h"
+#include "timer_wheel.h"
+#include "excludes.h"
+
+/* Number of timers used in the ordering test. */
+#define NTIMER (200)
+
+/*
+ * A timer together with what the test expects of it.
+ */
+typedef struct {
+    TW_TIMER timer;
+    struct timespec added;
+    unsigned long delay_ms;
+    long fired_ms;    // Milliseconds after being added that the timer fired, -1 if not yet
+    int order;        // Position in the firing order
+} TEST_TIMER;
+
+static pthread_mutex_t fired_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fired_count;
+
+static long ms_since(struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000 + (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static void record_fire(void *arg) {
+    TEST_TIMER *t = arg;
+    pthread_mutex_lock(&fired_lock);
+    t->fired_ms = ms_since(&t->added);
+    t->order = fired_count++;
+    pthread_mutex_unlock(&fired_lock);
+}
+
+static void add_test_timer(TEST_TIMER *t, unsigned long delay_ms) {
+    tw_timer_init(&t->timer, record_fire, t);
+    t->delay_ms = delay_ms;
+    t->fired_ms = -1;
+    clock_gettime(CLOCK_MONOTONIC, &t->added);
+    tw_add(&t->timer, delay_ms);
+}
+
+static void wait_for_fired(int n, int timeout_ms) {
+    for(int waited = 0; waited < timeout_ms; waited += 5) {
+	pthread_mutex_lock(&fired_lock);
+	int done = fired_count >= n;
+	pthread_mutex_unlock(&fired_lock);
+	if(done)
+	    return;
+	usleep(5000);
+    }
+}
+
+Test(timer_wheel_suite, fires_once_not_early, .timeout = 5) {
+    tw_init(0);
+    TEST_TIMER t;
+    add_test_timer(&t, 50);
+    cr_assert(tw_pending(&t.timer), "Expected the timer to be pending");
+    wait_for_fired(1, 2000);
+    cr_assert_neq(t.fired_ms, -1, "The timer did not fire");
+    cr_assert(t.fired_ms >= 50, "The timer fired early (%ld ms)", t.fired_ms);
+    cr_assert(!tw_pending(&t.timer), "Expected the timer to be no longer pending");
+    usleep(100000);
+    cr_assert_eq(fired_count, 1, "The timer fired more than once");
+    TW_STATS st;
+    tw_get_stats(&st);
+    cr_assert_eq(st.fired, 1, "Expected 1 fired, was %lu", st.fired);
+    cr_assert_eq(st.pending, 0, "Expected 0 pending, was %lu", st.pending);
+}
+
+Test(timer_wheel_suite, cancel, .timeout = 5) {
+    tw_init(0);
+    TEST_TIMER t, u;
+    add_test_timer(&t, 100);
+    add_test_timer(&u, 50);
+    cr_assert_eq(tw_cancel(&t.timer), 0, "Expected a pending timer to be cancelled");
+    cr_assert_eq(tw_cancel(&t.timer), -1, "Expected a second cancel to fail");
+    wait_for_fired(1, 2000);
+    usleep(200000);
+    cr_assert_eq(t.fired_ms, -1, "The cancelled timer fired");
+    cr_assert_neq(u.fired_ms, -1, "The other timer did not fire");
+    cr_assert_eq(tw_cancel(&u.timer), -1, "Expected cancel of a fired timer to fail");
+    TW_STATS st;
+    tw_get_stats(&st);
+    cr_assert_eq(st.cancelled, 1, "Expected 1 cancelled, was %lu", st.cancelled);
+}
+
+/*
+ * With 1 ms ticks, delays of up to a second span the first two wheels,
+ * so this also checks that timers cascade from the coarser wheel in time.
+ */
+Test(timer_wheel_suite, order_and_cascade, .timeout = 10) {
+    tw_init(1);
+    static TEST_TIMER timers[NTIMER];
+    for(int i = 0; i < NTIMER; i++)
+	add_test_timer(&timers[i], (unsigned long)(NTIMER - i) * 5);
+    wait_for_fired(NTIMER, 5000);
+    cr_assert_eq(fired_count, NTIMER, "Expected %d timers to fire, %d did", NTIMER, fired_count);
+    for(int i = 0; i < NTIMER; i++) {
+	TEST_TIMER *t = &timers[i];
+	cr_assert(t->fired_ms >= (long)t->delay_ms, "Timer %d fired early (%ld < %lu ms)",
+		  i, t->fired_ms, t->delay_ms);
+	// Delays differ by several ticks, so the firing order is the reverse of the adding order.
+	cr_assert_eq(t->order, NTIMER - 1 - i, "Timer %d fired out of order (%d)", i, t->order);
+    }
+    TW_STATS st;
+    tw_get_stats(&st);
+    cr_assert(st.cascaded > 0, "Expected some timers to be cascaded");
+    cr_assert(st.late_ns_max < 500000000UL, "Timers fired too late (%lu ns)", st.late_ns_max);
+}